@@ -6,7 +6,19 @@
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/PrintLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/SynchronizationLib.h>
+#include <Library/IoLib.h>
+#include <Library/CpuExceptionHandlerLib.h>
 #include <Protocol/Cpu.h>
+#include <Protocol/MpService.h>
+#include <Protocol/LoadedImage.h>
+#include <Protocol/SimpleFileSystem.h>
+#include <Protocol/Shell.h>
+#include <Protocol/ShellParameters.h>
+
+#include "SafeProbe.h"
+#include "MemBench.h"
 
 //
 // ================================================
@@ -14,10 +26,49 @@
 // ================================================
 //
 
+#define MSR_IA32_TIME_STAMP_COUNTER  0x00000010
+#define MSR_IA32_APIC_BASE           0x0000001B
+#define MSR_IA32_FEATURE_CONTROL     0x0000003A
+#define MSR_IA32_BIOS_SIGN_ID        0x0000008B
+#define MSR_PLATFORM_INFO            0x000000CE
+#define MSR_IA32_MPERF               0x000000E7
+#define MSR_IA32_APERF               0x000000E8
+#define MSR_IA32_PERF_STATUS         0x00000198
+#define MSR_IA32_PERF_CTL            0x00000199
+#define MSR_IA32_THERM_STATUS        0x0000019C
+#define MSR_IA32_MISC_ENABLE         0x000001A0
+#define MSR_IA32_PACKAGE_THERM_STATUS 0x000001B1
+#define MSR_TURBO_RATIO_LIMIT        0x000001AD
+#define MSR_TURBO_RATIO_LIMIT_CORES  0x000001AE
+#define MSR_PKG_C3_RESIDENCY         0x000003F8
+#define MSR_PKG_C6_RESIDENCY         0x000003F9
+#define MSR_PKG_C7_RESIDENCY         0x000003FA
+#define MSR_CORE_C3_RESIDENCY        0x000003FC
+#define MSR_CORE_C6_RESIDENCY        0x000003FD
+#define MSR_CORE_C7_RESIDENCY        0x000003FE
+#define MSR_RAPL_POWER_UNIT          0x00000606
+#define MSR_PKG_C2_RESIDENCY         0x0000060D
+#define MSR_PKG_ENERGY_STATUS        0x00000611
+#define MSR_DRAM_ENERGY_STATUS       0x00000619
+#define MSR_PP0_ENERGY_STATUS        0x00000639
+#define AMD_MSR_RAPL_POWER_UNIT      0xC0010299
+#define AMD_MSR_CORE_ENERGY_STATUS   0xC001029A
+#define AMD_MSR_PKG_ENERGY_STATUS    0xC001029B
+#define MSR_IA32_PAT                 0x00000277
 #define MSR_IA32_MTRRCAP             0x000000FE
 #define MSR_IA32_MTRR_DEF_TYPE       0x000002FF
 #define MSR_IA32_MTRR_PHYSBASE0      0x00000200
 #define MSR_IA32_MTRR_PHYSMASK0      0x00000201
+#define MSR_IA32_PMC0                0x000000C1
+#define MSR_IA32_PERFEVTSEL0         0x00000186
+#define MSR_IA32_FIXED_CTR0          0x00000309
+#define MSR_IA32_FIXED_CTR_CTRL      0x0000038D
+#define MSR_IA32_PERF_GLOBAL_STATUS  0x0000038E
+#define MSR_IA32_PERF_GLOBAL_CTRL    0x0000038F
+#define MSR_IA32_PERF_GLOBAL_OVF_CTRL 0x00000390
+#define MSR_IA32_PERF_GLOBAL_STATUS_SET 0x00000391
+#define MSR_IA32_PERF_CAPABILITIES   0x00000345
+#define MSR_IA32_A_PMC0              0x000004C1
 
 #define MSR_IA32_MTRR_FIX64K_00000   0x00000250
 #define MSR_IA32_MTRR_FIX16K_80000   0x00000258
@@ -35,15 +86,499 @@
 #define CPUID_FEAT_EDX_MSR           BIT5
 #define CPUID_FEAT_EDX_MTRR          BIT12
 
+#define CPUID_HYPERVISOR_BASE        0x40000000
+#define CPUID_EXTENDED_BASE          0x80000000
+#define CPUID_DB_MAX_ENTRIES         1024
+#define CPUID_DB_MAX_SUBLEAVES       64          // per leaf; XSAVE (0xD) components top out at 63
+#define CPUID_DB_MAX_RANGE_LEAVES    0x100       // guards against garbage max-leaf values under some hypervisors
+
 #define IA32_MTRRCAP_VCNT_MASK       0xFFu
 #define IA32_MTRRCAP_FIX_BIT         BIT8
 #define IA32_MTRR_DEF_TYPE_TYPE_MASK 0xFFu
 #define IA32_MTRR_DEF_TYPE_FE_BIT    BIT10
 #define IA32_MTRR_DEF_TYPE_E_BIT     BIT11
+#define IA32_MTRR_PHYSMASK_VALID_BIT BIT11
+
+#define MTRR_TYPE_UC                 0x00
+#define MTRR_TYPE_WC                 0x01
+#define MTRR_TYPE_WT                 0x04
+#define MTRR_TYPE_WP                 0x05
+#define MTRR_TYPE_WB                 0x06
+#define MTRR_TYPE_UNDEFINED          0xFF        // overlap with no architectural resolution
+#define MTRR_TYPE_DONT_CARE          0xFE        // solver only: first MB owned by the fixed MTRRs
+#define MTRR_FIXED_MSR_COUNT         11
+#define MTRR_FIXED_RANGE_END         0x100000
+#define MTRR_MAX_MASK_HOLES          4           // non-contiguous masks expand to 2^holes ranges
+#define MTRR_AUDIT_TYPE_SLOTS        8           // slot 7 collects reserved / undefined types
+#define MTRR_RENDEZVOUS_MS           100         // a CPU that never arrives cannot stall the others forever
+#define MTRR_RENDEZVOUS_ABORT        MAX_UINT32  // MTRR_APPLY_JOB.Arrived once any CPU gave up waiting
+
+#define PAT_TYPE_UC_MINUS            0x07
+#define PAT_ENTRY_COUNT              8
+
+#define CR0_NW_BIT                   BIT29
+#define CR0_CD_BIT                   BIT30
+#define CR4_PGE_BIT                  BIT7
+#define CR4_LA57_BIT                 BIT12
+
+#define PTE_PRESENT                  BIT0
+#define PTE_RW                       BIT1
+#define PTE_US                       BIT2
+#define PTE_PWT                      BIT3
+#define PTE_PCD                      BIT4
+#define PTE_PS                       BIT7        // PDPTE / PDE: maps a 1GB / 2MB page
+#define PTE_PAT_4K                   BIT7        // PTE
+#define PTE_PAT_LARGE                BIT12       // large-page PDPTE / PDE
+#define PTE_NX                       BIT63
+#define PAGE_TABLE_ENTRIES           512
+#define PAGE_WALK_MAX_RUNS           0x10000     // stats keep counting past this, the run list stops
+
+#define MEM_BENCH_DEFAULT_SIZE       0x1000000   // 16MB, past most LLCs
+#define MEM_BENCH_MIN_SIZE           0x100000
+#define MEM_BENCH_MAX_SIZE           0x10000000
+#define MEM_BENCH_TYPE_COUNT         4
+
+#define CPU_CACHE_MAX                8
+#define CACHE_PROBE_MIN_SET          0x1000
+#define CACHE_PROBE_DEFAULT_LLC      0x800000    // used when no cache leaf is enumerated
+#define CACHE_PROBE_MAX_POINTS       48
+#define CACHE_PROBE_MIN_STEPS        0x20000
+#define CACHE_PROBE_PLATEAU_PCT      125         // latency rise that ends a plateau
 
-#define MENU_ITEMS_COUNT             6
+#define PERFEVTSEL_USR               BIT16
+#define PERFEVTSEL_OS                BIT17
+#define PERFEVTSEL_EN                BIT22
+#define PERF_CAP_FW_WRITE            BIT13       // IA32_A_PMCx take full-width writes
+#define PMU_MAX_GP                   8
+#define PMU_MAX_FIXED                4
+#define PMU_NONE                     0xFF
+#define PMU_SORT_VALUES              0x10000
+
+#define MISC_ENABLE_EIST_BIT         BIT16
+#define MISC_ENABLE_TURBO_DISABLE    BIT38
+#define FREQ_DEFAULT_BUS_MHZ         100
+#define FREQ_DEFAULT_INTERVAL_MS     1000
+#define FREQ_LOW_PCT                 90          // loaded core below this % of base is flagged
+
+#define TELEMETRY_RING_SIZE          64
+#define TELEMETRY_DEFAULT_PERIOD_MS  1000
+#define TELEMETRY_MIN_PERIOD_MS      10
+#define TELEMETRY_DISPLAY_MS         100
+
+#define MSR_WATCH_DEFAULT_HZ         10
+#define MSR_WATCH_MAX_HZ             50
+#define MSR_WATCH_FIRST_ROW          3
+#define MSR_WATCH_VALUE_COL          10
+#define MSR_WATCH_DELTA_COL          28
+#define MSR_WATCH_RATE_COL           49
+#define MSR_WATCH_CELL_CHARS         21
+
+#define MENU_ITEMS_COUNT             22
 #define INPUT_BUF_LEN                32
-#define PAGE_LINES_LIMIT             18
+#define PAGE_LINES_RESERVED          7           // 18 lines per page on an 80x25 console
+#define SCREEN_DEFAULT_COLS          80
+#define SCREEN_DEFAULT_ROWS          25
+#define SCREEN_GAP_MERGE             4           // unchanged cells resent instead of moving the cursor
+#define SCREEN_ATTR_NORMAL           (EFI_LIGHTGRAY | EFI_BACKGROUND_BLACK)
+#define SCREEN_ATTR_HIGHLIGHT        (EFI_WHITE | EFI_BACKGROUND_BLUE)
+
+#define MSR_BATCH_CHUNK              0x1000
+#define MSR_BITMAP_BYTES(Count)      (((Count) + 7) / 8)
+#define MSR_BITMAP_SET(Map, Bit)     ((Map)[(Bit) >> 3] |= (UINT8)(1u << ((Bit) & 7)))
+#define MSR_BITMAP_TEST(Map, Bit)    (((Map)[(Bit) >> 3] & (1u << ((Bit) & 7))) != 0)
+
+#define MSR_CACHE_SIGNATURE          SIGNATURE_32 ('M', 'S', 'R', 'I')
+#define MSR_CACHE_VERSION            1
+#define MSR_CACHE_DIR                L"\\CpuIdPkg"
+#define MSR_CACHE_PATH_LEN           64
+#define MSR_INTERVAL_GROW            64
+
+#define CPU_CACHE_LINE_SIZE          64
+#define PERCPU_MSR_MAX               16
+#define PERCPU_COLS_PER_PAGE         4
+#define MSR_LIST_INPUT_LEN           128
+
+#define MSR_SCAN_CHUNK               0x400       // multiple of 512 so chunks never share a bitmap cache line
+#define MSR_SCAN_MAX_SPAN            0x10000000
+#define MSR_SCAN_PROGRESS_MS         20
+#define EVENT_LOOP_MAX_SOURCES       4
+#define EVENT_LOOP_POLL_US           1000        // CheckEvent fallback when WaitForEvent is unsupported
+#define CLI_MAX_ARGS                 17          // command name + 16 arguments
+#define CLI_MAX_SCRIPT_SIZE          0x100000
+#define CLI_MAX_SCRIPT_DEPTH         4
+#define EXPORT_BUFFER_SIZE           0x400000    // one File->Write per 4MB of records
+#define EXPORT_LINE_MAX              256         // flush before less than one record fits
+#define EXPORT_PATH_LEN              64
+#define EXPORT_DEFAULT_MSR_END       0x1FFF
+
+//
+// Persistent valid-MSR index. Both sets hold sorted, non-overlapping,
+// non-adjacent inclusive intervals: Probed = indices already scanned on
+// this CPU signature + microcode, Valid = the subset that did not #GP.
+//
+typedef struct {
+  UINT32 First;
+  UINT32 Last;
+} MSR_INTERVAL;
+
+typedef struct {
+  MSR_INTERVAL *Items;
+  UINTN        Count;
+  UINTN        Capacity;
+} MSR_INTERVAL_SET;
+
+typedef struct {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 Reserved;
+  UINT32 CpuSignature;
+  UINT32 MicrocodeRev;
+  UINT32 ProbedCount;
+  UINT32 ValidCount;
+} MSR_CACHE_FILE_HEADER;
+
+typedef enum {
+  MsrCacheUnknown = 0,
+  MsrCacheValid,
+  MsrCacheInvalid
+} MSR_CACHE_STATE;
+
+typedef struct {
+  BOOLEAN          Loaded;
+  BOOLEAN          Dirty;
+  UINT32           CpuSignature;
+  UINT32           MicrocodeRev;
+  MSR_INTERVAL_SET Probed;
+  MSR_INTERVAL_SET Valid;
+} MSR_INDEX_CACHE;
+
+//
+// Per-CPU result slot for parallel MSR collection. Slots are laid out on a
+// CPU_CACHE_LINE_SIZE stride so APs never write to a line another CPU owns.
+//
+typedef struct {
+  UINT32          ApicId;
+  BOOLEAN         Present;    // GetProcessorInfo succeeded, ApicId is meaningful
+  BOOLEAN         Enabled;
+  BOOLEAN         IsBsp;
+  volatile UINT8  Done;
+  UINT32          FaultMask;  // bit I = MsrList[I] faulted on this CPU
+  UINT32          ScanValid;  // valid indices found by this CPU in a parallel scan
+  UINT64          Values[PERCPU_MSR_MAX];
+} PERCPU_MSR_SLOT;
+
+typedef struct {
+  UINT8        *Slots;
+  UINTN        SlotStride;
+  UINTN        SlotCount;
+  UINTN        SlotPages;
+  UINTN        BspSlot;
+  UINT32       MaxBasicLeaf;
+  BOOLEAN      IsAmd;
+  CONST UINT32 *MsrList;
+  UINTN        MsrCount;
+  BOOLEAN      Orphaned;      // AP completion never confirmed, memory must not be freed
+} PERCPU_MSR_JOB;
+
+#define PERCPU_SLOT(Job, Index)      ((PERCPU_MSR_SLOT *)((Job)->Slots + (Index) * (Job)->SlotStride))
+
+//
+// Parallel blind scan. Each CPU owns a deque of chunk numbers packed as
+// Head (low dword) / Tail (high dword): the owner pops from the head, idle
+// CPUs steal from the tail, both with a single 64-bit compare-exchange.
+//
+typedef struct {
+  volatile UINT64 HeadTail;
+} MSR_SCAN_QUEUE;
+
+typedef struct {
+  PERCPU_MSR_JOB   Cpus;          // CPU roster + per-CPU valid counters
+  UINT32           FirstMsr;
+  UINT64           Span;
+  UINT32           ChunkCount;
+  UINT8            *Queues;       // one MSR_SCAN_QUEUE per slot, Cpus.SlotStride apart
+  UINTN            QueuePages;
+  UINT8            *ValidBitmap;  // bit N = FirstMsr + N did not #GP
+  UINTN            BitmapPages;
+  volatile UINT32  ChunksDone;
+  volatile BOOLEAN Abort;
+} MSR_SCAN_JOB;
+
+#define MSR_SCAN_QUEUE_AT(Scan, Index) ((MSR_SCAN_QUEUE *)((Scan)->Queues + (Index) * (Scan)->Cpus.SlotStride))
+
+//
+// CPUID capability database, filled once in UefiMain. Entries are kept in
+// (Leaf, SubLeaf) order so lookups are a binary search.
+//
+typedef struct {
+  UINT32 Leaf;
+  UINT32 SubLeaf;
+  UINT32 Eax;
+  UINT32 Ebx;
+  UINT32 Ecx;
+  UINT32 Edx;
+} CPUID_DB_ENTRY;
+
+//
+// One subleaf of CPUID 4 / 0x8000001D (both share the EAX..ECX layout).
+//
+typedef struct {
+  UINT8  Level;
+  UINT8  Type;             // 1 = data, 2 = instruction, 3 = unified
+  UINT32 Ways;
+  UINT32 LineSize;
+  UINT32 Sets;
+  UINT32 SharedBy;         // logical CPUs sharing the cache
+  UINT64 Size;
+} CPU_CACHE_INFO;
+
+typedef enum {
+  CpuidRegEax = 0,
+  CpuidRegEbx,
+  CpuidRegEcx,
+  CpuidRegEdx
+} CPUID_REG;
+
+typedef enum {
+  CpuFeatTsc = 0,
+  CpuFeatMsr,
+  CpuFeatPae,
+  CpuFeatApic,
+  CpuFeatMtrr,
+  CpuFeatPge,
+  CpuFeatPat,
+  CpuFeatClflush,
+  CpuFeatSse2,
+  CpuFeatHtt,
+  CpuFeatSse3,
+  CpuFeatMonitor,
+  CpuFeatVmx,
+  CpuFeatSmx,
+  CpuFeatEist,
+  CpuFeatPdcm,
+  CpuFeatPcid,
+  CpuFeatX2Apic,
+  CpuFeatTscDeadline,
+  CpuFeatXsave,
+  CpuFeatOsxsave,
+  CpuFeatAvx,
+  CpuFeatRdrand,
+  CpuFeatHypervisor,
+  CpuFeatAperfMperf,
+  CpuFeatTurbo,
+  CpuFeatHwp,
+  CpuFeatFsgsbase,
+  CpuFeatAvx2,
+  CpuFeatSmep,
+  CpuFeatErms,
+  CpuFeatInvpcid,
+  CpuFeatRdtMonitor,
+  CpuFeatRdtAlloc,
+  CpuFeatAvx512F,
+  CpuFeatRdseed,
+  CpuFeatSmap,
+  CpuFeatClflushopt,
+  CpuFeatClwb,
+  CpuFeatLa57,
+  CpuFeatHybrid,
+  CpuFeatNx,
+  CpuFeatPage1Gb,
+  CpuFeatRdtscp,
+  CpuFeatLongMode,
+  CpuFeatSvm,
+  CpuFeatInvariantTsc,
+  CpuFeatMax
+} CPU_FEATURE;
+
+typedef struct {
+  CONST CHAR16 *Name;
+  UINT32       Leaf;
+  UINT32       SubLeaf;
+  CPUID_REG    Reg;
+  UINT8        Bit;
+} CPU_FEATURE_DESC;
+
+typedef struct {
+  BOOLEAN        Valid;
+  BOOLEAN        IsIntel;
+  BOOLEAN        IsAmd;
+  CHAR8          Vendor[13];
+  CHAR8          HypervisorVendor[13];
+  CHAR8          Brand[49];
+  UINT32         MaxBasicLeaf;
+  UINT32         MaxHypervisorLeaf;   // 0 when no hypervisor range
+  UINT32         MaxExtLeaf;          // 0 when no extended range
+  UINT32         Signature;           // CPUID.1:EAX
+  UINT32         Family;
+  UINT32         Model;
+  UINT32         Stepping;
+  UINT8          PhysAddrBits;
+  UINT8          LinearAddrBits;
+  BOOLEAN        Features[CpuFeatMax];
+  UINTN          Count;
+  CPUID_DB_ENTRY Entries[CPUID_DB_MAX_ENTRIES];
+} CPUID_DB;
+
+//
+// One consistent read of the MTRR MSRs. Variables holds VariableCount
+// PHYSBASE/PHYSMASK pairs (VCNT from IA32_MTRRCAP, no fixed upper bound).
+//
+typedef struct {
+  UINT64 Base;
+  UINT64 Mask;
+} MTRR_VARIABLE_PAIR;
+
+typedef struct {
+  UINT64             Cap;
+  UINT64             DefType;
+  UINT8              PhysAddrBits;
+  BOOLEAN            FixedValid;
+  UINT64             Fixed[MTRR_FIXED_MSR_COUNT];
+  UINTN              VariableCount;
+  MTRR_VARIABLE_PAIR *Variables;
+} MTRR_SNAPSHOT;
+
+//
+// Effective memory-type map: sorted, non-overlapping, adjacent entries of
+// equal type merged, covering [0, 2^PhysAddrBits).
+//
+typedef struct {
+  UINT64 First;
+  UINT64 Last;
+  UINT8  Type;
+} MTRR_MAP_ENTRY;
+
+typedef struct {
+  MTRR_MAP_ENTRY *Items;
+  UINTN          Count;
+  UINTN          Capacity;
+  UINTN          Undefined;        // segments where overlapping types have no defined result
+  UINTN          SkippedRanges;    // variable ranges with too many mask holes to expand
+} MTRR_MEMORY_MAP;
+
+//
+// Result of translating one linear address through the live page tables.
+// Level is the level of the leaf entry (1 = PTE, 2 = PDE, 3 = PDPTE).
+//
+typedef struct {
+  BOOLEAN Present;
+  BOOLEAN Faulted;         // reading a table faulted (not identity mapped)
+  UINT8   Level;
+  UINT8   PatIndex;        // PAT * 4 + PCD * 2 + PWT of the leaf entry
+  UINT64  Entry;
+  UINT64  Physical;
+  UINT64  PageSize;
+} PAGE_WALK_RESULT;
+
+//
+// Full-table walk: runs of linearly contiguous leaves with identical
+// attributes, plus aggregate statistics.
+//
+typedef struct {
+  UINT64  FirstLinear;
+  UINT64  LastLinear;
+  UINT64  PageSize;
+  UINT8   EffType;
+  BOOLEAN Writable;
+  BOOLEAN NoExec;
+  BOOLEAN User;
+} PAGE_RUN;
+
+typedef struct {
+  UINT64                Pat;
+  BOOLEAN               CacheDisabled;
+  CONST MTRR_MEMORY_MAP *Mtrr;
+  UINT64                AddrMask;
+  UINTN                 Levels;
+  UINT64                PageCount[3];        // 4K, 2M, 1G
+  UINT64                BytesByType[MTRR_AUDIT_TYPE_SLOTS];
+  UINT64                WritableBytes;
+  UINT64                NoExecBytes;
+  UINTN                 Tables;
+  UINTN                 FaultedTables;
+  UINTN                 MtrrSplitPages;      // large pages spanning more than one MTRR type
+  PAGE_RUN              *Runs;
+  UINTN                 RunCount;
+  UINTN                 RunCapacity;
+  BOOLEAN               RunsTruncated;
+} PAGE_WALK_CONTEXT;
+
+//
+// Last memory benchmark run, kept so Dump MTRR can show it next to the
+// register decode. Bandwidths in MB/s, latency in picoseconds.
+//
+typedef struct {
+  UINT8        Type;               // MTRR type programmed over the buffer
+  UINT8        Effective;          // after combining with the buffer's PAT entry
+  CONST CHAR16 *Failure;           // non-NULL when the row could not be measured
+  UINT64       ReadMBs;
+  UINT64       WriteMBs;
+  UINT64       CopyMBs;            // non-temporal copy
+  UINT64       LatencyPs;          // dependent loads, random line order
+} MEM_BENCH_ROW;
+
+typedef struct {
+  BOOLEAN       Valid;
+  UINT64        Base;
+  UINT64        Size;
+  UINT64        TscHz;
+  MEM_BENCH_ROW Rows[MEM_BENCH_TYPE_COUNT];
+} MEM_BENCH_REPORT;
+
+//
+// Cache probe sweep: latency per working-set size (cycles * 100), and the
+// flat stretches found in it.
+//
+typedef struct {
+  UINT64 Size;
+  UINT64 CyclesX100;
+} CACHE_PROBE_POINT;
+
+typedef struct {
+  UINT64 FirstSize;
+  UINT64 LastSize;         // largest working set still at this latency
+  UINT64 CyclesX100;
+} CACHE_PLATEAU;
+
+typedef struct {
+  UINTN   Cols;
+  UINTN   Rows;
+  CHAR16  *Shown;                      // what the console is displaying, valid while Synced
+  UINT8   *ShownAttr;
+  CHAR16  *Back;                       // frame being built
+  UINT8   *BackAttr;
+  CHAR16  *Run;                        // one span, Cols + 1 chars
+  UINTN   Col;                         // write position in Back, cursor is left here on flush
+  UINTN   Row;
+  BOOLEAN Synced;
+} SCREEN_BUFFER;
+
+typedef BOOLEAN (*EVENT_LOOP_HANDLER)(IN VOID *Context);       // TRUE ends the loop
+
+typedef struct {
+  UINTN              Count;
+  EFI_EVENT          Events[EVENT_LOOP_MAX_SOURCES];
+  EVENT_LOOP_HANDLER Handlers[EVENT_LOOP_MAX_SOURCES];
+  VOID               *Contexts[EVENT_LOOP_MAX_SOURCES];
+} EVENT_LOOP;
+
+typedef enum {
+  ExportCsv = 0,
+  ExportJson,
+  ExportFormatMax
+} EXPORT_FORMAT;
+
+typedef struct {
+  EFI_FILE_PROTOCOL *File;
+  EXPORT_FORMAT     Format;
+  CHAR8             *Buffer;
+  UINTN             Size;
+  UINTN             Used;
+  UINTN             Records;           // in the current section, for JSON separators
+  UINT64            Written;
+  UINTN             Writes;
+  EFI_STATUS        Status;            // first write error, sticky
+} EXPORT_SINK;
 
 typedef enum {
   MenuCpuId = 0,
@@ -51,7 +586,23 @@ typedef enum {
   MenuReadMsr,
   MenuDumpMsr,
   MenuWriteMsr,
-  MenuDumpMtrr
+  MenuDumpMtrr,
+  MenuPerCoreMsr,
+  MenuParallelMsrScan,
+  MenuVmExitBench,
+  MenuMtrrMap,
+  MenuMtrrAudit,
+  MenuMtrrPlanner,
+  MenuPatResolve,
+  MenuPageWalk,
+  MenuCpuidMsrBench,
+  MenuMemBench,
+  MenuCacheProbe,
+  MenuPmuSession,
+  MenuFreqSampler,
+  MenuTelemetry,
+  MenuMsrWatch,
+  MenuExportCapture
 } MENU_ACTION;
 
 STATIC CONST CHAR16 *mMenuItems[MENU_ITEMS_COUNT] = {
@@ -60,85 +611,237 @@ STATIC CONST CHAR16 *mMenuItems[MENU_ITEMS_COUNT] = {
   L"Read MSR",
   L"Dump MSR",
   L"Write MSR",
-  L"Dump MTRR"
+  L"Dump MTRR",
+  L"Per-Core MSR",
+  L"Parallel MSR Scan",
+  L"VM Exit Benchmark",
+  L"MTRR Memory Map",
+  L"MTRR vs Memory Map Audit",
+  L"MTRR Layout Planner",
+  L"PAT / Effective Type",
+  L"Page Table Walk",
+  L"CPUID/MSR Benchmark",
+  L"Memory Throughput Benchmark",
+  L"Cache Hierarchy Probe",
+  L"PMU Session",
+  L"Effective Frequency",
+  L"Power / C-State Telemetry",
+  L"MSR Watch",
+  L"Export Capture to ESP"
 };
 
 //
 // =====================================================
-// Global Variables for MSR #GP Handler
+// Global Variables for the Probe Fault Handler
 // =====================================================
 //
-EFI_CPU_ARCH_PROTOCOL *mCpu = NULL;
-volatile BOOLEAN      gMsrFault = FALSE;
+EFI_CPU_ARCH_PROTOCOL    *mCpu = NULL;
+EFI_MP_SERVICES_PROTOCOL *mMp  = NULL;
+
+//
+// Vectors ProbeFaultHandler is registered for, and which registrations
+// actually succeeded (a vector another driver already owns is skipped).
+//
+STATIC CONST EFI_EXCEPTION_TYPE mProbeVectors[] = {
+  EXCEPT_IA32_INVALID_OPCODE, EXCEPT_IA32_GP_FAULT, EXCEPT_IA32_PAGE_FAULT
+};
+STATIC BOOLEAN mProbeVectorInstalled[sizeof (mProbeVectors) / sizeof (mProbeVectors[0])];
+
+//
+// Scratch buffers for batched MSR reads (one chunk of DoDumpMsr at a time)
+//
+STATIC UINT64 mMsrBatchValues[MSR_BATCH_CHUNK];
+STATIC UINT8  mMsrBatchFaults[MSR_BITMAP_BYTES (MSR_BATCH_CHUNK)];
+STATIC UINT32 mMsrBatchIndices[MSR_BATCH_CHUNK];
+
+STATIC MSR_INDEX_CACHE mMsrCache;
+STATIC CPUID_DB        mCpuidDb;
+STATIC MEM_BENCH_REPORT mMemBenchReport;
+STATIC SCREEN_BUFFER    mScreen;
+STATIC BOOLEAN          mBatchMode;            // command line / script: no paging, no key waits
 
 //
 // =====================================================
-// Exception Handler (Intercepts #GP)
+// Exception Handler (Fixup Table for #UD / #GP / #PF)
 // =====================================================
 //
+
+//
+// Installed once for the lifetime of the app. A fault whose RIP is listed
+// in mProbeFixupTable resumes at the matching fixup address with the
+// PROBE_FAULT status in RAX; this is per-call state, so it is safe on
+// every CPU at once.
+//
+// Any other fault is a real crash: dump the context the way the firmware's
+// default handler would and halt. The shared handler table is left alone,
+// other CPUs may be in the middle of a probe, and this may be running on
+// an AP where protocol calls are not allowed.
+//
 VOID
 EFIAPI
-MsrFaultHandler (
+ProbeFaultHandler (
   IN EFI_EXCEPTION_TYPE   InterruptType,
   IN EFI_SYSTEM_CONTEXT   SystemContext
   )
 {
-  UINT8 *Ip;
-
-#if defined (MDE_CPU_X64)
-  Ip = (UINT8 *)SystemContext.SystemContextX64->Rip;
-#elif defined (MDE_CPU_IA32)
-  Ip = (UINT8 *)SystemContext.SystemContextIa32->Eip;
-#else
-  return;
-#endif
-
-  // Check if instruction is rdmsr (0F 32) or wrmsr (0F 30)
-  if (Ip[0] == 0x0F && (Ip[1] == 0x32 || Ip[1] == 0x30)) {
-    gMsrFault = TRUE;
-    
-    // Skip the faulting 2-byte instruction
-#if defined (MDE_CPU_X64)
-    SystemContext.SystemContextX64->Rip += 2;
-    if (Ip[1] == 0x32) { // rdmsr: clear return values
-      SystemContext.SystemContextX64->Rax = 0;
-      SystemContext.SystemContextX64->Rdx = 0;
-    }
-#elif defined (MDE_CPU_IA32)
-    SystemContext.SystemContextIa32->Eip += 2;
-    if (Ip[1] == 0x32) {
-      SystemContext.SystemContextIa32->Eax = 0;
-      SystemContext.SystemContextIa32->Edx = 0;
-    }
-#endif
-  } else {
-    // If it's a real crash somewhere else, halt the system
-    CpuDeadLoop(); 
+  PROBE_FIXUP_ENTRY *Entry;
+
+  for (Entry = mProbeFixupTable; Entry < mProbeFixupTableEnd; Entry++) {
+    if (Entry->FaultIp == (UINTN)SystemContext.SystemContextX64->Rip) {
+      SystemContext.SystemContextX64->Rip = Entry->FixupIp;
+      SystemContext.SystemContextX64->Rax = PROBE_FAULT_FLAG | (UINT8)InterruptType;
+      return;
+    }
   }
+
+  DumpCpuContext (InterruptType, SystemContext);
+  CpuDeadLoop ();
 }
 
-STATIC BOOLEAN SafeReadMsr (IN UINT32 Index, OUT UINT64 *Value) {
-  gMsrFault = FALSE;
-  if (mCpu != NULL) {
-    mCpu->RegisterInterruptHandler (mCpu, EXCEPT_IA32_GP_FAULT, MsrFaultHandler);
+STATIC VOID ProbeFaultHandlerInstall (VOID) {
+  UINTN I;
+  if (mCpu == NULL) return;
+  for (I = 0; I < sizeof (mProbeVectors) / sizeof (mProbeVectors[0]); I++) {
+    mProbeVectorInstalled[I] = (BOOLEAN)!EFI_ERROR (mCpu->RegisterInterruptHandler (mCpu, mProbeVectors[I], ProbeFaultHandler));
   }
-  *Value = AsmReadMsr64 (Index);
-  if (mCpu != NULL) {
-    mCpu->RegisterInterruptHandler (mCpu, EXCEPT_IA32_GP_FAULT, NULL);
+}
+
+STATIC VOID ProbeFaultHandlerUninstall (VOID) {
+  UINTN I;
+  if (mCpu == NULL) return;
+  for (I = 0; I < sizeof (mProbeVectors) / sizeof (mProbeVectors[0]); I++) {
+    if (mProbeVectorInstalled[I]) {
+      mCpu->RegisterInterruptHandler (mCpu, mProbeVectors[I], NULL);
+      mProbeVectorInstalled[I] = FALSE;
+    }
   }
-  return !gMsrFault;
+}
+
+STATIC BOOLEAN SafeReadMsr (IN UINT32 Index, OUT UINT64 *Value) {
+  *Value = 0;
+  return (BOOLEAN)(ProbeReadMsr (Index, Value) == PROBE_OK);
 }
 
 STATIC BOOLEAN SafeWriteMsr (IN UINT32 Index, IN UINT64 Value) {
-  gMsrFault = FALSE;
-  if (mCpu != NULL) {
-    mCpu->RegisterInterruptHandler (mCpu, EXCEPT_IA32_GP_FAULT, MsrFaultHandler);
+  return (BOOLEAN)(ProbeWriteMsr (Index, Value) == PROBE_OK);
+}
+
+//
+// Batched read. Reads either IndexList[0..Count-1] or, when IndexList is
+// NULL, the contiguous range FirstIndex..FirstIndex+Count-1.
+// Faulting slots get Value 0 and their bit set in FaultBitmap.
+// Returns the number of faulting indices.
+//
+STATIC UINTN SafeReadMsrBatch (
+  IN  CONST UINT32 *IndexList OPTIONAL,
+  IN  UINT32       FirstIndex,
+  IN  UINTN        Count,
+  OUT UINT64       *Values,
+  OUT UINT8        *FaultBitmap
+  )
+{
+  UINTN  I;
+  UINTN  Faults = 0;
+  UINT32 Index;
+
+  if (Values == NULL || FaultBitmap == NULL || Count == 0) return 0;
+  SetMem (FaultBitmap, MSR_BITMAP_BYTES (Count), 0);
+
+  for (I = 0; I < Count; I++) {
+    Index = (IndexList != NULL) ? IndexList[I] : (UINT32)(FirstIndex + I);
+    if (ProbeReadMsr (Index, &Values[I]) != PROBE_OK) {
+      Values[I] = 0;
+      MSR_BITMAP_SET (FaultBitmap, I);
+      Faults++;
+    }
+  }
+  return Faults;
+}
+
+STATIC UINTN SafeReadMsrList (IN CONST UINT32 *IndexList, IN UINTN Count, OUT UINT64 *Values, OUT UINT8 *FaultBitmap) {
+  if (IndexList == NULL) return 0;
+  return SafeReadMsrBatch (IndexList, 0, Count, Values, FaultBitmap);
+}
+
+STATIC UINTN SafeReadMsrRange (IN UINT32 FirstIndex, IN UINTN Count, OUT UINT64 *Values, OUT UINT8 *FaultBitmap) {
+  return SafeReadMsrBatch (NULL, FirstIndex, Count, Values, FaultBitmap);
+}
+
+//
+// =====================================================
+// Event Loop
+// =====================================================
+//
+// Waits block in WaitForEvent on the key, timer and MP-completion events a view
+// registered, so the BSP halts between events instead of spinning on ReadKeyStroke
+// or CheckEvent. A handler returns TRUE to leave the loop. Events must not be
+// EVT_NOTIFY_SIGNAL (WaitForEvent and CheckEvent reject them).
+//
+STATIC VOID EventLoopInit (OUT EVENT_LOOP *Loop) {
+  ZeroMem (Loop, sizeof (*Loop));
+}
+
+STATIC EFI_STATUS EventLoopAdd (IN OUT EVENT_LOOP *Loop, IN EFI_EVENT Event, IN EVENT_LOOP_HANDLER Handler, IN VOID *Context) {
+  if (Event == NULL || Handler == NULL) return EFI_INVALID_PARAMETER;
+  if (Loop->Count >= EVENT_LOOP_MAX_SOURCES) return EFI_OUT_OF_RESOURCES;
+  Loop->Events[Loop->Count]   = Event;
+  Loop->Handlers[Loop->Count] = Handler;
+  Loop->Contexts[Loop->Count] = Context;
+  Loop->Count++;
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS EventLoopRun (IN EVENT_LOOP *Loop) {
+  EFI_STATUS Status;
+  UINTN      Index;
+
+  if (Loop->Count == 0) return EFI_INVALID_PARAMETER;
+  while (TRUE) {
+    Status = gBS->WaitForEvent (Loop->Count, Loop->Events, &Index);
+    if (Status == EFI_UNSUPPORTED) {
+      //
+      // Only allowed at TPL_APPLICATION; poll when a caller is running raised.
+      //
+      for (Index = 0; Index < Loop->Count; Index++) {
+        Status = gBS->CheckEvent (Loop->Events[Index]);
+        if (Status != EFI_NOT_READY) break;
+      }
+      if (Index == Loop->Count) {
+        gBS->Stall (EVENT_LOOP_POLL_US);
+        continue;
+      }
+      if (EFI_ERROR (Status)) return Status;
+    } else if (EFI_ERROR (Status)) {
+      return Status;
+    }
+    if (Loop->Handlers[Index] (Loop->Contexts[Index])) return EFI_SUCCESS;
   }
-  AsmWriteMsr64 (Index, Value);
-  if (mCpu != NULL) {
-    mCpu->RegisterInterruptHandler (mCpu, EXCEPT_IA32_GP_FAULT, NULL);
+}
+
+STATIC BOOLEAN EventLoopStop (IN VOID *Context) {
+  return TRUE;
+}
+
+//
+// WaitForKey can be signalled without a key actually being queued; only stop on a read.
+//
+STATIC BOOLEAN EventLoopReadKey (IN VOID *Context) {
+  return (BOOLEAN)!EFI_ERROR (gST->ConIn->ReadKeyStroke (gST->ConIn, (EFI_INPUT_KEY *)Context));
+}
+
+STATIC VOID EventLoopSleep (IN UINT32 Milliseconds) {
+  EVENT_LOOP Loop;
+  EFI_EVENT  Timer;
+
+  if (EFI_ERROR (gBS->CreateEvent (EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Timer))) {
+    gBS->Stall ((UINTN)Milliseconds * 1000);
+    return;
   }
-  return !gMsrFault;
+  gBS->SetTimer (Timer, TimerRelative, EFI_TIMER_PERIOD_MILLISECONDS (Milliseconds));
+  EventLoopInit (&Loop);
+  EventLoopAdd (&Loop, Timer, EventLoopStop, NULL);
+  EventLoopRun (&Loop);
+  gBS->CloseEvent (Timer);
 }
 
 //
@@ -147,26 +850,164 @@ STATIC BOOLEAN SafeWriteMsr (IN UINT32 Index, IN UINT64 Value) {
 // =====================================================
 //
 STATIC VOID SetAttrNormal (VOID) {
-  gST->ConOut->SetAttribute (gST->ConOut, EFI_LIGHTGRAY | EFI_BACKGROUND_BLACK);
+  gST->ConOut->SetAttribute (gST->ConOut, SCREEN_ATTR_NORMAL);
 }
 
 STATIC VOID SetAttrHighlight (VOID) {
-  gST->ConOut->SetAttribute (gST->ConOut, EFI_WHITE | EFI_BACKGROUND_BLUE);
+  gST->ConOut->SetAttribute (gST->ConOut, SCREEN_ATTR_HIGHLIGHT);
 }
 
 STATIC VOID ClearScreenAndResetAttr (VOID) {
   gST->ConOut->ClearScreen (gST->ConOut);
   SetAttrNormal ();
+  mScreen.Synced = FALSE;
+}
+
+//
+// Off-screen renderer: callers fill the back buffer, ScreenFlush() sends only the cells
+// that differ from what the console is showing, one OutputString per same-attribute span.
+// Anything printed outside the renderer makes the shadow stale; ScreenInvalidate() forces
+// the next flush to clear and repaint.
+//
+STATIC VOID ScreenInvalidate (VOID) {
+  mScreen.Synced = FALSE;
+}
+
+STATIC VOID ScreenFree (VOID) {
+  if (mScreen.Shown != NULL) FreePool (mScreen.Shown);
+  if (mScreen.ShownAttr != NULL) FreePool (mScreen.ShownAttr);
+  if (mScreen.Back != NULL) FreePool (mScreen.Back);
+  if (mScreen.BackAttr != NULL) FreePool (mScreen.BackAttr);
+  if (mScreen.Run != NULL) FreePool (mScreen.Run);
+  mScreen.Shown = mScreen.Back = mScreen.Run = NULL;
+  mScreen.ShownAttr = mScreen.BackAttr = NULL;
+  mScreen.Synced = FALSE;
+}
+
+STATIC VOID ScreenInit (VOID) {
+  UINTN Cols, Rows, Cells;
+
+  if (EFI_ERROR (gST->ConOut->QueryMode (gST->ConOut, gST->ConOut->Mode->Mode, &Cols, &Rows)) ||
+      Cols == 0 || Rows == 0) {
+    Cols = SCREEN_DEFAULT_COLS;
+    Rows = SCREEN_DEFAULT_ROWS;
+  }
+  ScreenFree ();
+  mScreen.Cols      = Cols;
+  mScreen.Rows      = Rows;
+  Cells             = Cols * Rows;
+  mScreen.Shown     = AllocatePool (Cells * sizeof (CHAR16));
+  mScreen.ShownAttr = AllocatePool (Cells);
+  mScreen.Back      = AllocatePool (Cells * sizeof (CHAR16));
+  mScreen.BackAttr  = AllocatePool (Cells);
+  mScreen.Run       = AllocatePool ((Cols + 1) * sizeof (CHAR16));
+  if (mScreen.Shown == NULL || mScreen.ShownAttr == NULL || mScreen.Back == NULL ||
+      mScreen.BackAttr == NULL || mScreen.Run == NULL) {
+    ScreenFree ();                                      // keep Cols/Rows for paging, draw directly
+  }
+}
+
+//
+// Usable lines per page for paged dumps, leaving room for the pause prompt and the
+// header that scrolls in with it.
+//
+STATIC UINTN ScreenPageLines (VOID) {
+  if (mScreen.Rows <= PAGE_LINES_RESERVED + 1) return 1;
+  return mScreen.Rows - PAGE_LINES_RESERVED;
+}
+
+STATIC BOOLEAN ScreenBegin (VOID) {
+  if (mScreen.Back == NULL) return FALSE;
+  SetMem16 (mScreen.Back, mScreen.Cols * mScreen.Rows * sizeof (CHAR16), L' ');
+  SetMem (mScreen.BackAttr, mScreen.Cols * mScreen.Rows, SCREEN_ATTR_NORMAL);
+  mScreen.Col = 0;
+  mScreen.Row = 0;
+  return TRUE;
+}
+
+STATIC VOID ScreenPuts (IN UINT8 Attr, IN CONST CHAR16 *Str) {
+  UINTN Index;
+
+  for (; *Str != L'\0'; Str++) {
+    if (*Str == L'\n') {
+      mScreen.Row++;
+      mScreen.Col = 0;
+      continue;
+    }
+    //
+    // Never write the bottom-right cell: most consoles scroll when the cursor leaves it.
+    //
+    if (mScreen.Row < mScreen.Rows && mScreen.Col < mScreen.Cols &&
+        !(mScreen.Row == mScreen.Rows - 1 && mScreen.Col == mScreen.Cols - 1)) {
+      Index                   = mScreen.Row * mScreen.Cols + mScreen.Col;
+      mScreen.Back[Index]     = *Str;
+      mScreen.BackAttr[Index] = Attr;
+    }
+    mScreen.Col++;
+  }
+}
+
+STATIC VOID ScreenFlush (VOID) {
+  UINTN Row, Col, Limit, Start, End, J, Index;
+  UINT8 Attr, Current = 0;
+
+  if (!mScreen.Synced) {
+    SetAttrNormal ();
+    gST->ConOut->ClearScreen (gST->ConOut);
+    SetMem16 (mScreen.Shown, mScreen.Cols * mScreen.Rows * sizeof (CHAR16), L' ');
+    SetMem (mScreen.ShownAttr, mScreen.Cols * mScreen.Rows, SCREEN_ATTR_NORMAL);
+    mScreen.Synced = TRUE;
+  }
+
+  for (Row = 0; Row < mScreen.Rows; Row++) {
+    Limit = (Row == mScreen.Rows - 1) ? mScreen.Cols - 1 : mScreen.Cols;
+    Col   = 0;
+    while (Col < Limit) {
+      Index = Row * mScreen.Cols + Col;
+      if (mScreen.Back[Index] == mScreen.Shown[Index] && mScreen.BackAttr[Index] == mScreen.ShownAttr[Index]) {
+        Col++;
+        continue;
+      }
+      //
+      // Grow the span while the attribute holds; short unchanged gaps are resent rather
+      // than paying for another cursor escape sequence.
+      //
+      Attr  = mScreen.BackAttr[Index];
+      Start = Col;
+      End   = Col + 1;
+      for (J = Col + 1; J < Limit && mScreen.BackAttr[Row * mScreen.Cols + J] == Attr; J++) {
+        Index = Row * mScreen.Cols + J;
+        if (mScreen.Back[Index] != mScreen.Shown[Index] || mScreen.ShownAttr[Index] != Attr) {
+          End = J + 1;
+        } else if (J - End >= SCREEN_GAP_MERGE) {
+          break;
+        }
+      }
+      Index = Row * mScreen.Cols + Start;
+      CopyMem (mScreen.Run, &mScreen.Back[Index], (End - Start) * sizeof (CHAR16));
+      mScreen.Run[End - Start] = L'\0';
+      gST->ConOut->SetCursorPosition (gST->ConOut, Start, Row);
+      if (Attr != Current) {
+        gST->ConOut->SetAttribute (gST->ConOut, Attr);
+        Current = Attr;
+      }
+      gST->ConOut->OutputString (gST->ConOut, mScreen.Run);
+      CopyMem (&mScreen.Shown[Index], &mScreen.Back[Index], (End - Start) * sizeof (CHAR16));
+      SetMem (&mScreen.ShownAttr[Index], End - Start, Attr);
+      Col = End;
+    }
+  }
+
+  SetAttrNormal ();
+  gST->ConOut->SetCursorPosition (gST->ConOut, MIN (mScreen.Col, mScreen.Cols - 1), MIN (mScreen.Row, mScreen.Rows - 1));
 }
 
 STATIC BOOLEAN ReadKeyBlocking (OUT EFI_INPUT_KEY *Key) {
-  EFI_STATUS Status;
-  UINTN      Index;
+  EVENT_LOOP Loop;
   if (Key == NULL) return FALSE;
-  Status = gBS->WaitForEvent (1, &gST->ConIn->WaitForKey, &Index);
-  if (EFI_ERROR (Status)) return FALSE;
-  Status = gST->ConIn->ReadKeyStroke (gST->ConIn, Key);
-  return (BOOLEAN)!EFI_ERROR (Status);
+  EventLoopInit (&Loop);
+  EventLoopAdd (&Loop, gST->ConIn->WaitForKey, EventLoopReadKey, Key);
+  return (BOOLEAN)!EFI_ERROR (EventLoopRun (&Loop));
 }
 
 STATIC VOID DrainKeyBuffer (VOID) {
@@ -176,13 +1017,12 @@ STATIC VOID DrainKeyBuffer (VOID) {
 
 STATIC VOID WaitAnyKey (VOID) {
   EFI_INPUT_KEY Key;
+  if (mBatchMode) return;
   DrainKeyBuffer ();
   SetAttrHighlight ();
   Print (L"\nPress any key to continue");
   SetAttrNormal ();
-  while (TRUE) {
-    if (!EFI_ERROR (gST->ConIn->ReadKeyStroke (gST->ConIn, &Key))) break;
-  }
+  ReadKeyBlocking (&Key);
 }
 
 STATIC BOOLEAN PagePauseOrExit (VOID) {
@@ -191,17 +1031,30 @@ STATIC BOOLEAN PagePauseOrExit (VOID) {
   SetAttrHighlight ();
   Print (L"\nPress any key to continue, or 'q' to exit");
   SetAttrNormal ();
-  while (TRUE) {
-    if (!EFI_ERROR (gST->ConIn->ReadKeyStroke (gST->ConIn, &Key))) {
-      Print (L"\n");
-      if (Key.UnicodeChar == L'q' || Key.UnicodeChar == L'Q') return TRUE;
-      return FALSE;
-    }
-  }
+  if (!ReadKeyBlocking (&Key)) Key.UnicodeChar = L'q';          // no console input, stop paging
+  Print (L"\n");
+  return (BOOLEAN)(Key.UnicodeChar == L'q' || Key.UnicodeChar == L'Q');
 }
 
+//
+// Arrow-key navigation only changes two menu lines, so the renderer sends just those.
+// Falls back to a full reprint if the back buffer could not be allocated.
+//
 STATIC VOID ShowHeaderAndMenu (IN UINTN HighlightIndex) {
-  UINTN I;
+  UINTN I, First = 0, Visible;
+
+  if (ScreenBegin ()) {
+    Visible = (mScreen.Rows > 2) ? MIN (MENU_ITEMS_COUNT, mScreen.Rows - 2) : 1;
+    if (HighlightIndex < MENU_ITEMS_COUNT && HighlightIndex >= Visible) First = HighlightIndex - Visible + 1;
+    ScreenPuts (SCREEN_ATTR_HIGHLIGHT, L"<<Select The Action>>\n");
+    for (I = First; I < First + Visible; I++) {
+      ScreenPuts ((I == HighlightIndex) ? SCREEN_ATTR_HIGHLIGHT : SCREEN_ATTR_NORMAL, mMenuItems[I]);
+      ScreenPuts (SCREEN_ATTR_NORMAL, L"\n");
+    }
+    ScreenFlush ();
+    return;
+  }
+
   ClearScreenAndResetAttr ();
   SetAttrHighlight ();
   Print (L"<<Select The Action>>\n");
@@ -289,10 +1142,46 @@ STATIC BOOLEAN PromptHexUint64 (IN CONST CHAR16 *Prompt, OUT UINT64 *Value) {
   return ParseHex16ToUint64 (Buf, Value);
 }
 
+//
+// Parses "10 8B, 198 ..." (hex, separated by spaces/commas) into List.
+// Returns the number of entries, 0 on a syntax error or empty input.
+//
+STATIC UINTN ParseHexList32 (IN CHAR16 *Str, OUT UINT32 *List, IN UINTN MaxCount) {
+  UINTN  Count = 0;
+  CHAR16 *Token, Saved;
+  UINT64 Value;
+
+  while (*Str != L'\0') {
+    while (*Str == L' ' || *Str == L',') Str++;
+    if (*Str == L'\0') break;
+    Token = Str;
+    while (*Str != L'\0' && *Str != L' ' && *Str != L',') Str++;
+    Saved = *Str;
+    *Str  = L'\0';
+    if (Count >= MaxCount || !ParseHex16ToUint64 (Token, &Value) || Value > MAX_UINT32) return 0;
+    List[Count++] = (UINT32)Value;
+    *Str = Saved;
+  }
+  return Count;
+}
+
+STATIC VOID SortUint64 (IN OUT UINT64 *Values, IN UINTN Count) {
+  UINTN  Gap, I, J;
+  UINT64 Tmp;
+  for (Gap = Count / 2; Gap > 0; Gap /= 2) {
+    for (I = Gap; I < Count; I++) {
+      Tmp = Values[I];
+      for (J = I; J >= Gap && Values[J - Gap] > Tmp; J -= Gap) Values[J] = Values[J - Gap];
+      Values[J] = Tmp;
+    }
+  }
+}
+
 STATIC BOOLEAN PageLineAccountingEx (IN OUT UINTN *LineCount, IN VOID (*ReprintHeader)(VOID), IN UINTN HeaderLines) {
   if (LineCount == NULL) return FALSE;
   (*LineCount)++;
-  if (*LineCount >= PAGE_LINES_LIMIT) {
+  if (mBatchMode) return FALSE;
+  if (*LineCount >= ScreenPageLines ()) {
     if (PagePauseOrExit ()) return TRUE;
     if (ReprintHeader != NULL) {
       ReprintHeader ();
@@ -309,354 +1198,5617 @@ STATIC BOOLEAN PageLineAccountingEx (IN OUT UINTN *LineCount, IN VOID (*ReprintH
 // CPU Feature Functions
 // =====================================================
 //
-STATIC BOOLEAN CpuSupportsMsr (VOID) {
-  UINT32 Eax, Ebx, Ecx, Edx;
-  AsmCpuid (1, &Eax, &Ebx, &Ecx, &Edx);
-  return (BOOLEAN)((Edx & CPUID_FEAT_EDX_MSR) != 0);
-}
+STATIC CONST CPU_FEATURE_DESC mCpuFeatureDesc[CpuFeatMax] = {
+  { L"TSC",          0x00000001, 0, CpuidRegEdx,  4 },
+  { L"MSR",          0x00000001, 0, CpuidRegEdx,  5 },
+  { L"PAE",          0x00000001, 0, CpuidRegEdx,  6 },
+  { L"APIC",         0x00000001, 0, CpuidRegEdx,  9 },
+  { L"MTRR",         0x00000001, 0, CpuidRegEdx, 12 },
+  { L"PGE",          0x00000001, 0, CpuidRegEdx, 13 },
+  { L"PAT",          0x00000001, 0, CpuidRegEdx, 16 },
+  { L"CLFSH",        0x00000001, 0, CpuidRegEdx, 19 },
+  { L"SSE2",         0x00000001, 0, CpuidRegEdx, 26 },
+  { L"HTT",          0x00000001, 0, CpuidRegEdx, 28 },
+  { L"SSE3",         0x00000001, 0, CpuidRegEcx,  0 },
+  { L"MONITOR",      0x00000001, 0, CpuidRegEcx,  3 },
+  { L"VMX",          0x00000001, 0, CpuidRegEcx,  5 },
+  { L"SMX",          0x00000001, 0, CpuidRegEcx,  6 },
+  { L"EIST",         0x00000001, 0, CpuidRegEcx,  7 },
+  { L"PDCM",         0x00000001, 0, CpuidRegEcx, 15 },
+  { L"PCID",         0x00000001, 0, CpuidRegEcx, 17 },
+  { L"x2APIC",       0x00000001, 0, CpuidRegEcx, 21 },
+  { L"TSC-Deadline", 0x00000001, 0, CpuidRegEcx, 24 },
+  { L"XSAVE",        0x00000001, 0, CpuidRegEcx, 26 },
+  { L"OSXSAVE",      0x00000001, 0, CpuidRegEcx, 27 },
+  { L"AVX",          0x00000001, 0, CpuidRegEcx, 28 },
+  { L"RDRAND",       0x00000001, 0, CpuidRegEcx, 30 },
+  { L"Hypervisor",   0x00000001, 0, CpuidRegEcx, 31 },
+  { L"APERF/MPERF",  0x00000006, 0, CpuidRegEcx,  0 },
+  { L"Turbo",        0x00000006, 0, CpuidRegEax,  1 },
+  { L"HWP",          0x00000006, 0, CpuidRegEax,  7 },
+  { L"FSGSBASE",     0x00000007, 0, CpuidRegEbx,  0 },
+  { L"AVX2",         0x00000007, 0, CpuidRegEbx,  5 },
+  { L"SMEP",         0x00000007, 0, CpuidRegEbx,  7 },
+  { L"ERMS",         0x00000007, 0, CpuidRegEbx,  9 },
+  { L"INVPCID",      0x00000007, 0, CpuidRegEbx, 10 },
+  { L"RDT-M",        0x00000007, 0, CpuidRegEbx, 12 },
+  { L"RDT-A",        0x00000007, 0, CpuidRegEbx, 15 },
+  { L"AVX512F",      0x00000007, 0, CpuidRegEbx, 16 },
+  { L"RDSEED",       0x00000007, 0, CpuidRegEbx, 18 },
+  { L"SMAP",         0x00000007, 0, CpuidRegEbx, 20 },
+  { L"CLFLUSHOPT",   0x00000007, 0, CpuidRegEbx, 23 },
+  { L"CLWB",         0x00000007, 0, CpuidRegEbx, 24 },
+  { L"LA57",         0x00000007, 0, CpuidRegEcx, 16 },
+  { L"Hybrid",       0x00000007, 0, CpuidRegEdx, 15 },
+  { L"NX",           0x80000001, 0, CpuidRegEdx, 20 },
+  { L"1GB-Pages",    0x80000001, 0, CpuidRegEdx, 26 },
+  { L"RDTSCP",       0x80000001, 0, CpuidRegEdx, 27 },
+  { L"LongMode",     0x80000001, 0, CpuidRegEdx, 29 },
+  { L"SVM",          0x80000001, 0, CpuidRegEcx,  2 },
+  { L"InvariantTSC", 0x80000007, 0, CpuidRegEdx,  8 }
+};
 
-STATIC BOOLEAN CpuSupportsMtrr (VOID) {
-  UINT32 Eax, Ebx, Ecx, Edx;
-  AsmCpuid (1, &Eax, &Ebx, &Ecx, &Edx);
-  return (BOOLEAN)((Edx & CPUID_FEAT_EDX_MTRR) != 0);
+STATIC CONST CPUID_DB_ENTRY *CpuidDbAdd (IN UINT32 Leaf, IN UINT32 SubLeaf) {
+  CPUID_DB_ENTRY *Entry;
+  if (mCpuidDb.Count >= CPUID_DB_MAX_ENTRIES) return NULL;
+  Entry          = &mCpuidDb.Entries[mCpuidDb.Count++];
+  Entry->Leaf    = Leaf;
+  Entry->SubLeaf = SubLeaf;
+  AsmCpuidEx (Leaf, SubLeaf, &Entry->Eax, &Entry->Ebx, &Entry->Ecx, &Entry->Edx);
+  return Entry;
 }
 
-STATIC CONST CHAR16 *MtrrTypeToStr (IN UINT8 Type) {
-  switch (Type) {
-    case 0x00: return L"Uncacheable";
-    case 0x01: return L"Write-Combining";
-    case 0x04: return L"Write-Through";
-    case 0x05: return L"Write-Protect";
-    case 0x06: return L"Write-Back";
-    default:   return L"Reserved";
+STATIC CONST CPUID_DB_ENTRY *CpuidDbFind (IN UINT32 Leaf, IN UINT32 SubLeaf) {
+  UINTN                Lo = 0, Hi = mCpuidDb.Count, Mid;
+  CONST CPUID_DB_ENTRY *Entry;
+
+  while (Lo < Hi) {
+    Mid   = Lo + (Hi - Lo) / 2;
+    Entry = &mCpuidDb.Entries[Mid];
+    if (Entry->Leaf == Leaf && Entry->SubLeaf == SubLeaf) return Entry;
+    if (Entry->Leaf < Leaf || (Entry->Leaf == Leaf && Entry->SubLeaf < SubLeaf)) Lo = Mid + 1;
+    else Hi = Mid;
   }
+  return NULL;
 }
 
-STATIC CONST CHAR16 *MtrrTypeToShortStr (IN UINT8 Type) {
-  switch (Type) {
-    case 0x00: return L"UC";
-    case 0x01: return L"WC";
-    case 0x04: return L"WT";
-    case 0x05: return L"WP";
-    case 0x06: return L"WB";
-    default:   return L"RSV";
+//
+// Cached CPUID: returns FALSE (and zeros) for leaves outside the database.
+//
+STATIC BOOLEAN CpuidDbGet (IN UINT32 Leaf, IN UINT32 SubLeaf, OUT UINT32 *Eax, OUT UINT32 *Ebx, OUT UINT32 *Ecx, OUT UINT32 *Edx) {
+  CONST CPUID_DB_ENTRY *Entry = CpuidDbFind (Leaf, SubLeaf);
+  UINT32               Dummy;
+
+  if (Eax == NULL) Eax = &Dummy;
+  if (Ebx == NULL) Ebx = &Dummy;
+  if (Ecx == NULL) Ecx = &Dummy;
+  if (Edx == NULL) Edx = &Dummy;
+  if (Entry == NULL) {
+    *Eax = *Ebx = *Ecx = *Edx = 0;
+    return FALSE;
   }
+  *Eax = Entry->Eax; *Ebx = Entry->Ebx; *Ecx = Entry->Ecx; *Edx = Entry->Edx;
+  return TRUE;
 }
 
-STATIC UINT8 GetPhysicalAddressBits (VOID) {
-  UINT32 Eax, Ebx, Ecx, Edx;
-  AsmCpuid (0x80000000, &Eax, &Ebx, &Ecx, &Edx);
-  if (Eax < 0x80000008) return 36;
-  AsmCpuid (0x80000008, &Eax, &Ebx, &Ecx, &Edx);
-  if ((Eax & 0xFF) == 0) return 36;
-  return (UINT8)(Eax & 0xFF);
-}
+//
+// Returns the first entry of Leaf and the number of subleaves recorded for
+// it (entries of one leaf are contiguous), or NULL when Leaf is absent.
+//
+STATIC CONST CPUID_DB_ENTRY *CpuidDbLeaf (IN UINT32 Leaf, OUT UINTN *SubLeafCount) {
+  UINTN Lo = 0, Hi = mCpuidDb.Count, Mid, End;
 
-STATIC VOID PrintCpuidTableHeader (VOID) {
-  Print (L"Leaf/SubLeaf    EAX       EBX       ECX       EDX\n");
-  Print (L"------------------------------------------------------\n");
+  *SubLeafCount = 0;
+  while (Lo < Hi) {
+    Mid = Lo + (Hi - Lo) / 2;
+    if (mCpuidDb.Entries[Mid].Leaf < Leaf) Lo = Mid + 1;
+    else Hi = Mid;
+  }
+  if (Lo >= mCpuidDb.Count || mCpuidDb.Entries[Lo].Leaf != Leaf) return NULL;
+  for (End = Lo; End < mCpuidDb.Count && mCpuidDb.Entries[End].Leaf == Leaf; End++);
+  *SubLeafCount = End - Lo;
+  return &mCpuidDb.Entries[Lo];
 }
 
-STATIC VOID PrintMsrTableHeader (VOID) {
-  Print (L"MSR        Value\n");
-  Print (L"------------------------------\n");
+STATIC UINT32 CpuidDbReg (IN CONST CPUID_DB_ENTRY *Entry, IN CPUID_REG Reg) {
+  switch (Reg) {
+    case CpuidRegEax: return Entry->Eax;
+    case CpuidRegEbx: return Entry->Ebx;
+    case CpuidRegEcx: return Entry->Ecx;
+    default:          return Entry->Edx;
+  }
 }
 
-STATIC BOOLEAN PrintOneCpuidLeafLine (IN UINT32 Leaf, IN UINT32 SubLeaf, IN OUT UINTN *LineCount) {
-  UINT32 Eax, Ebx, Ecx, Edx;
-  AsmCpuidEx (Leaf, SubLeaf, &Eax, &Ebx, &Ecx, &Edx);
-  Print (L"%08x/%08x  %08x  %08x  %08x  %08x\n", Leaf, SubLeaf, Eax, Ebx, Ecx, Edx);
-  if (PageLineAccountingEx (LineCount, PrintCpuidTableHeader, 2)) return TRUE;
+//
+// Adds every subleaf of Leaf, using the leaf's own termination rule.
+// Leaves without subleaves only get subleaf 0.
+//
+STATIC BOOLEAN CpuidDbAddLeaf (IN UINT32 Leaf) {
+  CONST CPUID_DB_ENTRY *Sub0, *Sub;
+  UINT64               Mask;
+  UINT32               SubLeaf, Max;
+
+  Sub0 = CpuidDbAdd (Leaf, 0);
+  if (Sub0 == NULL) return FALSE;
+
+  switch (Leaf) {
+    case 0x4:          // deterministic cache parameters: stop at cache type 0
+    case 0x8000001D:
+      if ((Sub0->Eax & 0x1F) == 0) break;
+      for (SubLeaf = 1; SubLeaf < CPUID_DB_MAX_SUBLEAVES; SubLeaf++) {
+        Sub = CpuidDbAdd (Leaf, SubLeaf);
+        if (Sub == NULL) return FALSE;
+        if ((Sub->Eax & 0x1F) == 0) break;
+      }
+      break;
+
+    case 0xB:          // topology: stop at level type 0 (ECX[15:8])
+    case 0x1F:
+      if (((Sub0->Ecx >> 8) & 0xFF) == 0) break;
+      for (SubLeaf = 1; SubLeaf < CPUID_DB_MAX_SUBLEAVES; SubLeaf++) {
+        Sub = CpuidDbAdd (Leaf, SubLeaf);
+        if (Sub == NULL) return FALSE;
+        if (((Sub->Ecx >> 8) & 0xFF) == 0) break;
+      }
+      break;
+
+    case 0x7:          // subleaf 0 EAX holds the highest valid subleaf
+    case 0x14:
+    case 0x17:
+    case 0x18:
+      Max = MIN (Sub0->Eax, CPUID_DB_MAX_SUBLEAVES - 1);
+      for (SubLeaf = 1; SubLeaf <= Max; SubLeaf++) {
+        if (CpuidDbAdd (Leaf, SubLeaf) == NULL) return FALSE;
+      }
+      break;
+
+    case 0xD:          // XSAVE: subleaf 1, then one per supported state component
+      Sub = CpuidDbAdd (Leaf, 1);
+      if (Sub == NULL) return FALSE;
+      Mask = LShiftU64 (Sub0->Edx, 32) | Sub0->Eax | LShiftU64 (Sub->Edx, 32) | Sub->Ecx;
+      for (SubLeaf = 2; SubLeaf < CPUID_DB_MAX_SUBLEAVES; SubLeaf++) {
+        if ((RShiftU64 (Mask, SubLeaf) & 1) == 0) continue;
+        if (CpuidDbAdd (Leaf, SubLeaf) == NULL) return FALSE;
+      }
+      break;
+
+    case 0xF:          // RDT monitoring: one subleaf per resource in EDX
+    case 0x10:         // RDT allocation: one subleaf per resource in EBX
+      Mask = (Leaf == 0xF) ? Sub0->Edx : Sub0->Ebx;
+      for (SubLeaf = 1; SubLeaf < 32; SubLeaf++) {
+        if ((Mask & (1u << SubLeaf)) == 0) continue;
+        if (CpuidDbAdd (Leaf, SubLeaf) == NULL) return FALSE;
+      }
+      break;
+
+    case 0x12:         // SGX (CPUID.7.0:EBX[2]): subleaf 1, then EPC sections until type 0
+      if (!CpuidDbGet (7, 0, NULL, &Max, NULL, NULL) || (Max & BIT2) == 0) break;
+      if (CpuidDbAdd (Leaf, 1) == NULL) return FALSE;
+      for (SubLeaf = 2; SubLeaf < CPUID_DB_MAX_SUBLEAVES; SubLeaf++) {
+        Sub = CpuidDbAdd (Leaf, SubLeaf);
+        if (Sub == NULL) return FALSE;
+        if ((Sub->Eax & 0xF) == 0) break;
+      }
+      break;
+
+    default:
+      break;
+  }
+  return TRUE;
+}
+
+//
+// Adds every leaf in [First, Last] (with subleaves), clamped to a sane range.
+//
+STATIC VOID CpuidDbAddRange (IN UINT32 First, IN UINT32 Last) {
+  UINT32 Leaf;
+  if (Last < First) return;
+  if (Last - First >= CPUID_DB_MAX_RANGE_LEAVES) Last = First + CPUID_DB_MAX_RANGE_LEAVES - 1;
+  for (Leaf = First; Leaf <= Last; Leaf++) {
+    if (!CpuidDbAddLeaf (Leaf)) return;
+  }
+}
+
+STATIC VOID CpuidDbDecode (VOID) {
+  CONST CPUID_DB_ENTRY *Entry;
+  UINT32               Eax, Ebx, Ecx, Edx, BaseFamily, BaseModel;
+  UINT32               *Brand;
+  UINTN                I;
+
+  CpuidDbGet (1, 0, &Eax, &Ebx, &Ecx, &Edx);
+  mCpuidDb.Signature = Eax;
+  BaseFamily         = (Eax >> 8) & 0xF;
+  BaseModel          = (Eax >> 4) & 0xF;
+  mCpuidDb.Stepping  = Eax & 0xF;
+  mCpuidDb.Family    = (BaseFamily == 0xF) ? BaseFamily + ((Eax >> 20) & 0xFF) : BaseFamily;
+  mCpuidDb.Model     = (BaseFamily == 0x6 || BaseFamily == 0xF) ? (((Eax >> 16) & 0xF) << 4) | BaseModel : BaseModel;
+
+  for (I = 0; I < CpuFeatMax; I++) {
+    Entry = CpuidDbFind (mCpuFeatureDesc[I].Leaf, mCpuFeatureDesc[I].SubLeaf);
+    mCpuidDb.Features[I] = (BOOLEAN)(Entry != NULL && (CpuidDbReg (Entry, mCpuFeatureDesc[I].Reg) & (1u << mCpuFeatureDesc[I].Bit)) != 0);
+  }
+
+  mCpuidDb.PhysAddrBits   = 36;
+  mCpuidDb.LinearAddrBits = 48;
+  if (CpuidDbGet (0x80000008, 0, &Eax, NULL, NULL, NULL) && (Eax & 0xFF) != 0) {
+    mCpuidDb.PhysAddrBits   = (UINT8)(Eax & 0xFF);
+    mCpuidDb.LinearAddrBits = (UINT8)((Eax >> 8) & 0xFF);
+  }
+
+  if (mCpuidDb.MaxExtLeaf >= 0x80000004) {
+    Brand = (UINT32 *)mCpuidDb.Brand;
+    CpuidDbGet (0x80000002, 0, &Brand[0], &Brand[1],  &Brand[2],  &Brand[3]);
+    CpuidDbGet (0x80000003, 0, &Brand[4], &Brand[5],  &Brand[6],  &Brand[7]);
+    CpuidDbGet (0x80000004, 0, &Brand[8], &Brand[9],  &Brand[10], &Brand[11]);
+  }
+}
+
+//
+// Executes CPUID once per leaf/subleaf at startup. Everything else reads
+// from mCpuidDb so menu actions do not cost a VM exit per check; only
+// explicit "live" queries (DoCpuId, per-CPU APIC ID) still run CPUID.
+//
+STATIC VOID CpuidDbBuild (VOID) {
+  UINT32 Eax, Ebx, Ecx, Edx;
+
+  ZeroMem (&mCpuidDb, sizeof (mCpuidDb));
+
+  AsmCpuid (0, &Eax, &Ebx, &Ecx, &Edx);
+  mCpuidDb.MaxBasicLeaf = Eax;
+  *(UINT32 *)&mCpuidDb.Vendor[0] = Ebx; *(UINT32 *)&mCpuidDb.Vendor[4] = Edx; *(UINT32 *)&mCpuidDb.Vendor[8] = Ecx;
+  mCpuidDb.IsIntel = (BOOLEAN)(Ebx == SIGNATURE_32 ('G', 'e', 'n', 'u'));
+  mCpuidDb.IsAmd   = (BOOLEAN)(Ebx == SIGNATURE_32 ('A', 'u', 't', 'h') || Ebx == SIGNATURE_32 ('H', 'y', 'g', 'o'));
+  CpuidDbAddRange (0, mCpuidDb.MaxBasicLeaf);
+
+  // Hypervisor range is only architecturally defined when CPUID.1:ECX[31] is set
+  CpuidDbGet (1, 0, NULL, NULL, &Ecx, NULL);
+  if ((Ecx & BIT31) != 0) {
+    AsmCpuid (CPUID_HYPERVISOR_BASE, &Eax, &Ebx, &Ecx, &Edx);
+    // Some hypervisors (older KVM) report 0 here, meaning "up to 0x40000001"
+    mCpuidDb.MaxHypervisorLeaf = (Eax < CPUID_HYPERVISOR_BASE + 1) ? CPUID_HYPERVISOR_BASE + 1 : Eax;
+    *(UINT32 *)&mCpuidDb.HypervisorVendor[0] = Ebx; *(UINT32 *)&mCpuidDb.HypervisorVendor[4] = Ecx; *(UINT32 *)&mCpuidDb.HypervisorVendor[8] = Edx;
+    CpuidDbAddRange (CPUID_HYPERVISOR_BASE, mCpuidDb.MaxHypervisorLeaf);
+  }
+
+  AsmCpuid (CPUID_EXTENDED_BASE, &Eax, &Ebx, &Ecx, &Edx);
+  if (Eax >= CPUID_EXTENDED_BASE) {
+    mCpuidDb.MaxExtLeaf = Eax;
+    CpuidDbAddRange (CPUID_EXTENDED_BASE, mCpuidDb.MaxExtLeaf);
+  }
+
+  CpuidDbDecode ();
+  mCpuidDb.Valid = TRUE;
+}
+
+#define CPU_HAS(Feature)             (mCpuidDb.Features[(Feature)])
+
+STATIC BOOLEAN CpuSupportsMsr (VOID) {
+  return CPU_HAS (CpuFeatMsr);
+}
+
+STATIC BOOLEAN CpuSupportsMtrr (VOID) {
+  return CPU_HAS (CpuFeatMtrr);
+}
+
+STATIC BOOLEAN CpuIsAmd (VOID) {
+  return mCpuidDb.IsAmd;
+}
+
+STATIC CONST CHAR16 *MtrrTypeToStr (IN UINT8 Type) {
+  switch (Type) {
+    case 0x00: return L"Uncacheable";
+    case 0x01: return L"Write-Combining";
+    case 0x04: return L"Write-Through";
+    case 0x05: return L"Write-Protect";
+    case 0x06: return L"Write-Back";
+    case MTRR_TYPE_UNDEFINED: return L"Undefined (overlap)";
+    default:   return L"Reserved";
+  }
+}
+
+STATIC CONST CHAR16 *MtrrTypeToShortStr (IN UINT8 Type) {
+  switch (Type) {
+    case 0x00: return L"UC";
+    case 0x01: return L"WC";
+    case 0x04: return L"WT";
+    case 0x05: return L"WP";
+    case 0x06: return L"WB";
+    case MTRR_TYPE_UNDEFINED: return L"??";
+    default:   return L"RSV";
+  }
+}
+
+STATIC UINT8 GetPhysicalAddressBits (VOID) {
+  return mCpuidDb.PhysAddrBits;
+}
+
+STATIC VOID PrintCpuidTableHeader (VOID) {
+  Print (L"Leaf/SubLeaf    EAX       EBX       ECX       EDX\n");
+  Print (L"------------------------------------------------------\n");
+}
+
+STATIC VOID PrintMsrTableHeader (VOID) {
+  Print (L"MSR        Value\n");
+  Print (L"------------------------------\n");
+}
+
+STATIC BOOLEAN PrintOneCpuidLeafLine (IN CONST CPUID_DB_ENTRY *Entry, IN OUT UINTN *LineCount) {
+  Print (L"%08x/%08x  %08x  %08x  %08x  %08x\n", Entry->Leaf, Entry->SubLeaf, Entry->Eax, Entry->Ebx, Entry->Ecx, Entry->Edx);
+  if (PageLineAccountingEx (LineCount, PrintCpuidTableHeader, 2)) return TRUE;
+  return FALSE;
+}
+
+//
+// Prints every database entry with Leaf in [First, Last].
+//
+STATIC BOOLEAN PrintCpuidDbRange (IN UINT32 First, IN UINT32 Last, IN OUT UINTN *LineCount) {
+  UINTN I;
+  for (I = 0; I < mCpuidDb.Count; I++) {
+    if (mCpuidDb.Entries[I].Leaf < First || mCpuidDb.Entries[I].Leaf > Last) continue;
+    if (PrintOneCpuidLeafLine (&mCpuidDb.Entries[I], LineCount)) return TRUE;
+  }
+  return FALSE;
+}
+
+STATIC VOID PrintBrandStringIfSupported (VOID) {
+  if (mCpuidDb.MaxExtLeaf >= 0x80000004) {
+    Print (L"\nBrand String : %a\n", mCpuidDb.Brand);
+  }
+}
+
+//
+// Prints a +/- flag list for Desc[0..Count-1], evaluated against the database.
+//
+STATIC BOOLEAN PrintCpuidBitList (IN CONST CHAR16 *Title, IN CONST CPU_FEATURE_DESC *Desc, IN UINTN Count, IN OUT UINTN *LineCount) {
+  CONST CPUID_DB_ENTRY *Entry;
+  BOOLEAN              Set;
+  UINTN                I, Col = 0;
+
+  Print (L"\n[%s]  (+ supported, - not supported)\n", Title);
+  if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+  if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+  for (I = 0; I < Count; I++) {
+    Entry = CpuidDbFind (Desc[I].Leaf, Desc[I].SubLeaf);
+    Set   = (BOOLEAN)(Entry != NULL && (CpuidDbReg (Entry, Desc[I].Reg) & (1u << Desc[I].Bit)) != 0);
+    Print (L"%c%-14s", Set ? L'+' : L'-', Desc[I].Name);
+    if (++Col == 5 || I == Count - 1) {
+      Col = 0;
+      Print (L"\n");
+      if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+STATIC BOOLEAN PrintCpuFeatureFlags (IN OUT UINTN *LineCount) {
+  return PrintCpuidBitList (L"Decoded Feature Flags", mCpuFeatureDesc, CpuFeatMax, LineCount);
+}
+
+//
+// KVM: CPUID 0x40000001 EAX feature bits, EDX hints.
+//
+STATIC CONST CPU_FEATURE_DESC mKvmFeatureDesc[] = {
+  { L"Clocksource",  0x40000001, 0, CpuidRegEax,  0 },
+  { L"NopIoDelay",   0x40000001, 0, CpuidRegEax,  1 },
+  { L"Clocksource2", 0x40000001, 0, CpuidRegEax,  3 },
+  { L"AsyncPf",      0x40000001, 0, CpuidRegEax,  4 },
+  { L"StealTime",    0x40000001, 0, CpuidRegEax,  5 },
+  { L"PvEoi",        0x40000001, 0, CpuidRegEax,  6 },
+  { L"PvUnhalt",     0x40000001, 0, CpuidRegEax,  7 },
+  { L"PvTlbFlush",   0x40000001, 0, CpuidRegEax,  9 },
+  { L"AsyncPfVmexit",0x40000001, 0, CpuidRegEax, 10 },
+  { L"PvSendIpi",    0x40000001, 0, CpuidRegEax, 11 },
+  { L"PollControl",  0x40000001, 0, CpuidRegEax, 12 },
+  { L"PvSchedYield", 0x40000001, 0, CpuidRegEax, 13 },
+  { L"AsyncPfInt",   0x40000001, 0, CpuidRegEax, 14 },
+  { L"MsiExtDestId", 0x40000001, 0, CpuidRegEax, 15 },
+  { L"MapGpaRange",  0x40000001, 0, CpuidRegEax, 16 },
+  { L"MigrationCtl", 0x40000001, 0, CpuidRegEax, 17 },
+  { L"ClockStable",  0x40000001, 0, CpuidRegEax, 24 },
+  { L"RealtimeHint", 0x40000001, 0, CpuidRegEdx,  0 }
+};
+
+//
+// Hyper-V: partition privileges (0x40000003 EAX), features (0x40000003 EDX)
+// and implementation recommendations (0x40000004 EAX).
+//
+STATIC CONST CPU_FEATURE_DESC mHyperVFeatureDesc[] = {
+  { L"VpRuntime",    0x40000003, 0, CpuidRegEax,  0 },
+  { L"RefCounter",   0x40000003, 0, CpuidRegEax,  1 },
+  { L"SynIC",        0x40000003, 0, CpuidRegEax,  2 },
+  { L"SynthTimers",  0x40000003, 0, CpuidRegEax,  3 },
+  { L"ApicMsrs",     0x40000003, 0, CpuidRegEax,  4 },
+  { L"HypercallMsr", 0x40000003, 0, CpuidRegEax,  5 },
+  { L"VpIndex",      0x40000003, 0, CpuidRegEax,  6 },
+  { L"ResetMsr",     0x40000003, 0, CpuidRegEax,  7 },
+  { L"StatsMsr",     0x40000003, 0, CpuidRegEax,  8 },
+  { L"RefTsc",       0x40000003, 0, CpuidRegEax,  9 },
+  { L"GuestIdle",    0x40000003, 0, CpuidRegEax, 10 },
+  { L"FreqMsrs",     0x40000003, 0, CpuidRegEax, 11 },
+  { L"DebugMsrs",    0x40000003, 0, CpuidRegEax, 12 },
+  { L"Reenlighten",  0x40000003, 0, CpuidRegEax, 13 },
+  { L"XmmHcInput",   0x40000003, 0, CpuidRegEdx,  4 },
+  { L"GuestIdleSt",  0x40000003, 0, CpuidRegEdx,  5 },
+  { L"NumaDistance", 0x40000003, 0, CpuidRegEdx,  7 },
+  { L"TimerFreqs",   0x40000003, 0, CpuidRegEdx,  8 },
+  { L"CrashMsrs",    0x40000003, 0, CpuidRegEdx, 10 },
+  { L"XmmHcOutput",  0x40000003, 0, CpuidRegEdx, 15 },
+  { L"DirectTimers", 0x40000003, 0, CpuidRegEdx, 19 },
+  { L"HcAsSwitch",   0x40000004, 0, CpuidRegEax,  0 },
+  { L"HcLocalFlush", 0x40000004, 0, CpuidRegEax,  1 },
+  { L"HcRemoteFlsh", 0x40000004, 0, CpuidRegEax,  2 },
+  { L"MsrApicRegs",  0x40000004, 0, CpuidRegEax,  3 },
+  { L"MsrReset",     0x40000004, 0, CpuidRegEax,  4 },
+  { L"RelaxTiming",  0x40000004, 0, CpuidRegEax,  5 },
+  { L"x2ApicMsrs",   0x40000004, 0, CpuidRegEax,  8 },
+  { L"ClusterIpi",   0x40000004, 0, CpuidRegEax, 10 },
+  { L"ExProcMasks",  0x40000004, 0, CpuidRegEax, 11 },
+  { L"Nested",       0x40000004, 0, CpuidRegEax, 12 },
+  { L"EnlightVmcs",  0x40000004, 0, CpuidRegEax, 14 }
+};
+
+STATIC BOOLEAN PrintHypervisorInfo (IN OUT UINTN *LineCount) {
+  UINT32 Eax, Ebx, Ecx, Edx;
+
+  Print (L"\n[CPUID Hypervisor]\n");
+  if (PageLineAccountingEx (LineCount, PrintCpuidTableHeader, 2)) return TRUE;
+  if (mCpuidDb.MaxHypervisorLeaf == 0) {
+    Print (L"Not running under a hypervisor (CPUID.1:ECX[31] = 0)\n");
+    return PageLineAccountingEx (LineCount, PrintCpuidTableHeader, 2);
+  }
+  Print (L"Vendor         : %a   Max Leaf : 0x%08x\n", mCpuidDb.HypervisorVendor, mCpuidDb.MaxHypervisorLeaf);
+  if (PageLineAccountingEx (LineCount, PrintCpuidTableHeader, 2)) return TRUE;
+  PrintCpuidTableHeader ();
+  *LineCount = 2;
+  if (PrintCpuidDbRange (CPUID_HYPERVISOR_BASE, CPUID_EXTENDED_BASE - 1, LineCount)) return TRUE;
+
+  if (CompareMem (mCpuidDb.HypervisorVendor, "KVMKVMKVM", 9) == 0) {
+    return PrintCpuidBitList (L"KVM Features", mKvmFeatureDesc, ARRAY_SIZE (mKvmFeatureDesc), LineCount);
+  }
+  if (CompareMem (mCpuidDb.HypervisorVendor, "Microsoft Hv", 12) == 0) {
+    CpuidDbGet (0x40000002, 0, &Eax, &Ebx, &Ecx, &Edx);
+    Print (L"\nHyper-V version %d.%d build %d\n", Ebx >> 16, Ebx & 0xFFFF, Eax);
+    if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    return PrintCpuidBitList (L"Hyper-V Enlightenments", mHyperVFeatureDesc, ARRAY_SIZE (mHyperVFeatureDesc), LineCount);
+  }
+  return FALSE;
+}
+
+STATIC CONST CHAR16 *CpuidCacheTypeStr (IN UINT32 Type) {
+  switch (Type) {
+    case 1:  return L"Data";
+    case 2:  return L"Instruction";
+    case 3:  return L"Unified";
+    default: return L"Unknown";
+  }
+}
+
+STATIC CONST CHAR16 *CpuidTopologyLevelStr (IN UINT32 Type) {
+  switch (Type) {
+    case 1:  return L"SMT";
+    case 2:  return L"Core";
+    case 3:  return L"Module";
+    case 4:  return L"Tile";
+    case 5:  return L"Die";
+    case 6:  return L"DieGrp";
+    default: return L"Unknown";
+  }
+}
+
+//
+// Deterministic cache parameters: leaf 4 on Intel, else 0x8000001D (AMD).
+// Count covers the subleaves before the first null cache type.
+//
+STATIC CONST CPUID_DB_ENTRY *CpuidCacheLeaf (OUT UINTN *Count) {
+  CONST CPUID_DB_ENTRY *Entry;
+  UINTN                I;
+
+  Entry = CpuidDbLeaf (0x4, Count);
+  if (Entry == NULL || (Entry->Eax & 0x1F) == 0) Entry = CpuidDbLeaf (0x8000001D, Count);
+  for (I = 0; Entry != NULL && I < *Count && (Entry[I].Eax & 0x1F) != 0; I++);
+  *Count = I;
+  return (I == 0) ? NULL : Entry;
+}
+
+//
+// One cache-parameter subleaf to level/type/geometry; Size = ways * partitions
+// * line size * sets.
+//
+STATIC VOID CpuidCacheDecode (IN CONST CPUID_DB_ENTRY *Entry, OUT CPU_CACHE_INFO *Info) {
+  UINT32 Partitions = ((Entry->Ebx >> 12) & 0x3FF) + 1;
+
+  Info->Level    = (UINT8)((Entry->Eax >> 5) & 0x7);
+  Info->Type     = (UINT8)(Entry->Eax & 0x1F);
+  Info->Ways     = ((Entry->Ebx >> 22) & 0x3FF) + 1;
+  Info->LineSize = (Entry->Ebx & 0xFFF) + 1;
+  Info->Sets     = Entry->Ecx + 1;
+  Info->SharedBy = ((Entry->Eax >> 14) & 0xFFF) + 1;
+  Info->Size     = (UINT64)Info->Ways * Partitions * Info->LineSize * Info->Sets;
+}
+
+//
+// Decodes the multi-subleaf leaves (cache hierarchy, topology, XSAVE layout)
+// straight from the database.
+//
+STATIC BOOLEAN PrintCpuidSubleafSummary (IN OUT UINTN *LineCount) {
+  CONST CPUID_DB_ENTRY *Entry;
+  CPU_CACHE_INFO       Cache;
+  UINTN                Count, I;
+
+  Entry = CpuidCacheLeaf (&Count);
+  if (Entry != NULL) {
+    Print (L"\n[Cache Hierarchy]  (CPUID 0x%x)\n", Entry->Leaf);
+    if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    for (I = 0; I < Count; I++) {
+      CpuidCacheDecode (&Entry[I], &Cache);
+      Print (L"  L%d %-11s %6d KB  %2d-way  %3d B line  %5d sets  shared by %d\n",
+             Cache.Level, CpuidCacheTypeStr (Cache.Type), (UINT32)(Cache.Size / 1024),
+             Cache.Ways, Cache.LineSize, Cache.Sets, Cache.SharedBy);
+      if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    }
+  }
+
+  Entry = CpuidDbLeaf (0x1F, &Count);
+  if (Entry == NULL || ((Entry->Ecx >> 8) & 0xFF) == 0) Entry = CpuidDbLeaf (0xB, &Count);
+  if (Entry != NULL && ((Entry->Ecx >> 8) & 0xFF) != 0) {
+    Print (L"\n[Topology]  (CPUID 0x%x, x2APIC ID of this CPU %08x)\n", Entry->Leaf, Entry->Edx);
+    if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    for (I = 0; I < Count && ((Entry[I].Ecx >> 8) & 0xFF) != 0; I++) {
+      Print (L"  %-7s APIC ID shift %2d  logical CPUs at this level %d\n",
+             CpuidTopologyLevelStr ((Entry[I].Ecx >> 8) & 0xFF), Entry[I].Eax & 0x1F, Entry[I].Ebx & 0xFFFF);
+      if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    }
+  }
+
+  Entry = CpuidDbLeaf (0xD, &Count);
+  if (Entry != NULL && Count >= 2 && (Entry->Eax | Entry->Edx) != 0) {
+    Print (L"\n[XSAVE Layout]  XCR0 mask %08x%08x  size(XCR0) %d  max size %d  size(XCR0|XSS) %d\n",
+           Entry[0].Edx, Entry[0].Eax, Entry[0].Ebx, Entry[0].Ecx, Entry[1].Ebx);
+    if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    for (I = 2; I < Count; I++) {
+      Print (L"  Component %2d  size %5d  offset %5d  %s\n", Entry[I].SubLeaf, Entry[I].Eax, Entry[I].Ebx,
+             (Entry[I].Ecx & BIT0) ? L"(supervisor)" : L"(user)");
+      if (PageLineAccountingEx (LineCount, NULL, 0)) return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+STATIC VOID PrintFixedMtrrDecoded8Types (IN UINT64 Val) {
+  UINTN B;
+  for (B = 0; B < 8; B++) {
+    UINT8 Type = (UINT8)((Val >> (B * 8)) & 0xFF);
+    Print (L"%s%s", MtrrTypeToShortStr (Type), (B == 7) ? L"" : L" ");
+  }
+}
+
+//
+// =====================================================
+// Valid-MSR Index Cache (persisted on the boot volume)
+// =====================================================
+//
+STATIC UINT32 GetMicrocodeRevision (VOID) {
+  UINT32 Eax, Ebx, Ecx, Edx;
+  UINT64 Value;
+
+  if (CpuIsAmd ()) {
+    // AMD: MSR 0x8B is PATCH_LEVEL, revision in the low dword
+    if (!SafeReadMsr (MSR_IA32_BIOS_SIGN_ID, &Value)) return 0;
+    return (UINT32)Value;
+  }
+
+  // Intel: clear BIOS_SIGN_ID, CPUID(1) latches the revision into EDX:EAX
+  SafeWriteMsr (MSR_IA32_BIOS_SIGN_ID, 0);
+  AsmCpuid (1, &Eax, &Ebx, &Ecx, &Edx);
+  if (!SafeReadMsr (MSR_IA32_BIOS_SIGN_ID, &Value)) return 0;
+  return (UINT32)RShiftU64 (Value, 32);
+}
+
+STATIC VOID IntervalSetFree (IN OUT MSR_INTERVAL_SET *Set) {
+  if (Set->Items != NULL) FreePool (Set->Items);
+  Set->Items    = NULL;
+  Set->Count    = 0;
+  Set->Capacity = 0;
+}
+
+STATIC BOOLEAN IntervalSetReserve (IN OUT MSR_INTERVAL_SET *Set, IN UINTN Needed) {
+  MSR_INTERVAL *NewItems;
+  UINTN        NewCapacity;
+
+  if (Needed <= Set->Capacity) return TRUE;
+  NewCapacity = Set->Capacity + MSR_INTERVAL_GROW;
+  if (NewCapacity < Needed) NewCapacity = Needed;
+
+  NewItems = ReallocatePool (Set->Capacity * sizeof (MSR_INTERVAL), NewCapacity * sizeof (MSR_INTERVAL), Set->Items);
+  if (NewItems == NULL) return FALSE;
+  Set->Items    = NewItems;
+  Set->Capacity = NewCapacity;
+  return TRUE;
+}
+
+//
+// Returns the position of the first interval whose Last >= Index (Count if none).
+//
+STATIC UINTN IntervalSetLowerBound (IN CONST MSR_INTERVAL_SET *Set, IN UINT32 Index) {
+  UINTN Lo = 0, Hi = Set->Count, Mid;
+  while (Lo < Hi) {
+    Mid = Lo + (Hi - Lo) / 2;
+    if (Set->Items[Mid].Last < Index) Lo = Mid + 1;
+    else Hi = Mid;
+  }
+  return Lo;
+}
+
+STATIC BOOLEAN IntervalSetContains (IN CONST MSR_INTERVAL_SET *Set, IN UINT32 Index) {
+  UINTN Pos = IntervalSetLowerBound (Set, Index);
+  return (BOOLEAN)(Pos < Set->Count && Set->Items[Pos].First <= Index);
+}
+
+//
+// Inserts [First, Last] and coalesces it with every overlapping or adjacent interval.
+//
+STATIC BOOLEAN IntervalSetAdd (IN OUT MSR_INTERVAL_SET *Set, IN UINT32 First, IN UINT32 Last) {
+  UINTN  Lo, Hi;
+  UINT32 NewFirst = First, NewLast = Last;
+
+  // First interval that overlaps or touches First (Last + 1 >= First)
+  Lo = IntervalSetLowerBound (Set, (First == 0) ? 0 : First - 1);
+  Hi = Lo;
+  while (Hi < Set->Count && (UINT64)Set->Items[Hi].First <= (UINT64)Last + 1) {
+    if (Set->Items[Hi].First < NewFirst) NewFirst = Set->Items[Hi].First;
+    if (Set->Items[Hi].Last  > NewLast)  NewLast  = Set->Items[Hi].Last;
+    Hi++;
+  }
+
+  if (Hi == Lo) {
+    if (!IntervalSetReserve (Set, Set->Count + 1)) return FALSE;
+    CopyMem (&Set->Items[Lo + 1], &Set->Items[Lo], (Set->Count - Lo) * sizeof (MSR_INTERVAL));
+    Set->Count++;
+  } else if (Hi > Lo + 1) {
+    CopyMem (&Set->Items[Lo + 1], &Set->Items[Hi], (Set->Count - Hi) * sizeof (MSR_INTERVAL));
+    Set->Count -= (Hi - Lo - 1);
+  }
+  Set->Items[Lo].First = NewFirst;
+  Set->Items[Lo].Last  = NewLast;
+  return TRUE;
+}
+
+//
+// Removes [First, Last] from the set, trimming or splitting intervals as needed.
+//
+STATIC BOOLEAN IntervalSetRemoveRange (IN OUT MSR_INTERVAL_SET *Set, IN UINT32 First, IN UINT32 Last) {
+  UINTN        Pos = IntervalSetLowerBound (Set, First);
+  MSR_INTERVAL *Item;
+
+  while (Pos < Set->Count && Set->Items[Pos].First <= Last) {
+    Item = &Set->Items[Pos];
+    if (Item->First < First && Item->Last > Last) {
+      if (!IntervalSetReserve (Set, Set->Count + 1)) return FALSE;
+      Item = &Set->Items[Pos];
+      CopyMem (Item + 1, Item, (Set->Count - Pos) * sizeof (MSR_INTERVAL));
+      Set->Count++;
+      Item[0].Last  = First - 1;
+      Item[1].First = Last + 1;
+      return TRUE;
+    }
+    if (Item->First < First) {
+      Item->Last = First - 1;
+      Pos++;
+      continue;
+    }
+    if (Item->Last > Last) {
+      Item->First = Last + 1;
+      break;
+    }
+    CopyMem (Item, Item + 1, (Set->Count - Pos - 1) * sizeof (MSR_INTERVAL));
+    Set->Count--;
+  }
+  return TRUE;
+}
+
+STATIC EFI_STATUS OpenBootVolumeRoot (OUT EFI_FILE_PROTOCOL **Root) {
+  EFI_STATUS                      Status;
+  EFI_LOADED_IMAGE_PROTOCOL       *LoadedImage;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *Fs;
+
+  Status = gBS->HandleProtocol (gImageHandle, &gEfiLoadedImageProtocolGuid, (VOID **)&LoadedImage);
+  if (EFI_ERROR (Status)) return Status;
+  Status = gBS->HandleProtocol (LoadedImage->DeviceHandle, &gEfiSimpleFileSystemProtocolGuid, (VOID **)&Fs);
+  if (EFI_ERROR (Status)) return Status;
+  return Fs->OpenVolume (Fs, Root);
+}
+
+STATIC VOID MsrCacheBuildPath (OUT CHAR16 *Path, IN UINTN PathChars) {
+  UnicodeSPrint (Path, PathChars * sizeof (CHAR16), L"%s\\MsrIdx-%08X-%08X.bin",
+                 MSR_CACHE_DIR, mMsrCache.CpuSignature, mMsrCache.MicrocodeRev);
+}
+
+STATIC EFI_STATUS MsrCacheReadSet (IN EFI_FILE_PROTOCOL *File, IN UINT32 Count, OUT MSR_INTERVAL_SET *Set) {
+  EFI_STATUS Status;
+  UINTN      Size;
+
+  if (Count == 0) return EFI_SUCCESS;
+  if (!IntervalSetReserve (Set, Count)) return EFI_OUT_OF_RESOURCES;
+  Size   = Count * sizeof (MSR_INTERVAL);
+  Status = File->Read (File, &Size, Set->Items);
+  if (EFI_ERROR (Status)) return Status;
+  if (Size != Count * sizeof (MSR_INTERVAL)) return EFI_VOLUME_CORRUPTED;
+  Set->Count = Count;
+  return EFI_SUCCESS;
+}
+
+//
+// Loads the index for the running CPU signature + microcode revision.
+// A missing or mismatching file just leaves the cache empty.
+//
+STATIC VOID MsrCacheLoad (VOID) {
+  EFI_STATUS            Status;
+  EFI_FILE_PROTOCOL     *Root, *File;
+  MSR_CACHE_FILE_HEADER Header;
+  CHAR16                Path[MSR_CACHE_PATH_LEN];
+  UINTN                 Size;
+
+  if (mMsrCache.Loaded) return;
+  mMsrCache.Loaded = TRUE;
+
+  mMsrCache.CpuSignature = mCpuidDb.Signature;
+  mMsrCache.MicrocodeRev = GetMicrocodeRevision ();
+
+  if (EFI_ERROR (OpenBootVolumeRoot (&Root))) return;
+  MsrCacheBuildPath (Path, MSR_CACHE_PATH_LEN);
+  Status = Root->Open (Root, &File, Path, EFI_FILE_MODE_READ, 0);
+  if (EFI_ERROR (Status)) { Root->Close (Root); return; }
+
+  Size   = sizeof (Header);
+  Status = File->Read (File, &Size, &Header);
+  if (!EFI_ERROR (Status) && Size == sizeof (Header) &&
+      Header.Signature == MSR_CACHE_SIGNATURE && Header.Version == MSR_CACHE_VERSION &&
+      Header.CpuSignature == mMsrCache.CpuSignature && Header.MicrocodeRev == mMsrCache.MicrocodeRev) {
+    Status = MsrCacheReadSet (File, Header.ProbedCount, &mMsrCache.Probed);
+    if (!EFI_ERROR (Status)) Status = MsrCacheReadSet (File, Header.ValidCount, &mMsrCache.Valid);
+    if (EFI_ERROR (Status)) {
+      IntervalSetFree (&mMsrCache.Probed);
+      IntervalSetFree (&mMsrCache.Valid);
+    }
+  }
+  File->Close (File);
+  Root->Close (Root);
+}
+
+//
+// Writes the whole index back in one sequential Write. Silently does
+// nothing when the boot volume is read-only or absent.
+//
+STATIC EFI_STATUS MsrCacheSave (VOID) {
+  EFI_STATUS            Status;
+  EFI_FILE_PROTOCOL     *Root, *Dir, *File;
+  MSR_CACHE_FILE_HEADER *Header;
+  CHAR16                Path[MSR_CACHE_PATH_LEN];
+  UINTN                 Size;
+  UINT8                 *Buffer;
+
+  if (!mMsrCache.Dirty) return EFI_SUCCESS;
+
+  Size   = sizeof (MSR_CACHE_FILE_HEADER) + (mMsrCache.Probed.Count + mMsrCache.Valid.Count) * sizeof (MSR_INTERVAL);
+  Buffer = AllocatePool (Size);
+  if (Buffer == NULL) return EFI_OUT_OF_RESOURCES;
+
+  Header               = (MSR_CACHE_FILE_HEADER *)Buffer;
+  Header->Signature    = MSR_CACHE_SIGNATURE;
+  Header->Version      = MSR_CACHE_VERSION;
+  Header->Reserved     = 0;
+  Header->CpuSignature = mMsrCache.CpuSignature;
+  Header->MicrocodeRev = mMsrCache.MicrocodeRev;
+  Header->ProbedCount  = (UINT32)mMsrCache.Probed.Count;
+  Header->ValidCount   = (UINT32)mMsrCache.Valid.Count;
+  CopyMem (Header + 1, mMsrCache.Probed.Items, mMsrCache.Probed.Count * sizeof (MSR_INTERVAL));
+  CopyMem ((MSR_INTERVAL *)(Header + 1) + mMsrCache.Probed.Count, mMsrCache.Valid.Items, mMsrCache.Valid.Count * sizeof (MSR_INTERVAL));
+
+  Status = OpenBootVolumeRoot (&Root);
+  if (EFI_ERROR (Status)) { FreePool (Buffer); return Status; }
+
+  Status = Root->Open (Root, &Dir, MSR_CACHE_DIR, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, EFI_FILE_DIRECTORY);
+  if (!EFI_ERROR (Status)) Dir->Close (Dir);
+
+  MsrCacheBuildPath (Path, MSR_CACHE_PATH_LEN);
+  // Delete first so a shorter index never leaves stale tail bytes behind
+  Status = Root->Open (Root, &File, Path, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+  if (!EFI_ERROR (Status)) File->Delete (File);
+
+  Status = Root->Open (Root, &File, Path, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+  if (!EFI_ERROR (Status)) {
+    Status = File->Write (File, &Size, Buffer);
+    File->Close (File);
+  }
+  Root->Close (Root);
+  FreePool (Buffer);
+
+  if (!EFI_ERROR (Status)) mMsrCache.Dirty = FALSE;
+  return Status;
+}
+
+STATIC MSR_CACHE_STATE MsrCacheLookup (IN UINT32 Index) {
+  if (!IntervalSetContains (&mMsrCache.Probed, Index)) return MsrCacheUnknown;
+  return IntervalSetContains (&mMsrCache.Valid, Index) ? MsrCacheValid : MsrCacheInvalid;
+}
+
+//
+// Merges one batch result into the index. IndexList is ascending and a
+// subset of [First, First + Count - 1]; indices not in the list were
+// already known-invalid, so the whole window becomes "probed".
+//
+STATIC VOID MsrCacheRecordBatch (
+  IN UINT32       First,
+  IN UINTN        Count,
+  IN CONST UINT32 *IndexList,
+  IN UINTN        ListCount,
+  IN CONST UINT8  *FaultBitmap
+  )
+{
+  UINTN   J;
+  UINT32  RunFirst = 0, RunLast = 0;
+  BOOLEAN InRun = FALSE;
+
+  if (Count == 0) return;
+
+  for (J = 0; J < ListCount; J++) {
+    if (MSR_BITMAP_TEST (FaultBitmap, J)) {
+      // Known-valid index now faults (e.g. locked by firmware): forget it
+      if (IntervalSetContains (&mMsrCache.Valid, IndexList[J])) {
+        IntervalSetRemoveRange (&mMsrCache.Valid, IndexList[J], IndexList[J]);
+        mMsrCache.Dirty = TRUE;
+      }
+      continue;
+    }
+    if (InRun && IndexList[J] == RunLast + 1) {
+      RunLast = IndexList[J];
+      continue;
+    }
+    if (InRun) IntervalSetAdd (&mMsrCache.Valid, RunFirst, RunLast);
+    RunFirst = RunLast = IndexList[J];
+    InRun    = TRUE;
+  }
+  if (InRun) IntervalSetAdd (&mMsrCache.Valid, RunFirst, RunLast);
+
+  if (!IntervalSetContains (&mMsrCache.Probed, First) ||
+      !IntervalSetContains (&mMsrCache.Probed, First + (UINT32)(Count - 1)) ||
+      IntervalSetLowerBound (&mMsrCache.Probed, First) != IntervalSetLowerBound (&mMsrCache.Probed, First + (UINT32)(Count - 1))) {
+    IntervalSetAdd (&mMsrCache.Probed, First, First + (UINT32)(Count - 1));
+    mMsrCache.Dirty = TRUE;
+  }
+}
+
+//
+// =====================================================
+// Effective MTRR Memory Map
+// =====================================================
+//
+
+//
+// Fixed-range MTRRs in address order; MTRR_SNAPSHOT.Fixed[] uses the same order.
+//
+STATIC CONST UINT32 mMtrrFixedMsrs[MTRR_FIXED_MSR_COUNT] = {
+  MSR_IA32_MTRR_FIX64K_00000, MSR_IA32_MTRR_FIX16K_80000, MSR_IA32_MTRR_FIX16K_A0000,
+  MSR_IA32_MTRR_FIX4K_C0000,  MSR_IA32_MTRR_FIX4K_C8000,  MSR_IA32_MTRR_FIX4K_D0000,
+  MSR_IA32_MTRR_FIX4K_D8000,  MSR_IA32_MTRR_FIX4K_E0000,  MSR_IA32_MTRR_FIX4K_E8000,
+  MSR_IA32_MTRR_FIX4K_F0000,  MSR_IA32_MTRR_FIX4K_F8000
+};
+
+STATIC VOID MtrrSnapshotFree (IN OUT MTRR_SNAPSHOT *Snap) {
+  if (Snap->Variables != NULL) FreePool (Snap->Variables);
+  ZeroMem (Snap, sizeof (*Snap));
+}
+
+//
+// Reads MTRRCAP / DEF_TYPE, then the fixed MSRs and all VCNT variable pairs
+// in one batch. Variable pairs that fault are left zero (i.e. disabled).
+//
+STATIC EFI_STATUS MtrrSnapshotRead (OUT MTRR_SNAPSHOT *Snap) {
+  UINT32 *List;
+  UINT64 *Values;
+  UINT8  *Faults;
+  UINTN  Count, I, FixedFaults = 0;
+
+  ZeroMem (Snap, sizeof (*Snap));
+  if (!SafeReadMsr (MSR_IA32_MTRRCAP, &Snap->Cap) || !SafeReadMsr (MSR_IA32_MTRR_DEF_TYPE, &Snap->DefType)) {
+    return EFI_DEVICE_ERROR;
+  }
+  Snap->PhysAddrBits  = GetPhysicalAddressBits ();
+  Snap->VariableCount = (UINTN)(Snap->Cap & IA32_MTRRCAP_VCNT_MASK);
+
+  Count  = MTRR_FIXED_MSR_COUNT + Snap->VariableCount * 2;
+  List   = AllocatePool (Count * sizeof (UINT32));
+  Values = AllocatePool (Count * sizeof (UINT64));
+  Faults = AllocateZeroPool (MSR_BITMAP_BYTES (Count));
+  if (Snap->VariableCount != 0) {
+    Snap->Variables = AllocateZeroPool (Snap->VariableCount * sizeof (MTRR_VARIABLE_PAIR));
+  }
+  if (List == NULL || Values == NULL || Faults == NULL || (Snap->VariableCount != 0 && Snap->Variables == NULL)) {
+    if (List != NULL)   FreePool (List);
+    if (Values != NULL) FreePool (Values);
+    if (Faults != NULL) FreePool (Faults);
+    MtrrSnapshotFree (Snap);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  CopyMem (List, mMtrrFixedMsrs, sizeof (mMtrrFixedMsrs));
+  for (I = 0; I < Snap->VariableCount; I++) {
+    List[MTRR_FIXED_MSR_COUNT + I * 2]     = MSR_IA32_MTRR_PHYSBASE0 + (UINT32)(I * 2);
+    List[MTRR_FIXED_MSR_COUNT + I * 2 + 1] = MSR_IA32_MTRR_PHYSMASK0 + (UINT32)(I * 2);
+  }
+  SafeReadMsrList (List, Count, Values, Faults);
+
+  for (I = 0; I < MTRR_FIXED_MSR_COUNT; I++) {
+    Snap->Fixed[I] = Values[I];
+    if (MSR_BITMAP_TEST (Faults, I)) FixedFaults++;
+  }
+  Snap->FixedValid = (BOOLEAN)((Snap->Cap & IA32_MTRRCAP_FIX_BIT) != 0 && FixedFaults == 0);
+  for (I = 0; I < Snap->VariableCount; I++) {
+    Snap->Variables[I].Base = Values[MTRR_FIXED_MSR_COUNT + I * 2];
+    Snap->Variables[I].Mask = Values[MTRR_FIXED_MSR_COUNT + I * 2 + 1];
+  }
+
+  FreePool (List);
+  FreePool (Values);
+  FreePool (Faults);
+  return EFI_SUCCESS;
+}
+
+STATIC UINT64 MtrrPhysAddrMask (IN CONST MTRR_SNAPSHOT *Snap) {
+  return LShiftU64 (1, Snap->PhysAddrBits) - 1;
+}
+
+//
+// Architectural precedence for overlapping variable ranges: identical types
+// keep their type, UC wins over everything, WT wins over WB. Anything else
+// is undefined.
+//
+STATIC UINT8 MtrrCombineTypes (IN UINT8 A, IN UINT8 B) {
+  if (A == B) return A;
+  if (A == MTRR_TYPE_UC || B == MTRR_TYPE_UC) return MTRR_TYPE_UC;
+  if ((A == MTRR_TYPE_WT && B == MTRR_TYPE_WB) || (A == MTRR_TYPE_WB && B == MTRR_TYPE_WT)) return MTRR_TYPE_WT;
+  return MTRR_TYPE_UNDEFINED;
+}
+
+STATIC BOOLEAN MtrrMapReserve (IN OUT MTRR_MEMORY_MAP *Map, IN UINTN Needed) {
+  MTRR_MAP_ENTRY *NewItems;
+  UINTN          NewCapacity;
+
+  if (Needed <= Map->Capacity) return TRUE;
+  NewCapacity = MAX (Needed, Map->Capacity * 2);
+  NewItems    = ReallocatePool (Map->Capacity * sizeof (MTRR_MAP_ENTRY), NewCapacity * sizeof (MTRR_MAP_ENTRY), Map->Items);
+  if (NewItems == NULL) return FALSE;
+  Map->Items    = NewItems;
+  Map->Capacity = NewCapacity;
+  return TRUE;
+}
+
+STATIC VOID MtrrMapFree (IN OUT MTRR_MEMORY_MAP *Map) {
+  if (Map->Items != NULL) FreePool (Map->Items);
+  ZeroMem (Map, sizeof (*Map));
+}
+
+//
+// Appends [First, Last] (must follow the current last entry) and merges it
+// with that entry when the types match.
+//
+STATIC BOOLEAN MtrrMapAppend (IN OUT MTRR_MEMORY_MAP *Map, IN UINT64 First, IN UINT64 Last, IN UINT8 Type) {
+  MTRR_MAP_ENTRY *Prev;
+
+  if (Map->Count > 0) {
+    Prev = &Map->Items[Map->Count - 1];
+    if (Prev->Type == Type && Prev->Last + 1 == First) {
+      Prev->Last = Last;
+      return TRUE;
+    }
+  }
+  if (!MtrrMapReserve (Map, Map->Count + 1)) return FALSE;
+  Map->Items[Map->Count].First = First;
+  Map->Items[Map->Count].Last  = Last;
+  Map->Items[Map->Count].Type  = Type;
+  Map->Count++;
+  return TRUE;
+}
+
+//
+// Decodes one variable pair into its matching block size and the set of
+// "hole" address bits (zero mask bits above the size). Returns FALSE when
+// the pair is disabled.
+//
+STATIC BOOLEAN MtrrVariableDecode (
+  IN  CONST MTRR_SNAPSHOT      *Snap,
+  IN  CONST MTRR_VARIABLE_PAIR *Pair,
+  OUT UINT64                   *Base,
+  OUT UINT64                   *Size,
+  OUT UINT64                   *Holes
+  )
+{
+  UINT64 AddrMask = MtrrPhysAddrMask (Snap) & ~(UINT64)0xFFF;
+  UINT64 Mask;
+
+  if ((Pair->Mask & IA32_MTRR_PHYSMASK_VALID_BIT) == 0) return FALSE;
+  Mask   = Pair->Mask & AddrMask;
+  *Size  = (Mask == 0) ? MtrrPhysAddrMask (Snap) + 1 : (Mask & (~Mask + 1));
+  *Holes = AddrMask & ~Mask & ~(*Size - 1);
+  *Base  = Pair->Base & Mask;
+  return TRUE;
+}
+
+//
+// Fixed ranges: 8 x 64K, 16 x 16K, 64 x 4K covering the first megabyte.
+//
+STATIC BOOLEAN MtrrMapAddFixed (IN CONST MTRR_SNAPSHOT *Snap, IN OUT MTRR_MEMORY_MAP *Map) {
+  UINT64 Address = 0, Step;
+  UINTN  Msr, Byte;
+
+  for (Msr = 0; Msr < MTRR_FIXED_MSR_COUNT; Msr++) {
+    Step = (Msr == 0) ? SIZE_64KB : (Msr < 3) ? SIZE_16KB : SIZE_4KB;
+    for (Byte = 0; Byte < 8; Byte++, Address += Step) {
+      if (!MtrrMapAppend (Map, Address, Address + Step - 1, (UINT8)RShiftU64 (Snap->Fixed[Msr], Byte * 8))) return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+//
+// Flattens default type, fixed and variable ranges into Map. Every range
+// edge becomes a boundary; each elementary segment between two boundaries
+// is then covered by the same set of variable ranges, so its type is the
+// precedence-combined type of that set (or the default type if empty).
+//
+STATIC EFI_STATUS MtrrMapBuild (IN CONST MTRR_SNAPSHOT *Snap, OUT MTRR_MEMORY_MAP *Map) {
+  MTRR_MAP_ENTRY *Ranges = NULL;
+  UINT64         *Edges  = NULL;
+  UINT64         Base, Size, Holes, Sub, Top, Start;
+  UINTN          RangeCount = 0, RangeMax, EdgeCount = 0, EdgeUnique, I, J;
+  UINT8          DefaultType, Type;
+  BOOLEAN        FixedOn, Hit;
+  EFI_STATUS     Status = EFI_OUT_OF_RESOURCES;
+
+  ZeroMem (Map, sizeof (*Map));
+  Top         = MtrrPhysAddrMask (Snap);
+  DefaultType = (UINT8)(Snap->DefType & IA32_MTRR_DEF_TYPE_TYPE_MASK);
+
+  if ((Snap->DefType & IA32_MTRR_DEF_TYPE_E_BIT) == 0) {
+    return MtrrMapAppend (Map, 0, Top, MTRR_TYPE_UC) ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+  }
+  FixedOn = (BOOLEAN)(Snap->FixedValid && (Snap->DefType & IA32_MTRR_DEF_TYPE_FE_BIT) != 0);
+
+  RangeMax = Snap->VariableCount << MTRR_MAX_MASK_HOLES;
+  if (RangeMax != 0) {
+    Ranges = AllocatePool (RangeMax * sizeof (MTRR_MAP_ENTRY));
+    if (Ranges == NULL) goto Done;
+  }
+  for (I = 0; I < Snap->VariableCount; I++) {
+    if (!MtrrVariableDecode (Snap, &Snap->Variables[I], &Base, &Size, &Holes)) continue;
+    if (BitFieldCountOnes64 (Holes, 0, 63) > MTRR_MAX_MASK_HOLES) {
+      Map->SkippedRanges++;
+      continue;
+    }
+    // Walk every subset of the hole bits
+    Sub = 0;
+    do {
+      Ranges[RangeCount].First = Base | Sub;
+      Ranges[RangeCount].Last  = (Base | Sub) + Size - 1;
+      Ranges[RangeCount].Type  = (UINT8)(Snap->Variables[I].Base & 0xFF);
+      RangeCount++;
+      Sub = (Sub - Holes) & Holes;
+    } while (Sub != 0);
+  }
+
+  Edges = AllocatePool ((RangeCount * 2 + 2) * sizeof (UINT64));
+  if (Edges == NULL) goto Done;
+  Edges[EdgeCount++] = FixedOn ? MTRR_FIXED_RANGE_END : 0;
+  for (I = 0; I < RangeCount; I++) {
+    Edges[EdgeCount++] = Ranges[I].First;
+    if (Ranges[I].Last < Top) Edges[EdgeCount++] = Ranges[I].Last + 1;
+  }
+  SortUint64 (Edges, EdgeCount);
+  for (I = 0, EdgeUnique = 0; I < EdgeCount; I++) {
+    if (FixedOn && Edges[I] < MTRR_FIXED_RANGE_END) continue;
+    if (EdgeUnique == 0 || Edges[EdgeUnique - 1] != Edges[I]) Edges[EdgeUnique++] = Edges[I];
+  }
+
+  if (FixedOn && !MtrrMapAddFixed (Snap, Map)) goto Done;
+  for (I = 0; I < EdgeUnique; I++) {
+    Start = Edges[I];
+    Type  = DefaultType;
+    Hit   = FALSE;
+    for (J = 0; J < RangeCount; J++) {
+      if (Ranges[J].First > Start || Ranges[J].Last < Start) continue;
+      Type = Hit ? MtrrCombineTypes (Type, Ranges[J].Type) : Ranges[J].Type;
+      Hit  = TRUE;
+    }
+    if (Type == MTRR_TYPE_UNDEFINED) Map->Undefined++;
+    if (!MtrrMapAppend (Map, Start, (I + 1 < EdgeUnique) ? Edges[I + 1] - 1 : Top, Type)) goto Done;
+  }
+  Status = EFI_SUCCESS;
+
+Done:
+  if (Ranges != NULL) FreePool (Ranges);
+  if (Edges != NULL)  FreePool (Edges);
+  if (EFI_ERROR (Status)) MtrrMapFree (Map);
+  return Status;
+}
+
+//
+// O(log n) address -> entry lookup; NULL if Address is above the map.
+//
+STATIC CONST MTRR_MAP_ENTRY *MtrrMapLookup (IN CONST MTRR_MEMORY_MAP *Map, IN UINT64 Address) {
+  UINTN Lo = 0, Hi = Map->Count, Mid;
+  while (Lo < Hi) {
+    Mid = Lo + (Hi - Lo) / 2;
+    if (Map->Items[Mid].Last < Address) Lo = Mid + 1;
+    else Hi = Mid;
+  }
+  return (Lo < Map->Count) ? &Map->Items[Lo] : NULL;
+}
+
+STATIC VOID FormatByteSize (IN UINT64 Size, OUT CHAR16 *Buf, IN UINTN BufChars) {
+  if (Size >= SIZE_1GB && (Size & (SIZE_1GB - 1)) == 0) {
+    UnicodeSPrint (Buf, BufChars * sizeof (CHAR16), L"%ld GB", RShiftU64 (Size, 30));
+  } else if (Size >= SIZE_1MB && (Size & (SIZE_1MB - 1)) == 0) {
+    UnicodeSPrint (Buf, BufChars * sizeof (CHAR16), L"%ld MB", RShiftU64 (Size, 20));
+  } else {
+    UnicodeSPrint (Buf, BufChars * sizeof (CHAR16), L"%ld KB", RShiftU64 (Size, 10));
+  }
+}
+
+//
+// =====================================================
+// Feature Implementation 
+// =====================================================
+//
+STATIC VOID DumpMtrrUiLikePhoto_VariableRanges (IN CONST MTRR_SNAPSHOT *Snap) {
+  UINT64  Base, Size, Holes;
+  UINTN   I, Used = 0;
+  CHAR16  SizeStr[16];
+  BOOLEAN Valid;
+
+  Print (L"=== [ Variable Range MTRRs ] ===  VCNT=%d\n", (UINT32)Snap->VariableCount);
+  Print (L"MTRR | Idx  | PHYSBASE (Type)                  | PHYSMASK (Valid)               | Size\n");
+  Print (L"-----+------+--------------------------------+--------------------------------+----------------\n");
+
+  for (I = 0; I < Snap->VariableCount; I++) {
+    Valid = MtrrVariableDecode (Snap, &Snap->Variables[I], &Base, &Size, &Holes);
+    if (Valid) {
+      Used++;
+      FormatByteSize (Size, SizeStr, ARRAY_SIZE (SizeStr));
+    }
+    Print (L"MTRR | 0x%02x | %016lx (%-24s) | %016lx (Valid:%d) | %s%s\n",
+           (UINT32)I, Snap->Variables[I].Base, MtrrTypeToStr ((UINT8)(Snap->Variables[I].Base & 0xFF)),
+           Snap->Variables[I].Mask, Valid ? 1 : 0, Valid ? SizeStr : L"DISABLED",
+           (Valid && Holes != 0) ? L" (non-contiguous)" : L"");
+  }
+  Print (L"Used %d of %d, %d free\n\n", (UINT32)Used, (UINT32)Snap->VariableCount, (UINT32)(Snap->VariableCount - Used));
+}
+
+STATIC VOID DumpMtrrUiLikePhoto_FixedRanges (IN CONST MTRR_SNAPSHOT *Snap) {
+  BOOLEAN MtrrEnabled, FixEnabled;
+  UINTN   I;
+
+  MtrrEnabled = (BOOLEAN)((Snap->DefType & IA32_MTRR_DEF_TYPE_E_BIT) != 0);
+  FixEnabled  = (BOOLEAN)((Snap->DefType & IA32_MTRR_DEF_TYPE_FE_BIT) != 0);
+
+  Print (L"=== [ Fixed Range MTRRs ] ===\n");
+
+  if ((Snap->Cap & IA32_MTRRCAP_FIX_BIT) == 0) {
+    Print (L"Fixed MTRR not supported.\n\n");
+    return;
+  }
+
+  if (!MtrrEnabled || !FixEnabled) {
+    Print (L"Fixed MTRR supported but disabled (E=%d, FE=%d).\n\n", MtrrEnabled ? 1 : 0, FixEnabled ? 1 : 0);
+    return;
+  }
+
+  Print (L"MSR | MSR Addr | Value (64-bit Hex)   | Decoded Memory Types (8 Bytes)\n");
+  Print (L"----+----------+----------------------+----------------------------------------\n");
+
+  for (I = 0; I < MTRR_FIXED_MSR_COUNT; I++) {
+    Print (L"MSR | 0x%03x    | %016lx | ", mMtrrFixedMsrs[I], Snap->Fixed[I]);
+    PrintFixedMtrrDecoded8Types (Snap->Fixed[I]);
+    Print (L"\n");
+  }
+  Print (L"\n");
+}
+
+//
+// Explicit live query: always executes CPUID, bypassing mCpuidDb.
+//
+STATIC VOID PrintCpuidQuery (IN UINT32 Leaf, IN UINT32 SubLeaf) {
+  UINT32 Eax, Ebx, Ecx, Edx;
+
+  AsmCpuidEx (Leaf, SubLeaf, &Eax, &Ebx, &Ecx, &Edx);
+  Print (L"RegisterEax : %08x\nRegisterEbx : %08x\nRegisterEcx : %08x\nRegisterEdx : %08x\n", Eax, Ebx, Ecx, Edx);
+
+  if (Leaf == 0) {
+    CHAR8 Vendor[13];
+    *(UINT32 *)&Vendor[0] = Ebx; *(UINT32 *)&Vendor[4] = Edx; *(UINT32 *)&Vendor[8] = Ecx; Vendor[12] = '\0';
+    Print (L"Vendor      : %a\n", Vendor);
+  }
+
+  if (Leaf == 1) {
+    Print (L"Feature(MSR)  EDX.BIT5  : %d\n", ((Edx & CPUID_FEAT_EDX_MSR)  != 0) ? 1 : 0);
+    Print (L"Feature(MTRR) EDX.BIT12 : %d\n", ((Edx & CPUID_FEAT_EDX_MTRR) != 0) ? 1 : 0);
+    Print (L"Feature(TSC)  EDX.BIT4  : %d\n", ((Edx & CPUID_FEAT_EDX_TSC)  != 0) ? 1 : 0);
+  }
+}
+
+STATIC VOID DoCpuId (VOID) {
+  UINT32 Leaf;
+  ShowHeaderAndMenu (MenuCpuId);
+
+  if (!PromptHexUint32 (L"Enter Function Number (Hex): ", &Leaf)) {
+    Print (L"Invalid input.\n"); WaitAnyKey (); return;
+  }
+  PrintCpuidQuery (Leaf, 0);
+  WaitAnyKey ();
+}
+
+//
+// Returns TRUE if the user quit at a page break.
+//
+STATIC BOOLEAN DumpCpuidDb (VOID) {
+  UINTN LineCount;
+
+  Print (L"[CPUID Basic]\nMax Basic Leaf : 0x%08x\nVendor         : %a\n", mCpuidDb.MaxBasicLeaf, mCpuidDb.Vendor);
+  Print (L"Signature      : %08x (Family 0x%x, Model 0x%x, Stepping 0x%x)\n\n",
+         mCpuidDb.Signature, mCpuidDb.Family, mCpuidDb.Model, mCpuidDb.Stepping);
+  PrintCpuidTableHeader ();
+  LineCount = 2;
+
+  if (PrintCpuidDbRange (0, CPUID_HYPERVISOR_BASE - 1, &LineCount)) return TRUE;
+  if (PrintHypervisorInfo (&LineCount)) return TRUE;
+
+  Print (L"\n[CPUID Extended]\n");
+  if (PageLineAccountingEx (&LineCount, PrintCpuidTableHeader, 2)) return TRUE;
+  Print (L"Max Ext Leaf   : 0x%08x\n", mCpuidDb.MaxExtLeaf);
+  if (PageLineAccountingEx (&LineCount, PrintCpuidTableHeader, 2)) return TRUE;
+  PrintCpuidTableHeader ();
+  LineCount = 2;
+
+  if (PrintCpuidDbRange (CPUID_EXTENDED_BASE, MAX_UINT32, &LineCount)) return TRUE;
+  if (PrintCpuFeatureFlags (&LineCount)) return TRUE;
+  if (PrintCpuidSubleafSummary (&LineCount)) return TRUE;
+  PrintBrandStringIfSupported ();
+  return FALSE;
+}
+
+STATIC VOID DoDumpCpuId (VOID) {
+  ShowHeaderAndMenu (MenuDumpCpuId);
+  if (DumpCpuidDb ()) return;
+  WaitAnyKey ();
+}
+
+STATIC VOID DoReadMsr (VOID) {
+  UINT32 MsrIndex;
+  UINT64 MsrData;
+  ShowHeaderAndMenu (MenuReadMsr);
+
+  if (!CpuSupportsMsr ()) {
+    Print (L"[ERROR] CPU does not support MSR.\n"); WaitAnyKey (); return;
+  }
+  if (!PromptHexUint32 (L"Enter MSR Index (Hex): ", &MsrIndex)) {
+    Print (L"Invalid input.\n"); WaitAnyKey (); return;
+  }
+  
+  if (SafeReadMsr (MsrIndex, &MsrData)) {
+    Print (L"MSR_Data : %016lx\n", MsrData);
+  } else {
+    Print (L"[ERROR] #GP Fault! MSR 0x%08x is invalid or reserved.\n", MsrIndex);
+  }
+  WaitAnyKey ();
+}
+
+//
+// Reads [StartMsr, EndMsr] through the valid-MSR index cache. Returns TRUE if the
+// user quit at a page break.
+//
+STATIC BOOLEAN DumpMsrRange (IN UINT32 StartMsr, IN UINT32 EndMsr) {
+  UINT32  Msr, Index;
+  UINT64  Remaining;
+  UINTN   LineCount, Chunk, I, J, ListCount;
+  UINTN   Probed = 0, Skipped = 0;
+  BOOLEAN Quit = FALSE;
+
+  MsrCacheLoad ();
+  PrintMsrTableHeader ();
+  LineCount = 2;
+
+  Msr       = StartMsr;
+  Remaining = (UINT64)EndMsr - StartMsr + 1;
+
+  while (Remaining > 0 && !Quit) {
+    Chunk = (Remaining > MSR_BATCH_CHUNK) ? MSR_BATCH_CHUNK : (UINTN)Remaining;
+
+    // Only touch indices that are known-valid or never probed on this CPU
+    ListCount = 0;
+    for (I = 0; I < Chunk; I++) {
+      MSR_CACHE_STATE State = MsrCacheLookup (Msr + (UINT32)I);
+      if (State == MsrCacheInvalid) { Skipped++; continue; }
+      if (State == MsrCacheUnknown) Probed++;
+      mMsrBatchIndices[ListCount++] = Msr + (UINT32)I;
+    }
+    SafeReadMsrList (mMsrBatchIndices, ListCount, mMsrBatchValues, mMsrBatchFaults);
+    MsrCacheRecordBatch (Msr, Chunk, mMsrBatchIndices, ListCount, mMsrBatchFaults);
+
+    for (I = 0, J = 0; I < Chunk; I++) {
+      Index = Msr + (UINT32)I;
+      if (J < ListCount && mMsrBatchIndices[J] == Index) {
+        if (!MSR_BITMAP_TEST (mMsrBatchFaults, J)) {
+          Print (L"%08x   %016lx\n", Index, mMsrBatchValues[J]);
+        } else {
+          SetAttrHighlight();
+          Print (L"%08x   [Invalid / #GP]\n", Index);
+          SetAttrNormal();
+        }
+        J++;
+      } else {
+        SetAttrHighlight();
+        Print (L"%08x   [Invalid / #GP] (cached)\n", Index);
+        SetAttrNormal();
+      }
+      
+      if (PageLineAccountingEx (&LineCount, PrintMsrTableHeader, 2)) { Quit = TRUE; break; }
+    }
+
+    Msr       += (UINT32)Chunk;
+    Remaining -= Chunk;
+  }
+
+  if (EFI_ERROR (MsrCacheSave ())) {
+    Print (L"\n[WARN] Could not save MSR index cache to boot volume.\n");
+  }
+  if (Quit) return TRUE;
+  Print (L"\nMSR index cache (sig %08x, ucode %08x): probed %d new, skipped %d known #GP.\n",
+         mMsrCache.CpuSignature, mMsrCache.MicrocodeRev, (UINT32)Probed, (UINT32)Skipped);
+  return FALSE;
+}
+
+STATIC VOID DoDumpMsr (VOID) {
+  UINT32 StartMsr, EndMsr;
+  ShowHeaderAndMenu (MenuDumpMsr);
+
+  if (!CpuSupportsMsr ()) {
+    Print (L"[ERROR] CPU does not support MSR.\n"); WaitAnyKey (); return;
+  }
+  if (!PromptHexUint32 (L"Enter Start MSR Index (Hex): ", &StartMsr)) {
+    Print (L"Invalid start MSR index.\n"); WaitAnyKey (); return;
+  }
+  if (!PromptHexUint32 (L"Enter End   MSR Index (Hex): ", &EndMsr)) {
+    Print (L"Invalid end MSR index.\n"); WaitAnyKey (); return;
+  }
+  if (EndMsr < StartMsr) {
+    Print (L"[ERROR] End MSR must be >= Start MSR.\n"); WaitAnyKey (); return;
+  }
+  if (DumpMsrRange (StartMsr, EndMsr)) return;
+  WaitAnyKey ();
+}
+
+STATIC EFI_STATUS WriteMsrReadBack (IN UINT32 MsrIndex, IN UINT64 MsrData) {
+  if (!SafeWriteMsr (MsrIndex, MsrData)) {
+    Print (L"[ERROR] #GP Fault! Cannot write to MSR 0x%08x (Reserved or Read-Only).\n", MsrIndex);
+    return EFI_DEVICE_ERROR;
+  }
+  Print (L"Write executed successfully.\n");
+  if (SafeReadMsr (MsrIndex, &MsrData)) {
+    Print (L"ReadBack  : %016lx\n", MsrData);
+  }
+  return EFI_SUCCESS;
+}
+
+STATIC VOID DoWriteMsr (VOID) {
+  UINT32        MsrIndex;
+  UINT64        MsrData;
+  EFI_INPUT_KEY Key;
+  ShowHeaderAndMenu (MenuWriteMsr);
+
+  if (!CpuSupportsMsr ()) {
+    Print (L"[ERROR] CPU does not support MSR.\n"); WaitAnyKey (); return;
+  }
+
+  if (!PromptHexUint32 (L"Enter MSR Index (Hex): ", &MsrIndex)) {
+    Print (L"Invalid MSR index.\n"); WaitAnyKey (); return;
+  }
+  if (!PromptHexUint64 (L"Enter MSR Data  (Hex): ", &MsrData)) {
+    Print (L"Invalid MSR data.\n"); WaitAnyKey (); return;
+  }
+
+  Print (L"Confirm write MSR[0x%X] = 0x%016lx ? (Y/N): ", MsrIndex, MsrData);
+  if (!ReadKeyBlocking (&Key)) return;
+  Print (L"%c\n", (Key.UnicodeChar == 0) ? L'?' : Key.UnicodeChar);
+  if (Key.UnicodeChar != L'Y' && Key.UnicodeChar != L'y') {
+    Print (L"Canceled.\n"); WaitAnyKey (); return;
+  }
+
+  WriteMsrReadBack (MsrIndex, MsrData);
+  WaitAnyKey ();
+}
+
+STATIC VOID PrintMemBenchRow (IN CONST MEM_BENCH_ROW *Row) {
+  Print (L"  %-3s   %-3s   ", MtrrTypeToShortStr (Row->Type), MtrrTypeToShortStr (Row->Effective));
+  if (Row->Failure != NULL) {
+    Print (L"n/a (%s)\n", Row->Failure);
+    return;
+  }
+  Print (L"%-10ld %-10ld %-10ld %ld.%d ns\n", Row->ReadMBs, Row->WriteMBs, Row->CopyMBs,
+         DivU64x32 (Row->LatencyPs, 1000), (UINT32)(DivU64x32 (Row->LatencyPs, 100) % 10));
+}
+
+STATIC VOID PrintMemBenchReport (VOID) {
+  CHAR16 SizeStr[16];
+  UINTN  I;
+
+  FormatByteSize (mMemBenchReport.Size, SizeStr, ARRAY_SIZE (SizeStr));
+  Print (L"\n=== [ Measured Throughput ] ===  Buffer %016lx (%s)  TSC %ld MHz\n",
+         mMemBenchReport.Base, SizeStr, DivU64x32 (mMemBenchReport.TscHz, 1000000));
+  Print (L"  MTRR  Eff.  Read MB/s  Write MB/s NT Copy    Latency\n");
+  for (I = 0; I < MEM_BENCH_TYPE_COUNT; I++) PrintMemBenchRow (&mMemBenchReport.Rows[I]);
+}
+
+STATIC EFI_STATUS DumpMtrr (VOID) {
+  MTRR_SNAPSHOT Snap;
+  UINT64        MtrrDefType, MtrrCap;
+  UINT8         DefaultType, Vcnt, PhysAddrBits;
+  EFI_STATUS    Status;
+
+  if (!CpuSupportsMsr () || !CpuSupportsMtrr ()) {
+    Print (L"[ERROR] CPU does not support MSR/MTRR.\n");
+    return EFI_UNSUPPORTED;
+  }
+
+  Status = MtrrSnapshotRead (&Snap);
+  if (EFI_ERROR (Status)) {
+    Print (L"[ERROR] Failed to read MTRR registers (%r).\n", Status);
+    return Status;
+  }
+
+  MtrrDefType  = Snap.DefType;
+  MtrrCap      = Snap.Cap;
+  DefaultType  = (UINT8)(MtrrDefType & IA32_MTRR_DEF_TYPE_TYPE_MASK);
+  Vcnt         = (UINT8)(MtrrCap & IA32_MTRRCAP_VCNT_MASK);
+  PhysAddrBits = Snap.PhysAddrBits;
+
+  Print (L"\n=== [ MTRR Summary ] ===\n");
+  Print (L"MTRRCAP   (0xFE)  : %016lx   VCNT=%d  FIX=%d\n", MtrrCap, (UINT32)Vcnt, (MtrrCap & IA32_MTRRCAP_FIX_BIT) ? 1 : 0);
+  Print (L"DEF_TYPE  (0x2FF) : %016lx   E=%d  FE=%d  Default=%s\n", MtrrDefType, 
+         (MtrrDefType & IA32_MTRR_DEF_TYPE_E_BIT)  ? 1 : 0, 
+         (MtrrDefType & IA32_MTRR_DEF_TYPE_FE_BIT) ? 1 : 0, 
+         MtrrTypeToStr (DefaultType));
+  Print (L"PhysAddrBits      : %d\n\n", (UINT32)PhysAddrBits);
+
+  DumpMtrrUiLikePhoto_VariableRanges (&Snap);
+  DumpMtrrUiLikePhoto_FixedRanges (&Snap);
+  if (mMemBenchReport.Valid) PrintMemBenchReport ();
+  MtrrSnapshotFree (&Snap);
+  return EFI_SUCCESS;
+}
+
+STATIC VOID DoDumpMtrr (VOID) {
+  ShowHeaderAndMenu (MenuDumpMtrr);
+  DumpMtrr ();
+  WaitAnyKey ();
+}
+
+//
+// =====================================================
+// Per-Core MSR Collection (EFI_MP_SERVICES_PROTOCOL)
+// =====================================================
+//
+STATIC CONST UINT32 mPerCpuDefaultMsrs[] = {
+  MSR_IA32_BIOS_SIGN_ID, MSR_IA32_FEATURE_CONTROL, MSR_IA32_PERF_STATUS, MSR_IA32_MISC_ENABLE,
+  MSR_IA32_MTRRCAP, MSR_IA32_MTRR_DEF_TYPE, MSR_IA32_MTRR_PHYSBASE0, MSR_IA32_MTRR_PHYSMASK0,
+  MSR_IA32_MTRR_FIX64K_00000, MSR_IA32_PAT
+};
+
+STATIC UINT32 GetCurrentApicId (IN UINT32 MaxBasicLeaf) {
+  UINT32 Eax, Ebx, Ecx, Edx;
+  if (MaxBasicLeaf >= 0xB) {
+    AsmCpuidEx (0xB, 0, &Eax, &Ebx, &Ecx, &Edx);
+    if (Ebx != 0) return Edx;   // x2APIC ID
+  }
+  AsmCpuid (1, &Eax, &Ebx, &Ecx, &Edx);
+  return Ebx >> 24;             // initial APIC ID
+}
+
+STATIC PERCPU_MSR_SLOT *PerCpuFindSlot (IN PERCPU_MSR_JOB *Job, IN UINT32 ApicId) {
+  UINTN I;
+  for (I = 0; I < Job->SlotCount; I++) {
+    if (PERCPU_SLOT (Job, I)->Present && PERCPU_SLOT (Job, I)->ApicId == ApicId) return PERCPU_SLOT (Job, I);
+  }
+  return NULL;
+}
+
+STATIC PERCPU_MSR_JOB *mPerCpuView;
+STATIC UINTN          mPerCpuHeaderGroup;
+
+//
+// Runs on every CPU at once (APs via StartupAllAPs, BSP directly). Must not
+// call Print or any boot service: everything goes into the CPU's own slot.
+//
+STATIC VOID EFIAPI PerCpuMsrCollectProc (IN OUT VOID *Buffer) {
+  PERCPU_MSR_JOB  *Job = (PERCPU_MSR_JOB *)Buffer;
+  PERCPU_MSR_SLOT *Slot;
+  UINT32          Eax, Ebx, Ecx, Edx;
+  UINTN           I;
+
+  Slot = PerCpuFindSlot (Job, GetCurrentApicId (Job->MaxBasicLeaf));
+  if (Slot == NULL) return;
+
+  for (I = 0; I < Job->MsrCount; I++) {
+    if (Job->MsrList[I] == MSR_IA32_BIOS_SIGN_ID && !Job->IsAmd) {
+      // Intel: latch this core's microcode revision first
+      ProbeWriteMsr (MSR_IA32_BIOS_SIGN_ID, 0);
+      AsmCpuid (1, &Eax, &Ebx, &Ecx, &Edx);
+    }
+    if (ProbeReadMsr (Job->MsrList[I], &Slot->Values[I]) != PROBE_OK) {
+      Slot->Values[I]  = 0;
+      Slot->FaultMask |= (1u << I);
+    }
+  }
+  Slot->Done = 1;
+}
+
+STATIC VOID PerCpuJobFree (IN OUT PERCPU_MSR_JOB *Job) {
+  if (Job->Orphaned) return;                          // APs may still write here, leak it
+  if (Job->Slots != NULL) FreePages (Job->Slots, Job->SlotPages);
+  Job->Slots = NULL;
+}
+
+//
+// Allocates one cache-line-aligned slot per logical processor and fills in
+// APIC IDs from MP Services (BSP-only when the protocol is unavailable).
+//
+STATIC EFI_STATUS PerCpuJobInit (OUT PERCPU_MSR_JOB *Job, IN CONST UINT32 *MsrList, IN UINTN MsrCount) {
+  EFI_STATUS                Status;
+  EFI_PROCESSOR_INFORMATION Info;
+  PERCPU_MSR_SLOT           *Slot;
+  UINTN                     NumCpus = 1, NumEnabled = 1, I;
+
+  ZeroMem (Job, sizeof (*Job));
+  Job->MaxBasicLeaf = mCpuidDb.MaxBasicLeaf;
+  Job->IsAmd        = CpuIsAmd ();
+  Job->MsrList      = MsrList;
+  Job->MsrCount     = MsrCount;
+
+  if (mMp != NULL) {
+    Status = mMp->GetNumberOfProcessors (mMp, &NumCpus, &NumEnabled);
+    if (EFI_ERROR (Status)) NumCpus = 1;
+  }
+
+  Job->SlotStride = ALIGN_VALUE (sizeof (PERCPU_MSR_SLOT), CPU_CACHE_LINE_SIZE);
+  Job->SlotCount  = NumCpus;
+  Job->SlotPages  = EFI_SIZE_TO_PAGES (Job->SlotStride * NumCpus);
+  Job->Slots      = AllocatePages (Job->SlotPages);   // page-aligned, so every slot is line-aligned
+  if (Job->Slots == NULL) return EFI_OUT_OF_RESOURCES;
+  ZeroMem (Job->Slots, EFI_PAGES_TO_SIZE (Job->SlotPages));
+
+  for (I = 0; I < NumCpus; I++) {
+    Slot = PERCPU_SLOT (Job, I);
+    if (mMp == NULL || NumCpus == 1) {
+      Slot->ApicId  = GetCurrentApicId (Job->MaxBasicLeaf);
+      Slot->Present = TRUE;
+      Slot->Enabled = TRUE;
+      Slot->IsBsp   = TRUE;
+      Job->BspSlot  = I;
+      continue;
+    }
+    if (EFI_ERROR (mMp->GetProcessorInfo (mMp, I, &Info))) continue;   // stays !Present, never matched
+    Slot->Present = TRUE;
+    Slot->ApicId  = (UINT32)Info.ProcessorId;
+    Slot->Enabled = (BOOLEAN)((Info.StatusFlag & PROCESSOR_ENABLED_BIT) != 0);
+    Slot->IsBsp   = (BOOLEAN)((Info.StatusFlag & PROCESSOR_AS_BSP_BIT) != 0);
+    if (Slot->IsBsp) Job->BspSlot = I;
+  }
+  return EFI_SUCCESS;
+}
+
+//
+// Completion event for a non-blocking StartupAllAPs. It has no notify function on
+// purpose: CheckEvent and WaitForEvent reject EVT_NOTIFY_SIGNAL events, so a wait on
+// one returns at once while the APs are still running.
+//
+STATIC EFI_STATUS PerCpuCreateDoneEvent (OUT EFI_EVENT *Done) {
+  return gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, Done);
+}
+
+//
+// Blocks until the APs started with Done have all returned, then closes Done.
+// On error Done is left open: MP Services may still signal it.
+//
+STATIC EFI_STATUS PerCpuWaitDone (IN EFI_EVENT Done) {
+  EVENT_LOOP Loop;
+  EFI_STATUS Status;
+
+  EventLoopInit (&Loop);
+  Status = EventLoopAdd (&Loop, Done, EventLoopStop, NULL);
+  if (!EFI_ERROR (Status)) Status = EventLoopRun (&Loop);
+  if (EFI_ERROR (Status)) return Status;
+  gBS->CloseEvent (Done);
+  return EFI_SUCCESS;
+}
+
+//
+// PerCpuWaitDone for a job. If completion cannot be confirmed the job is marked
+// Orphaned: the APs may still be writing into it, so its memory is never freed.
+//
+STATIC EFI_STATUS PerCpuWaitAps (IN OUT PERCPU_MSR_JOB *Job, IN EFI_EVENT Done) {
+  EFI_STATUS Status;
+
+  Status = PerCpuWaitDone (Done);
+  if (EFI_ERROR (Status)) Job->Orphaned = TRUE;
+  return Status;
+}
+
+//
+// Runs PerCpuMsrCollectProc on all enabled CPUs concurrently: the APs are
+// started non-blocking and the BSP reads its own slot while they run. DXE APs
+// share the BSP's IDT, so ProbeFaultHandler recovers faults on every core.
+//
+STATIC EFI_STATUS PerCpuJobRun (IN OUT PERCPU_MSR_JOB *Job) {
+  EFI_STATUS Status = EFI_NOT_STARTED;
+  EFI_EVENT  Done   = NULL;
+
+  if (mMp != NULL && Job->SlotCount > 1 && !EFI_ERROR (PerCpuCreateDoneEvent (&Done))) {
+    Status = mMp->StartupAllAPs (mMp, PerCpuMsrCollectProc, FALSE, Done, 0, Job, NULL);
+  }
+  PerCpuMsrCollectProc (Job);
+  if (!EFI_ERROR (Status)) return PerCpuWaitAps (Job, Done);
+
+  if (Done != NULL) gBS->CloseEvent (Done);
+  return (Status == EFI_NOT_STARTED) ? EFI_SUCCESS : Status;   // no enabled APs
+}
+
+STATIC VOID PrintPerCpuMatrixHeader (VOID) {
+  UINTN I, First = mPerCpuHeaderGroup * PERCPU_COLS_PER_PAGE;
+  Print (L"CPU  APIC     ");
+  for (I = First; I < First + PERCPU_COLS_PER_PAGE && I < mPerCpuView->MsrCount; I++) {
+    Print (L"| MSR %08x      ", mPerCpuView->MsrList[I]);
+  }
+  Print (L"\n");
+  Print (L"-------------");
+  for (I = First; I < First + PERCPU_COLS_PER_PAGE && I < mPerCpuView->MsrCount; I++) {
+    Print (L"+-------------------");
+  }
+  Print (L"\n");
+}
+
+//
+// Core x MSR matrix. The BSP row shows full values; other rows print "="
+// when they match the BSP and the (highlighted) value when they differ.
+//
+STATIC BOOLEAN PrintPerCpuMatrix (IN PERCPU_MSR_JOB *Job, OUT UINTN *DiffCpus) {
+  PERCPU_MSR_SLOT *Bsp = PERCPU_SLOT (Job, Job->BspSlot);
+  PERCPU_MSR_SLOT *Slot;
+  UINTN           Group, Groups, Cpu, I, First, LineCount;
+  BOOLEAN         Differs;
+
+  *DiffCpus = 0;
+  for (Cpu = 0; Cpu < Job->SlotCount; Cpu++) {
+    Slot = PERCPU_SLOT (Job, Cpu);
+    if (!Slot->Done || Cpu == Job->BspSlot) continue;
+    for (I = 0; I < Job->MsrCount; I++) {
+      if (Slot->Values[I] != Bsp->Values[I] || ((Slot->FaultMask ^ Bsp->FaultMask) & (1u << I))) { (*DiffCpus)++; break; }
+    }
+  }
+
+  Groups = (Job->MsrCount + PERCPU_COLS_PER_PAGE - 1) / PERCPU_COLS_PER_PAGE;
+  mPerCpuView = Job;
+  for (Group = 0; Group < Groups; Group++) {
+    mPerCpuHeaderGroup = Group;
+    First = Group * PERCPU_COLS_PER_PAGE;
+    Print (L"\n");
+    PrintPerCpuMatrixHeader ();
+    LineCount = 3;
+
+    for (Cpu = 0; Cpu < Job->SlotCount; Cpu++) {
+      Slot = PERCPU_SLOT (Job, Cpu);
+      Print (L"%3d  %08x%s", (UINT32)Cpu, Slot->ApicId, Slot->IsBsp ? L"*" : L" ");
+      for (I = First; I < First + PERCPU_COLS_PER_PAGE && I < Job->MsrCount; I++) {
+        Print (L"| ");
+        if (!Slot->Done) {
+          Print (L"%-18s", !Slot->Present ? L"(no info)" : Slot->Enabled ? L"(no response)" : L"(disabled)");
+          continue;
+        }
+        if (Slot->FaultMask & (1u << I)) {
+          Differs = (BOOLEAN)(Cpu != Job->BspSlot && (Bsp->FaultMask & (1u << I)) == 0);
+          if (Differs) SetAttrHighlight ();
+          Print (L"%-18s", L"[#GP]");
+          if (Differs) SetAttrNormal ();
+          continue;
+        }
+        if (Cpu == Job->BspSlot) {
+          Print (L"%016lx  ", Slot->Values[I]);
+        } else if (Slot->Values[I] == Bsp->Values[I] && (Bsp->FaultMask & (1u << I)) == 0) {
+          Print (L"%-18s", L"=");
+        } else {
+          SetAttrHighlight ();
+          Print (L"%016lx", Slot->Values[I]);
+          SetAttrNormal ();
+          Print (L"  ");
+        }
+      }
+      Print (L"\n");
+      if (PageLineAccountingEx (&LineCount, PrintPerCpuMatrixHeader, 2)) return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+STATIC VOID DoPerCoreMsr (VOID) {
+  CHAR16         Buf[MSR_LIST_INPUT_LEN];
+  UINT32         MsrList[PERCPU_MSR_MAX];
+  UINTN          MsrCount, DiffCpus;
+  PERCPU_MSR_JOB Job;
+  EFI_STATUS     Status;
+  ShowHeaderAndMenu (MenuPerCoreMsr);
+
+  if (!CpuSupportsMsr ()) {
+    Print (L"[ERROR] CPU does not support MSR.\n"); WaitAnyKey (); return;
+  }
+  if (mMp == NULL) {
+    Print (L"[WARN] MP Services not available, collecting on BSP only.\n");
+  }
+
+  Print (L"Enter MSR list (Hex, max %d, Enter = default): ", PERCPU_MSR_MAX);
+  if (!ReadLine (Buf, MSR_LIST_INPUT_LEN)) return;
+  if (Buf[0] == L'\0') {
+    MsrCount = sizeof (mPerCpuDefaultMsrs) / sizeof (mPerCpuDefaultMsrs[0]);
+    CopyMem (MsrList, mPerCpuDefaultMsrs, sizeof (mPerCpuDefaultMsrs));
+  } else {
+    MsrCount = ParseHexList32 (Buf, MsrList, PERCPU_MSR_MAX);
+    if (MsrCount == 0) {
+      Print (L"Invalid MSR list.\n"); WaitAnyKey (); return;
+    }
+  }
+
+  if (EFI_ERROR (PerCpuJobInit (&Job, MsrList, MsrCount))) {
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); return;
+  }
+  Status = PerCpuJobRun (&Job);
+  if (Job.Orphaned) {
+    Print (L"[ERROR] Could not wait for the APs (%r); results dropped.\n", Status); WaitAnyKey (); return;
+  }
+  if (EFI_ERROR (Status)) {
+    Print (L"[WARN] StartupAllAPs returned %r, showing partial results.\n", Status);
+  }
+
+  Print (L"Logical CPUs: %d   (* = BSP, '=' = same as BSP)\n", (UINT32)Job.SlotCount);
+  if (!PrintPerCpuMatrix (&Job, &DiffCpus)) {
+    Print (L"\n%d CPU(s) differ from the BSP.\n", (UINT32)DiffCpus);
+    WaitAnyKey ();
+  }
+  PerCpuJobFree (&Job);
+}
+
+//
+// =====================================================
+// Parallel MSR Blind Scan (work-stealing across all CPUs)
+// =====================================================
+//
+STATIC BOOLEAN MsrScanQueuePop (IN MSR_SCAN_QUEUE *Queue, IN BOOLEAN FromTail, OUT UINT32 *Chunk) {
+  UINT64 Old, New;
+  UINT32 Head, Tail;
+
+  do {
+    Old  = Queue->HeadTail;
+    Head = (UINT32)Old;
+    Tail = (UINT32)RShiftU64 (Old, 32);
+    if (Head >= Tail) return FALSE;
+    if (FromTail) {
+      *Chunk = --Tail;
+    } else {
+      *Chunk = Head++;
+    }
+    New = LShiftU64 (Tail, 32) | Head;
+  } while (InterlockedCompareExchange64 (&Queue->HeadTail, Old, New) != Old);
+  return TRUE;
+}
+
+STATIC BOOLEAN MsrScanTakeChunk (IN MSR_SCAN_JOB *Scan, IN UINTN Self, OUT UINT32 *Chunk) {
+  UINTN I, Victim;
+
+  if (MsrScanQueuePop (MSR_SCAN_QUEUE_AT (Scan, Self), FALSE, Chunk)) return TRUE;
+  for (I = 1; I < Scan->Cpus.SlotCount; I++) {
+    Victim = (Self + I) % Scan->Cpus.SlotCount;
+    if (MsrScanQueuePop (MSR_SCAN_QUEUE_AT (Scan, Victim), TRUE, Chunk)) return TRUE;
+  }
+  return FALSE;
+}
+
+STATIC VOID MsrScanRunChunk (IN MSR_SCAN_JOB *Scan, IN PERCPU_MSR_SLOT *Slot, IN UINT32 Chunk) {
+  UINT64 Offset = (UINT64)Chunk * MSR_SCAN_CHUNK;
+  UINT64 End    = Offset + MSR_SCAN_CHUNK;
+  UINT64 N, Value;
+
+  if (End > Scan->Span) End = Scan->Span;
+  for (N = Offset; N < End; N++) {
+    if (ProbeReadMsr (Scan->FirstMsr + (UINT32)N, &Value) == PROBE_OK) {
+      MSR_BITMAP_SET (Scan->ValidBitmap, N);
+      Slot->ScanValid++;
+    }
+  }
+}
+
+//
+// Worker body shared by the APs and the BSP. Returns after one chunk when
+// OneChunk is set so the BSP can interleave progress output.
+//
+STATIC BOOLEAN MsrScanWork (IN MSR_SCAN_JOB *Scan, IN BOOLEAN OneChunk) {
+  PERCPU_MSR_SLOT *Slot;
+  UINTN           Self;
+  UINT32          Chunk;
+
+  Slot = PerCpuFindSlot (&Scan->Cpus, GetCurrentApicId (Scan->Cpus.MaxBasicLeaf));
+  if (Slot == NULL) return FALSE;
+  Self = ((UINT8 *)Slot - Scan->Cpus.Slots) / Scan->Cpus.SlotStride;
+
+  while (!Scan->Abort && MsrScanTakeChunk (Scan, Self, &Chunk)) {
+    MsrScanRunChunk (Scan, Slot, Chunk);
+    InterlockedIncrement (&Scan->ChunksDone);
+    if (OneChunk) return TRUE;
+  }
+  return FALSE;
+}
+
+STATIC VOID EFIAPI MsrScanApProc (IN OUT VOID *Buffer) {
+  MsrScanWork ((MSR_SCAN_JOB *)Buffer, FALSE);
+}
+
+STATIC VOID MsrScanJobFree (IN OUT MSR_SCAN_JOB *Scan) {
+  if (Scan->Cpus.Orphaned) return;                    // APs may still be writing the bitmap
+  if (Scan->Queues != NULL)      FreePages (Scan->Queues, Scan->QueuePages);
+  if (Scan->ValidBitmap != NULL) FreePages (Scan->ValidBitmap, Scan->BitmapPages);
+  Scan->Queues      = NULL;
+  Scan->ValidBitmap = NULL;
+  PerCpuJobFree (&Scan->Cpus);
+}
+
+//
+// Splits [FirstMsr, FirstMsr + Span) into chunks and deals them out as
+// contiguous runs to the enabled CPUs so each starts with local work.
+//
+STATIC EFI_STATUS MsrScanJobInit (OUT MSR_SCAN_JOB *Scan, IN UINT32 FirstMsr, IN UINT64 Span) {
+  EFI_STATUS Status;
+  UINTN      I, Enabled = 0, Given = 0;
+  UINT32     Next = 0, Share;
+
+  ZeroMem (Scan, sizeof (*Scan));
+  Status = PerCpuJobInit (&Scan->Cpus, NULL, 0);
+  if (EFI_ERROR (Status)) return Status;
+
+  Scan->FirstMsr    = FirstMsr;
+  Scan->Span        = Span;
+  Scan->ChunkCount  = (UINT32)((Span + MSR_SCAN_CHUNK - 1) / MSR_SCAN_CHUNK);
+  Scan->QueuePages  = EFI_SIZE_TO_PAGES (Scan->Cpus.SlotStride * Scan->Cpus.SlotCount);
+  Scan->BitmapPages = EFI_SIZE_TO_PAGES ((UINTN)Scan->ChunkCount * MSR_BITMAP_BYTES (MSR_SCAN_CHUNK));
+  Scan->Queues      = AllocatePages (Scan->QueuePages);
+  Scan->ValidBitmap = AllocatePages (Scan->BitmapPages);
+  if (Scan->Queues == NULL || Scan->ValidBitmap == NULL) {
+    MsrScanJobFree (Scan);
+    return EFI_OUT_OF_RESOURCES;
+  }
+  ZeroMem (Scan->Queues, EFI_PAGES_TO_SIZE (Scan->QueuePages));
+  ZeroMem (Scan->ValidBitmap, EFI_PAGES_TO_SIZE (Scan->BitmapPages));
+
+  for (I = 0; I < Scan->Cpus.SlotCount; I++) {
+    if (PERCPU_SLOT (&Scan->Cpus, I)->Enabled) Enabled++;
+  }
+  for (I = 0; I < Scan->Cpus.SlotCount; I++) {
+    if (!PERCPU_SLOT (&Scan->Cpus, I)->Enabled) continue;
+    Given++;
+    Share = (Given == Enabled) ? (Scan->ChunkCount - Next) : (UINT32)(Scan->ChunkCount / Enabled);
+    MSR_SCAN_QUEUE_AT (Scan, I)->HeadTail = LShiftU64 (Next + Share, 32) | Next;
+    Next += Share;
+  }
+  return EFI_SUCCESS;
+}
+
+STATIC VOID MsrScanPrintProgress (IN MSR_SCAN_JOB *Scan) {
+  UINTN  I;
+  UINT32 Valid = 0;
+  for (I = 0; I < Scan->Cpus.SlotCount; I++) Valid += PERCPU_SLOT (&Scan->Cpus, I)->ScanValid;
+  Print (L"\rScanned %d / %d chunks, %d valid MSRs so far   ", Scan->ChunksDone, Scan->ChunkCount, Valid);
+}
+
+STATIC VOID MsrScanCheckCancel (IN OUT MSR_SCAN_JOB *Scan) {
+  EFI_INPUT_KEY Key;
+  if (!EFI_ERROR (gST->ConIn->ReadKeyStroke (gST->ConIn, &Key)) && Key.ScanCode == SCAN_ESC) {
+    Scan->Abort = TRUE;
+  }
+}
+
+STATIC BOOLEAN MsrScanOnKey (IN VOID *Context) {
+  MsrScanCheckCancel ((MSR_SCAN_JOB *)Context);
+  return FALSE;                                                 // keep waiting for the APs to drain
+}
+
+STATIC BOOLEAN MsrScanOnTick (IN VOID *Context) {
+  MsrScanPrintProgress ((MSR_SCAN_JOB *)Context);
+  return FALSE;
+}
+
+//
+// APs are started non-blocking with a completion event; the BSP scans its
+// own share one chunk at a time and refreshes the progress line in between,
+// then sleeps in the event loop until the APs finish. If Done is never seen
+// the job is left Orphaned: its bitmap is incomplete and still being written.
+//
+STATIC EFI_STATUS MsrScanJobRun (IN OUT MSR_SCAN_JOB *Scan) {
+  EFI_STATUS Status = EFI_NOT_STARTED;
+  EFI_EVENT  Done   = NULL, Tick = NULL;
+  EVENT_LOOP Loop;
+
+  if (mMp != NULL && Scan->Cpus.SlotCount > 1 && !EFI_ERROR (PerCpuCreateDoneEvent (&Done))) {
+    Status = mMp->StartupAllAPs (mMp, MsrScanApProc, FALSE, Done, 0, Scan, NULL);
+  }
+
+  while (MsrScanWork (Scan, TRUE)) {
+    MsrScanPrintProgress (Scan);
+    MsrScanCheckCancel (Scan);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    EventLoopInit (&Loop);
+    EventLoopAdd (&Loop, Done, EventLoopStop, NULL);
+    EventLoopAdd (&Loop, gST->ConIn->WaitForKey, MsrScanOnKey, Scan);
+    if (!EFI_ERROR (gBS->CreateEvent (EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Tick))) {
+      gBS->SetTimer (Tick, TimerPeriodic, EFI_TIMER_PERIOD_MILLISECONDS (MSR_SCAN_PROGRESS_MS));
+      EventLoopAdd (&Loop, Tick, MsrScanOnTick, Scan);
+    }
+    Status = EventLoopRun (&Loop);
+    if (Tick != NULL) gBS->CloseEvent (Tick);
+    if (EFI_ERROR (Status)) {
+      Scan->Cpus.Orphaned = TRUE;
+      return Status;
+    }
+  }
+  MsrScanPrintProgress (Scan);
+  Print (L"\n");
+
+  if (Done != NULL) gBS->CloseEvent (Done);
+  return (Status == EFI_NOT_STARTED) ? EFI_SUCCESS : Status;
+}
+
+STATIC VOID PrintMsrScanTableHeader (VOID) {
+  Print (L"First MSR  Last MSR   Count\n");
+  Print (L"------------------------------\n");
+}
+
+//
+// Walks the bitmap in index order, prints the valid runs and folds them
+// into the valid-MSR index cache (the scanned window replaces what the
+// cache knew about it).
+//
+STATIC BOOLEAN MsrScanMergeResults (IN MSR_SCAN_JOB *Scan, OUT UINT64 *ValidTotal) {
+  UINT64  N, RunStart = 0;
+  BOOLEAN InRun = FALSE, Quit = FALSE;
+  UINTN   LineCount;
+  UINT32  Last = Scan->FirstMsr + (UINT32)(Scan->Span - 1);
+
+  MsrCacheLoad ();
+  IntervalSetRemoveRange (&mMsrCache.Valid, Scan->FirstMsr, Last);
+  IntervalSetAdd (&mMsrCache.Probed, Scan->FirstMsr, Last);
+  mMsrCache.Dirty = TRUE;
+
+  *ValidTotal = 0;
+  PrintMsrScanTableHeader ();
+  LineCount = 2;
+
+  for (N = 0; N <= Scan->Span; N++) {
+    BOOLEAN Valid = (BOOLEAN)(N < Scan->Span && MSR_BITMAP_TEST (Scan->ValidBitmap, N));
+    if (Valid) {
+      (*ValidTotal)++;
+      if (!InRun) { RunStart = N; InRun = TRUE; }
+      continue;
+    }
+    if (!InRun) continue;
+    InRun = FALSE;
+    IntervalSetAdd (&mMsrCache.Valid, Scan->FirstMsr + (UINT32)RunStart, Scan->FirstMsr + (UINT32)(N - 1));
+    if (!Quit) {
+      Print (L"%08x   %08x   %ld\n", Scan->FirstMsr + (UINT32)RunStart, Scan->FirstMsr + (UINT32)(N - 1), N - RunStart);
+      Quit = PageLineAccountingEx (&LineCount, PrintMsrScanTableHeader, 2);
+    }
+  }
+  return Quit;
+}
+
+STATIC VOID DoParallelMsrScan (VOID) {
+  UINT32       StartMsr, EndMsr;
+  UINT64       Span, ValidTotal;
+  MSR_SCAN_JOB Scan;
+  EFI_STATUS   Status;
+  BOOLEAN      Quit;
+  ShowHeaderAndMenu (MenuParallelMsrScan);
+
+  if (!CpuSupportsMsr ()) {
+    Print (L"[ERROR] CPU does not support MSR.\n"); WaitAnyKey (); return;
+  }
+  if (!PromptHexUint32 (L"Enter Start MSR Index (Hex): ", &StartMsr)) {
+    Print (L"Invalid start MSR index.\n"); WaitAnyKey (); return;
+  }
+  if (!PromptHexUint32 (L"Enter End   MSR Index (Hex): ", &EndMsr)) {
+    Print (L"Invalid end MSR index.\n"); WaitAnyKey (); return;
+  }
+  if (EndMsr < StartMsr) {
+    Print (L"[ERROR] End MSR must be >= Start MSR.\n"); WaitAnyKey (); return;
+  }
+  Span = (UINT64)EndMsr - StartMsr + 1;
+  if (Span > MSR_SCAN_MAX_SPAN) {
+    Print (L"[ERROR] Range too large (max 0x%x indices per scan).\n", MSR_SCAN_MAX_SPAN); WaitAnyKey (); return;
+  }
+
+  if (EFI_ERROR (MsrScanJobInit (&Scan, StartMsr, Span))) {
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); return;
+  }
+
+  Print (L"Scanning on %d CPU(s), %d chunks of 0x%x. Press ESC to abort.\n",
+         (UINT32)Scan.Cpus.SlotCount, Scan.ChunkCount, MSR_SCAN_CHUNK);
+  Status = MsrScanJobRun (&Scan);
+  if (Scan.Cpus.Orphaned) {
+    Print (L"\n[ERROR] Lost track of the APs (%r); partial results discarded.\n", Status);
+    WaitAnyKey ();
+    return;
+  }
+  if (EFI_ERROR (Status)) {
+    Print (L"[WARN] StartupAllAPs returned %r, BSP scanned alone.\n", Status);
+  }
+
+  if (Scan.Abort) {
+    Print (L"Scan aborted, results discarded.\n");
+    MsrScanJobFree (&Scan);
+    WaitAnyKey ();
+    return;
+  }
+
+  Quit = MsrScanMergeResults (&Scan, &ValidTotal);
+  MsrScanJobFree (&Scan);
+  if (EFI_ERROR (MsrCacheSave ())) {
+    Print (L"\n[WARN] Could not save MSR index cache to boot volume.\n");
+  }
+  if (Quit) return;
+  Print (L"\n%ld valid MSR(s) in %08x-%08x.\n", ValidTotal, StartMsr, EndMsr);
+  WaitAnyKey ();
+}
+
+//
+// =====================================================
+// Micro-Benchmark Harness
+// =====================================================
+//
+// Every sample is bracketed by LFENCE; RDTSC on the way in and RDTSCP (or
+// LFENCE; RDTSC without it) on the way out, with interrupts disabled.
+// Results are in TSC cycles; "Net" subtracts the median of an empty
+// operation timed the same way.
+//
+#define BENCH_DEFAULT_SAMPLES        0x400
+#define BENCH_MAX_SAMPLES            0x10000
+#define BENCH_WARMUP                 32
+
+typedef BOOLEAN (*BENCH_OP)(IN VOID *Context);   // FALSE when the operation is unavailable
+
+typedef struct {
+  UINT64 Min;
+  UINT64 Median;
+  UINT64 Mean;
+  UINT64 P99;
+} BENCH_STATS;
+
+//
+// Times Op Count times and reduces the sorted samples to Stats. Returns
+// FALSE (without timing) if a trial call of Op fails.
+//
+STATIC BOOLEAN BenchMeasure (IN BENCH_OP Op, IN VOID *Context, IN OUT UINT64 *Samples, IN UINTN Count, OUT BENCH_STATS *Stats) {
+  UINT64  T0, T1, Sum = 0;
+  UINT32  Aux;
+  UINTN   I;
+  BOOLEAN IntState, UseRdtscp = CPU_HAS (CpuFeatRdtscp);
+
+  ZeroMem (Stats, sizeof (*Stats));
+  if (Count == 0 || !Op (Context)) return FALSE;
+  IntState = SaveAndDisableInterrupts ();
+  for (I = 0; I < BENCH_WARMUP; I++) Op (Context);
+  for (I = 0; I < Count; I++) {
+    AsmLfence ();
+    T0 = AsmReadTsc ();
+    AsmLfence ();
+    Op (Context);
+    if (UseRdtscp) {
+      ProbeRdtscp (&T1, &Aux);
+    } else {
+      AsmLfence ();
+      T1 = AsmReadTsc ();
+    }
+    AsmLfence ();
+    Samples[I] = T1 - T0;
+  }
+  SetInterruptState (IntState);
+
+  SortUint64 (Samples, Count);
+  for (I = 0; I < Count; I++) Sum += Samples[I];
+  Stats->Min    = Samples[0];
+  Stats->Median = Samples[Count / 2];
+  Stats->Mean   = DivU64x32 (Sum, (UINT32)Count);
+  Stats->P99    = Samples[(Count * 99) / 100];
+  return TRUE;
+}
+
+STATIC UINT64 BenchNet (IN CONST BENCH_STATS *Stats, IN UINT64 Overhead) {
+  return (Stats->Median > Overhead) ? Stats->Median - Overhead : 0;
+}
+
+//
+// TSC rate from CPUID 0x15 (crystal * ratio) when enumerated, else measured
+// once against a 50ms Stall.
+//
+STATIC UINT64 BenchTscHz (VOID) {
+  STATIC UINT64 TscHz = 0;
+  UINT32        Eax = 0, Ebx = 0, Ecx = 0;
+  UINT64        Start;
+
+  if (TscHz != 0) return TscHz;
+  CpuidDbGet (0x15, 0, &Eax, &Ebx, &Ecx, NULL);
+  if (Eax != 0 && Ebx != 0 && Ecx != 0) {
+    TscHz = DivU64x32 (MultU64x32 (Ecx, Ebx), Eax);
+  } else {
+    Start = AsmReadTsc ();
+    gBS->Stall (50000);
+    TscHz = MultU64x32 (AsmReadTsc () - Start, 20);
+  }
+  return TscHz;
+}
+
+STATIC BOOLEAN BenchOpEmpty (IN VOID *Context) {
+  return TRUE;
+}
+
+//
+// Context: CPUID_DB_ENTRY (Leaf / SubLeaf used).
+//
+STATIC BOOLEAN BenchOpCpuid (IN VOID *Context) {
+  CONST CPUID_DB_ENTRY *Entry = (CONST CPUID_DB_ENTRY *)Context;
+  UINT32               Eax;
+  AsmCpuidEx (Entry->Leaf, Entry->SubLeaf, &Eax, NULL, NULL, NULL);
+  return TRUE;
+}
+
+//
+// Context: UINT32 MSR index. Raw only runs on indices already known valid.
+//
+STATIC BOOLEAN BenchOpRdmsrRaw (IN VOID *Context) {
+  AsmReadMsr64 (*(UINT32 *)Context);
+  return TRUE;
+}
+
+STATIC BOOLEAN BenchOpRdmsrSafe (IN VOID *Context) {
+  UINT64 Value;
+  SafeReadMsr (*(UINT32 *)Context, &Value);
+  return TRUE;                                   // the fault path is timed too
+}
+
+STATIC BOOLEAN BenchOpIoRead (IN VOID *Context) {
+  IoRead8 (*(UINT16 *)Context);
+  return TRUE;
+}
+
+STATIC BOOLEAN BenchOpRdmsrProbe (IN VOID *Context) {
+  UINT64 Value;
+  return (BOOLEAN)(ProbeReadMsr (*(UINT32 *)Context, &Value) == PROBE_OK);
+}
+
+STATIC UINT64 BenchCalibrate (IN OUT UINT64 *Samples, IN UINTN Count) {
+  BENCH_STATS Stats;
+  BenchMeasure (BenchOpEmpty, NULL, Samples, Count, &Stats);
+  return Stats.Median;
+}
+
+//
+// ----- VM exit cost -----
+//
+// Each operation below unconditionally exits to the hypervisor on common
+// VMMs.
+//
+#define VMEXIT_BENCH_IO_PORT         0x80         // POST code port, trapped by every VMM we care about
+#define VMEXIT_BENCH_MSR             MSR_IA32_APIC_BASE
+
+typedef struct {
+  CONST CHAR16 *Name;
+  BENCH_OP     Op;
+  VOID         *Context;
+} BENCH_CASE;
+
+STATIC VOID DoVmExitBench (VOID) {
+  STATIC CPUID_DB_ENTRY Leaf0   = { 0, 0, 0, 0, 0, 0 };
+  STATIC UINT32         Msr     = VMEXIT_BENCH_MSR;
+  STATIC UINT16         Port    = VMEXIT_BENCH_IO_PORT;
+  CONST BENCH_CASE      Cases[] = {
+    { L"CPUID leaf 0",    BenchOpCpuid,      &Leaf0 },
+    { L"RDMSR APIC_BASE", BenchOpRdmsrProbe, &Msr   },
+    { L"IN port 0x80",    BenchOpIoRead,     &Port  }
+  };
+  UINT64      *Samples, Overhead;
+  BENCH_STATS Stats;
+  UINTN       I;
+  ShowHeaderAndMenu (MenuVmExitBench);
+
+  Samples = AllocatePool (BENCH_DEFAULT_SAMPLES * sizeof (UINT64));
+  if (Samples == NULL) {
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); return;
+  }
+
+  Print (L"Hypervisor : %a\n", (mCpuidDb.MaxHypervisorLeaf != 0) ? mCpuidDb.HypervisorVendor : "(none, bare metal)");
+  Print (L"Samples    : %d per operation, TSC cycles, interrupts disabled\n\n", BENCH_DEFAULT_SAMPLES);
+  SetAttrHighlight ();
+  Print (L"Operation            Min       Median    Mean      P99       Net(median)\n");
+  SetAttrNormal ();
+
+  Overhead = BenchCalibrate (Samples, BENCH_DEFAULT_SAMPLES);
+  Print (L"%-18s   %-8ld  -\n", L"(empty)", Overhead);
+  for (I = 0; I < ARRAY_SIZE (Cases); I++) {
+    if (!BenchMeasure (Cases[I].Op, Cases[I].Context, Samples, BENCH_DEFAULT_SAMPLES, &Stats)) {
+      Print (L"%-18s   n/a (faulted)\n", Cases[I].Name);
+      continue;
+    }
+    Print (L"%-18s   %-8ld  %-8ld  %-8ld  %-8ld  %ld\n", Cases[I].Name,
+           Stats.Min, Stats.Median, Stats.Mean, Stats.P99, BenchNet (&Stats, Overhead));
+  }
+
+  FreePool (Samples);
+  Print (L"\nNet = median minus the empty-operation median (timing overhead).\n");
+  WaitAnyKey ();
+}
+
+//
+// ----- CPUID / RDMSR latency -----
+//
+STATIC VOID PrintCpuidBenchHeader (VOID) {
+  Print (L"Leaf/SubLeaf       Min       Median    P99       Net\n");
+  Print (L"------------------------------------------------------\n");
+}
+
+STATIC VOID PrintMsrBenchHeader (VOID) {
+  Print (L"MSR        Raw(net)  Safe(net) Safe P99  Status\n");
+  Print (L"------------------------------------------------\n");
+}
+
+STATIC VOID DoCpuidMsrBench (VOID) {
+  UINT64      *Samples, Overhead, Value;
+  UINT32      Samples32, MsrList[PERCPU_MSR_MAX];
+  UINTN       SampleCount, MsrCount, I, LineCount;
+  CHAR16      Input[MSR_LIST_INPUT_LEN];
+  BENCH_STATS Stats, Raw;
+  BOOLEAN     Valid, HaveRaw;
+  ShowHeaderAndMenu (MenuCpuidMsrBench);
+
+  SampleCount = BENCH_DEFAULT_SAMPLES;
+  if (PromptHexUint32 (L"Repetitions (Hex, Enter = 0x400): ", &Samples32) && Samples32 != 0) {
+    SampleCount = MIN (Samples32, BENCH_MAX_SAMPLES);
+  }
+  Print (L"Enter MSR list (Hex, max %d, Enter = default): ", PERCPU_MSR_MAX);
+  if (!ReadLine (Input, MSR_LIST_INPUT_LEN)) return;
+  if (Input[0] == L'\0') {
+    MsrCount = sizeof (mPerCpuDefaultMsrs) / sizeof (mPerCpuDefaultMsrs[0]);
+    CopyMem (MsrList, mPerCpuDefaultMsrs, sizeof (mPerCpuDefaultMsrs));
+  } else {
+    MsrCount = ParseHexList32 (Input, MsrList, PERCPU_MSR_MAX);
+    if (MsrCount == 0) {
+      Print (L"Invalid MSR list.\n"); WaitAnyKey (); return;
+    }
+  }
+
+  Samples = AllocatePool (SampleCount * sizeof (UINT64));
+  if (Samples == NULL) {
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); return;
+  }
+
+  ClearScreenAndResetAttr ();
+  Overhead = BenchCalibrate (Samples, SampleCount);
+  Print (L"%d samples each, TSC cycles, %s end stamp, timing overhead %ld\n\n", (UINT32)SampleCount,
+         CPU_HAS (CpuFeatRdtscp) ? L"RDTSCP" : L"LFENCE+RDTSC", Overhead);
+  PrintCpuidBenchHeader ();
+  LineCount = 4;
+
+  for (I = 0; I < mCpuidDb.Count; I++) {
+    BenchMeasure (BenchOpCpuid, &mCpuidDb.Entries[I], Samples, SampleCount, &Stats);
+    Print (L"%08x/%08x  %-8ld  %-8ld  %-8ld  %ld\n", mCpuidDb.Entries[I].Leaf, mCpuidDb.Entries[I].SubLeaf,
+           Stats.Min, Stats.Median, Stats.P99, BenchNet (&Stats, Overhead));
+    if (PageLineAccountingEx (&LineCount, PrintCpuidBenchHeader, 2)) goto Exit;
+  }
+
+  if (CpuSupportsMsr ()) {
+    Print (L"\nRaw = AsmReadMsr64, Safe = SafeReadMsr (fault handler registered once at startup).\n\n");
+    PrintMsrBenchHeader ();
+    LineCount += 5;
+    for (I = 0; I < MsrCount; I++) {
+      Valid   = SafeReadMsr (MsrList[I], &Value);
+      HaveRaw = Valid && BenchMeasure (BenchOpRdmsrRaw, &MsrList[I], Samples, SampleCount, &Raw);
+      BenchMeasure (BenchOpRdmsrSafe, &MsrList[I], Samples, SampleCount, &Stats);
+
+      if (HaveRaw) Print (L"%08x   %-8ld  ", MsrList[I], BenchNet (&Raw, Overhead));
+      else         Print (L"%08x   -         ", MsrList[I]);
+      Print (L"%-8ld  %-8ld  %s\n", BenchNet (&Stats, Overhead), Stats.P99,
+             Valid ? L"OK" : L"#GP (fault path)");
+      if (PageLineAccountingEx (&LineCount, PrintMsrBenchHeader, 2)) goto Exit;
+    }
+  }
+  WaitAnyKey ();
+
+Exit:
+  FreePool (Samples);
+}
+
+//
+// =====================================================
+// MTRR Memory Map View
+// =====================================================
+//
+STATIC VOID PrintMtrrMapHeader (VOID) {
+  Print (L"First              Last               Size        Type\n");
+  Print (L"-----------------------------------------------------------------\n");
+}
+
+STATIC BOOLEAN PrintMtrrMap (IN CONST MTRR_MEMORY_MAP *Map, IN OUT UINTN *LineCount) {
+  CHAR16 SizeStr[16];
+  UINTN  I;
+
+  PrintMtrrMapHeader ();
+  *LineCount += 2;
+  for (I = 0; I < Map->Count; I++) {
+    FormatByteSize (Map->Items[I].Last - Map->Items[I].First + 1, SizeStr, ARRAY_SIZE (SizeStr));
+    Print (L"%016lx - %016lx  %-10s  %s\n", Map->Items[I].First, Map->Items[I].Last, SizeStr, MtrrTypeToStr (Map->Items[I].Type));
+    if (PageLineAccountingEx (LineCount, PrintMtrrMapHeader, 2)) return TRUE;
+  }
+  return FALSE;
+}
+
+STATIC VOID DoMtrrMemoryMap (VOID) {
+  MTRR_SNAPSHOT        Snap;
+  MTRR_MEMORY_MAP      Map;
+  CONST MTRR_MAP_ENTRY *Entry;
+  UINT64               Address;
+  UINTN                LineCount = 0;
+  ShowHeaderAndMenu (MenuMtrrMap);
+
+  if (!CpuSupportsMsr () || !CpuSupportsMtrr ()) {
+    Print (L"[ERROR] CPU does not support MSR/MTRR.\n"); WaitAnyKey (); return;
+  }
+  if (EFI_ERROR (MtrrSnapshotRead (&Snap))) {
+    Print (L"[ERROR] Failed to read MTRR registers.\n"); WaitAnyKey (); return;
+  }
+  if (EFI_ERROR (MtrrMapBuild (&Snap, &Map))) {
+    MtrrSnapshotFree (&Snap);
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); return;
+  }
+
+  Print (L"=== [ Effective Memory Types ] ===  %d region(s), PhysAddrBits %d\n", (UINT32)Map.Count, (UINT32)Snap.PhysAddrBits);
+  LineCount++;
+  if (Map.Undefined != 0) {
+    Print (L"[WARN] %d region(s) have overlapping types with undefined behaviour.\n", (UINT32)Map.Undefined);
+    LineCount++;
+  }
+  if (Map.SkippedRanges != 0) {
+    Print (L"[WARN] %d variable range(s) skipped (more than %d mask holes).\n", (UINT32)Map.SkippedRanges, MTRR_MAX_MASK_HOLES);
+    LineCount++;
+  }
+
+  if (!PrintMtrrMap (&Map, &LineCount)) {
+    Print (L"\n");
+    while (PromptHexUint64 (L"Lookup address (Hex, empty to exit): ", &Address)) {
+      Entry = MtrrMapLookup (&Map, Address);
+      if (Entry == NULL) {
+        Print (L"  %016lx is above the physical address width.\n", Address);
+      } else {
+        Print (L"  %016lx -> %s  (region %016lx - %016lx)\n", Address, MtrrTypeToStr (Entry->Type), Entry->First, Entry->Last);
+      }
+    }
+  }
+
+  MtrrMapFree (&Map);
+  MtrrSnapshotFree (&Snap);
+}
+
+//
+// =====================================================
+// MTRR vs UEFI Memory Map Audit
+// =====================================================
+//
+typedef enum {
+  MemClassOther = 0,
+  MemClassRam,
+  MemClassMmio
+} MEM_CLASS;
+
+typedef struct {
+  UINT64    First;
+  UINT64    Last;
+  UINT8     Type;
+  MEM_CLASS Class;
+  BOOLEAN   Valid;
+} MTRR_AUDIT_REGION;
+
+//
+// Returns the current memory map in a pool buffer the caller frees.
+//
+STATIC EFI_STATUS GetUefiMemoryMap (OUT EFI_MEMORY_DESCRIPTOR **MemMap, OUT UINTN *EntryCount, OUT UINTN *DescSize) {
+  EFI_STATUS Status;
+  UINTN      MapSize = 0, MapKey;
+  UINT32     DescVersion;
+
+  *MemMap = NULL;
+  Status  = gBS->GetMemoryMap (&MapSize, NULL, &MapKey, DescSize, &DescVersion);
+  while (Status == EFI_BUFFER_TOO_SMALL) {
+    if (*MemMap != NULL) FreePool (*MemMap);
+    MapSize += 4 * (*DescSize);          // our own allocation may add descriptors
+    *MemMap  = AllocatePool (MapSize);
+    if (*MemMap == NULL) return EFI_OUT_OF_RESOURCES;
+    Status = gBS->GetMemoryMap (&MapSize, *MemMap, &MapKey, DescSize, &DescVersion);
+  }
+  if (EFI_ERROR (Status)) {
+    if (*MemMap != NULL) FreePool (*MemMap);
+    *MemMap = NULL;
+    return Status;
+  }
+  *EntryCount = MapSize / *DescSize;
+  return EFI_SUCCESS;
+}
+
+STATIC MEM_CLASS MemTypeClass (IN UINT32 Type) {
+  switch (Type) {
+    case EfiLoaderCode:
+    case EfiLoaderData:
+    case EfiBootServicesCode:
+    case EfiBootServicesData:
+    case EfiRuntimeServicesCode:
+    case EfiRuntimeServicesData:
+    case EfiConventionalMemory:
+    case EfiACPIReclaimMemory:
+    case EfiACPIMemoryNVS:
+    case EfiPersistentMemory:
+      return MemClassRam;
+    case EfiMemoryMappedIO:
+    case EfiMemoryMappedIOPortSpace:
+      return MemClassMmio;
+    default:
+      return MemClassOther;
+  }
+}
+
+STATIC UINTN MtrrAuditSlot (IN UINT8 Type) {
+  switch (Type) {
+    case MTRR_TYPE_UC: case MTRR_TYPE_WC: case MTRR_TYPE_WT: case MTRR_TYPE_WP: case MTRR_TYPE_WB:
+      return Type;
+    default:
+      return MTRR_AUDIT_TYPE_SLOTS - 1;
+  }
+}
+
+//
+// A region is suspicious when RAM is not WB or MMIO is WB.
+//
+STATIC BOOLEAN MtrrAuditIsSuspicious (IN CONST MTRR_AUDIT_REGION *Region) {
+  if (Region->Class == MemClassRam)  return (BOOLEAN)(Region->Type != MTRR_TYPE_WB);
+  if (Region->Class == MemClassMmio) return (BOOLEAN)(Region->Type == MTRR_TYPE_WB);
+  return FALSE;
+}
+
+STATIC VOID PrintMtrrAuditHeader (VOID) {
+  Print (L"Class  First              Last               Size        MTRR Type\n");
+  Print (L"---------------------------------------------------------------------\n");
+}
+
+//
+// Prints Region if suspicious. Returns TRUE if the user quit paging.
+//
+STATIC BOOLEAN MtrrAuditFlush (IN OUT MTRR_AUDIT_REGION *Region, IN OUT UINTN *Flagged, IN OUT UINTN *LineCount) {
+  CHAR16 SizeStr[16];
+
+  if (!Region->Valid) return FALSE;
+  Region->Valid = FALSE;
+  if (!MtrrAuditIsSuspicious (Region)) return FALSE;
+
+  if (*Flagged == 0) {
+    PrintMtrrAuditHeader ();
+    *LineCount += 2;
+  }
+  (*Flagged)++;
+  FormatByteSize (Region->Last - Region->First + 1, SizeStr, ARRAY_SIZE (SizeStr));
+  SetAttrHighlight ();
+  Print (L"%-5s  %016lx - %016lx  %-10s  %s\n", (Region->Class == MemClassRam) ? L"RAM" : L"MMIO",
+         Region->First, Region->Last, SizeStr, MtrrTypeToStr (Region->Type));
+  SetAttrNormal ();
+  return PageLineAccountingEx (LineCount, PrintMtrrAuditHeader, 2);
+}
+
+STATIC VOID DoMtrrAudit (VOID) {
+  MTRR_SNAPSHOT         Snap;
+  MTRR_MEMORY_MAP       Map;
+  EFI_MEMORY_DESCRIPTOR *MemMap, *Desc;
+  CONST MTRR_MAP_ENTRY  *Entry;
+  MTRR_AUDIT_REGION     Pending, Piece;
+  UINT64                RamBytes[MTRR_AUDIT_TYPE_SLOTS], RamTotal = 0, First, Last;
+  UINTN                 EntryCount, DescSize, I, Pos, Flagged = 0, LineCount = 0;
+  MEM_CLASS             Class;
+  CHAR16                SizeStr[16];
+  STATIC CONST UINT8    SlotTypes[] = { MTRR_TYPE_WB, MTRR_TYPE_WT, MTRR_TYPE_WP, MTRR_TYPE_WC, MTRR_TYPE_UC, MTRR_TYPE_UNDEFINED };
+  ShowHeaderAndMenu (MenuMtrrAudit);
+
+  if (!CpuSupportsMsr () || !CpuSupportsMtrr ()) {
+    Print (L"[ERROR] CPU does not support MSR/MTRR.\n"); WaitAnyKey (); return;
+  }
+  if (EFI_ERROR (MtrrSnapshotRead (&Snap))) {
+    Print (L"[ERROR] Failed to read MTRR registers.\n"); WaitAnyKey (); return;
+  }
+  if (EFI_ERROR (MtrrMapBuild (&Snap, &Map))) {
+    MtrrSnapshotFree (&Snap);
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); return;
+  }
+  MtrrSnapshotFree (&Snap);
+  if (EFI_ERROR (GetUefiMemoryMap (&MemMap, &EntryCount, &DescSize))) {
+    MtrrMapFree (&Map);
+    Print (L"[ERROR] GetMemoryMap failed.\n"); WaitAnyKey (); return;
+  }
+
+  ZeroMem (RamBytes, sizeof (RamBytes));
+  ZeroMem (&Pending, sizeof (Pending));
+  Print (L"=== [ Suspicious Regions ]  (RAM not WB, MMIO marked WB) ===\n");
+  LineCount++;
+
+  for (I = 0, Desc = MemMap; I < EntryCount; I++, Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescSize)) {
+    Class = MemTypeClass (Desc->Type);
+    if (Class == MemClassOther || Desc->NumberOfPages == 0) continue;
+    First = Desc->PhysicalStart;
+    Last  = First + LShiftU64 (Desc->NumberOfPages, EFI_PAGE_SHIFT) - 1;
+
+    // Walk every map entry the descriptor overlaps
+    Entry = MtrrMapLookup (&Map, First);
+    for (Pos = (Entry == NULL) ? Map.Count : (UINTN)(Entry - Map.Items); Pos < Map.Count && Map.Items[Pos].First <= Last; Pos++) {
+      Piece.First = MAX (First, Map.Items[Pos].First);
+      Piece.Last  = MIN (Last, Map.Items[Pos].Last);
+      Piece.Type  = Map.Items[Pos].Type;
+      Piece.Class = Class;
+      Piece.Valid = TRUE;
+      if (Class == MemClassRam) {
+        RamBytes[MtrrAuditSlot (Piece.Type)] += Piece.Last - Piece.First + 1;
+        RamTotal                             += Piece.Last - Piece.First + 1;
+      }
+
+      // Coalesce contiguous pieces of the same class and type before reporting
+      if (Pending.Valid && Pending.Class == Piece.Class && Pending.Type == Piece.Type && Pending.Last + 1 == Piece.First) {
+        Pending.Last = Piece.Last;
+        continue;
+      }
+      if (MtrrAuditFlush (&Pending, &Flagged, &LineCount)) goto Exit;
+      Pending = Piece;
+    }
+  }
+  if (MtrrAuditFlush (&Pending, &Flagged, &LineCount)) goto Exit;
+  if (Flagged == 0) {
+    Print (L"None.\n");
+    LineCount++;
+  }
+
+  Print (L"\n=== [ RAM by Effective MTRR Type ] ===\n");
+  if (PageLineAccountingEx (&LineCount, NULL, 0)) goto Exit;
+  if (PageLineAccountingEx (&LineCount, NULL, 0)) goto Exit;
+  for (I = 0; I < ARRAY_SIZE (SlotTypes); I++) {
+    FormatByteSize (RamBytes[MtrrAuditSlot (SlotTypes[I])], SizeStr, ARRAY_SIZE (SizeStr));
+    Print (L"%-20s : %-12s (%ld bytes)\n", (SlotTypes[I] == MTRR_TYPE_UNDEFINED) ? L"Other / Undefined" : MtrrTypeToStr (SlotTypes[I]),
+           SizeStr, RamBytes[MtrrAuditSlot (SlotTypes[I])]);
+    if (PageLineAccountingEx (&LineCount, NULL, 0)) goto Exit;
+  }
+  FormatByteSize (RamTotal, SizeStr, ARRAY_SIZE (SizeStr));
+  Print (L"%-20s : %-12s, %d suspicious region(s)\n", L"Total RAM", SizeStr, (UINT32)Flagged);
+  WaitAnyKey ();
+
+Exit:
+  FreePool (MemMap);
+  MtrrMapFree (&Map);
+}
+
+//
+// =====================================================
+// Variable MTRR Layout Solver / What-If Planner
+// =====================================================
+//
+// Given a desired address -> type map, finds a default type plus a small
+// set of power-of-two aligned variable MTRRs that reproduce it. Each run of
+// non-default type T is either covered exactly, or widened to an aligned
+// boundary where the spill lands on memory whose type already beats T
+// (UC, or WT over WB) or on "don't care" memory; spill onto default-typed
+// memory is carved back out with blocks of the default type.
+//
+typedef struct {
+  MTRR_VARIABLE_PAIR *Pairs;
+  UINTN              Count;
+  UINTN              Capacity;
+  UINT8              DefaultType;
+} MTRR_SOLUTION;
+
+typedef struct {
+  UINT64             DefType;
+  CONST MTRR_VARIABLE_PAIR *Pairs;   // VariableCount entries, unused ones zero (copied after the job)
+  UINTN              VariableCount;
+  volatile UINT32    FailedCpus;
+  volatile UINT32    Arrived;         // CPUs at the entry rendezvous, or MTRR_RENDEZVOUS_ABORT
+  volatile UINT32    Left;            // CPUs at the exit rendezvous
+  volatile UINT32    Finished;        // CPUs done touching the job
+  volatile BOOLEAN   Abort;           // entry rendezvous timed out, no CPU touched an MTRR
+  UINT32             Expected;
+  UINT64             TimeoutTicks;
+} MTRR_APPLY_JOB;
+
+STATIC VOID MtrrSolutionFree (IN OUT MTRR_SOLUTION *Sol) {
+  if (Sol->Pairs != NULL) FreePool (Sol->Pairs);
+  ZeroMem (Sol, sizeof (*Sol));
+}
+
+STATIC BOOLEAN MtrrSolutionAdd (IN OUT MTRR_SOLUTION *Sol, IN UINT64 Base, IN UINT64 Size, IN UINT8 Type, IN UINT64 AddrMask) {
+  MTRR_VARIABLE_PAIR *NewPairs;
+  UINTN              NewCapacity;
+
+  if (Sol->Count == Sol->Capacity) {
+    NewCapacity = MAX (16, Sol->Capacity * 2);
+    NewPairs    = ReallocatePool (Sol->Capacity * sizeof (MTRR_VARIABLE_PAIR), NewCapacity * sizeof (MTRR_VARIABLE_PAIR), Sol->Pairs);
+    if (NewPairs == NULL) return FALSE;
+    Sol->Pairs    = NewPairs;
+    Sol->Capacity = NewCapacity;
+  }
+  Sol->Pairs[Sol->Count].Base = Base | Type;
+  Sol->Pairs[Sol->Count].Mask = (~(Size - 1) & AddrMask & ~(UINT64)0xFFF) | IA32_MTRR_PHYSMASK_VALID_BIT;
+  Sol->Count++;
+  return TRUE;
+}
+
+//
+// Number of aligned power-of-two blocks that tile [First, End) exactly
+// (greedy largest-aligned-block, which is optimal for an exact tiling).
+// Emits them into Sol when Sol is not NULL.
+//
+STATIC UINTN MtrrTileRange (IN UINT64 First, IN UINT64 End, IN UINT8 Type, IN UINT64 AddrMask, IN OUT MTRR_SOLUTION *Sol OPTIONAL) {
+  UINT64 Size;
+  UINTN  Count = 0;
+
+  while (First < End) {
+    Size = GetPowerOfTwo64 (End - First);
+    if (First != 0 && (First & (~First + 1)) < Size) Size = First & (~First + 1);
+    if (Sol != NULL && !MtrrSolutionAdd (Sol, First, Size, Type, AddrMask)) return MAX_UINTN;
+    First += Size;
+    Count++;
+  }
+  return Count;
+}
+
+//
+// Checks that type T may spill over [First, End). Returns MAX_UINTN when it
+// may not, otherwise the number of carve-out blocks needed (emitted into Sol
+// when not NULL).
+//
+STATIC UINTN MtrrSpill (
+  IN     CONST MTRR_MEMORY_MAP *Desired,
+  IN     UINT64                First,
+  IN     UINT64                End,
+  IN     UINT8                 Type,
+  IN     UINT8                 DefaultType,
+  IN     UINT64                AddrMask,
+  IN OUT MTRR_SOLUTION         *Sol OPTIONAL
+  )
+{
+  CONST MTRR_MAP_ENTRY *Entry;
+  UINTN                Pos, Carve = 0, Blocks;
+  UINT64               PieceFirst, PieceEnd;
+  UINT8                Other;
+
+  if (First >= End) return 0;
+  Entry = MtrrMapLookup (Desired, First);
+  if (Entry == NULL) return MAX_UINTN;
+  for (Pos = (UINTN)(Entry - Desired->Items); Pos < Desired->Count && Desired->Items[Pos].First < End; Pos++) {
+    Other = Desired->Items[Pos].Type;
+    if (Other == MTRR_TYPE_DONT_CARE) continue;
+    if (MtrrCombineTypes (Type, Other) != Other) return MAX_UINTN;
+    if (Other != DefaultType) continue;          // covered by its own blocks
+    PieceFirst = MAX (First, Desired->Items[Pos].First);
+    PieceEnd   = MIN (End, Desired->Items[Pos].Last + 1);
+    Blocks     = MtrrTileRange (PieceFirst, PieceEnd, Other, AddrMask, Sol);
+    if (Blocks == MAX_UINTN) return MAX_UINTN;
+    Carve += Blocks;
+  }
+  return Carve;
+}
+
+#define MTRR_SOLVER_MAX_CANDIDATES   64
+
+//
+// Solves for one default type. Returns the register count (MAX_UINTN on
+// allocation failure); fills Sol when it is not NULL.
+//
+STATIC UINTN MtrrSolveWithDefault (
+  IN     CONST MTRR_MEMORY_MAP *Desired,
+  IN     UINT8                 DefaultType,
+  IN     UINT8                 PhysAddrBits,
+  IN OUT MTRR_SOLUTION         *Sol OPTIONAL
+  )
+{
+  UINT64 AddrMask = LShiftU64 (1, PhysAddrBits) - 1;
+  UINT64 Lows[MTRR_SOLVER_MAX_CANDIDATES], Highs[MTRR_SOLVER_MAX_CANDIDATES];
+  UINTN  LowCarve[MTRR_SOLVER_MAX_CANDIDATES], HighCarve[MTRR_SOLVER_MAX_CANDIDATES];
+  UINTN  LowCount, HighCount, L, H, Cost, Best, BestL, BestH, Total = 0, Carve, Run;
+  UINT64 First, End, Align, Candidate;
+  UINT8  Type;
+  UINTN  Bit;
+
+  for (Run = 0; Run < Desired->Count; Run++) {
+    Type = Desired->Items[Run].Type;
+    if (Type == DefaultType || Type == MTRR_TYPE_DONT_CARE) continue;
+    First = Desired->Items[Run].First;
+    End   = Desired->Items[Run].Last + 1;
+
+    // Candidate widened edges: the run itself, then each larger alignment
+    // for as long as the spill stays legal.
+    Lows[0] = First;  LowCarve[0]  = 0; LowCount  = 1;
+    Highs[0] = End;   HighCarve[0] = 0; HighCount = 1;
+    for (Bit = 12; Bit < PhysAddrBits && (LowCount < MTRR_SOLVER_MAX_CANDIDATES); Bit++) {
+      Align     = LShiftU64 (1, Bit);
+      Candidate = First & ~(Align - 1);
+      if (Candidate == Lows[LowCount - 1]) continue;
+      Carve = MtrrSpill (Desired, Candidate, First, Type, DefaultType, AddrMask, NULL);
+      if (Carve == MAX_UINTN) break;
+      Lows[LowCount] = Candidate; LowCarve[LowCount++] = Carve;
+    }
+    for (Bit = 12; Bit <= PhysAddrBits && (HighCount < MTRR_SOLVER_MAX_CANDIDATES); Bit++) {
+      Align     = LShiftU64 (1, Bit);
+      Candidate = (End + Align - 1) & ~(Align - 1);
+      if (Candidate > AddrMask + 1) break;
+      if (Candidate == Highs[HighCount - 1]) continue;
+      Carve = MtrrSpill (Desired, End, Candidate, Type, DefaultType, AddrMask, NULL);
+      if (Carve == MAX_UINTN) break;
+      Highs[HighCount] = Candidate; HighCarve[HighCount++] = Carve;
+    }
+
+    Best = MAX_UINTN; BestL = 0; BestH = 0;
+    for (L = 0; L < LowCount; L++) {
+      for (H = 0; H < HighCount; H++) {
+        Cost = MtrrTileRange (Lows[L], Highs[H], Type, AddrMask, NULL) + LowCarve[L] + HighCarve[H];
+        if (Cost < Best) { Best = Cost; BestL = L; BestH = H; }
+      }
+    }
+
+    if (Sol != NULL) {
+      if (MtrrTileRange (Lows[BestL], Highs[BestH], Type, AddrMask, Sol) == MAX_UINTN) return MAX_UINTN;
+      if (MtrrSpill (Desired, Lows[BestL], First, Type, DefaultType, AddrMask, Sol) == MAX_UINTN) return MAX_UINTN;
+      if (MtrrSpill (Desired, End, Highs[BestH], Type, DefaultType, AddrMask, Sol) == MAX_UINTN) return MAX_UINTN;
+    }
+    Total += Best;
+  }
+  return Total;
+}
+
+//
+// Tries every type present in Desired as the default and keeps the cheapest.
+//
+STATIC EFI_STATUS MtrrSolve (IN CONST MTRR_MEMORY_MAP *Desired, IN UINT8 PhysAddrBits, OUT MTRR_SOLUTION *Sol) {
+  STATIC CONST UINT8 Candidates[] = { MTRR_TYPE_UC, MTRR_TYPE_WB, MTRR_TYPE_WT, MTRR_TYPE_WP, MTRR_TYPE_WC };
+  UINTN              I, J, Cost, Best = MAX_UINTN;
+  UINT8              BestType = MTRR_TYPE_UC;
+  BOOLEAN            Present;
+
+  ZeroMem (Sol, sizeof (*Sol));
+  for (I = 0; I < Desired->Count; I++) {
+    if (Desired->Items[I].Type == MTRR_TYPE_UNDEFINED) return EFI_INVALID_PARAMETER;
+  }
+  for (I = 0; I < ARRAY_SIZE (Candidates); I++) {
+    for (J = 0, Present = FALSE; J < Desired->Count && !Present; J++) {
+      Present = (BOOLEAN)(Desired->Items[J].Type == Candidates[I]);
+    }
+    if (!Present && I != 0) continue;            // UC is always a valid default
+    Cost = MtrrSolveWithDefault (Desired, Candidates[I], PhysAddrBits, NULL);
+    if (Cost < Best) { Best = Cost; BestType = Candidates[I]; }
+  }
+  Sol->DefaultType = BestType;
+  if (MtrrSolveWithDefault (Desired, BestType, PhysAddrBits, Sol) == MAX_UINTN) {
+    MtrrSolutionFree (Sol);
+    return EFI_OUT_OF_RESOURCES;
+  }
+  return EFI_SUCCESS;
+}
+
+//
+// Desired map = current effective map, with the first MB marked "don't
+// care" when the fixed MTRRs own it.
+//
+STATIC EFI_STATUS MtrrDesiredFromSnapshot (IN CONST MTRR_SNAPSHOT *Snap, OUT MTRR_MEMORY_MAP *Desired) {
+  MTRR_MEMORY_MAP Current;
+  EFI_STATUS      Status;
+  UINTN           I;
+  BOOLEAN         FixedOn;
+
+  ZeroMem (Desired, sizeof (*Desired));
+  Status = MtrrMapBuild (Snap, &Current);
+  if (EFI_ERROR (Status)) return Status;
+
+  FixedOn = (BOOLEAN)(Snap->FixedValid && (Snap->DefType & IA32_MTRR_DEF_TYPE_E_BIT) != 0 &&
+                      (Snap->DefType & IA32_MTRR_DEF_TYPE_FE_BIT) != 0);
+  if (FixedOn && !MtrrMapAppend (Desired, 0, MTRR_FIXED_RANGE_END - 1, MTRR_TYPE_DONT_CARE)) Status = EFI_OUT_OF_RESOURCES;
+  for (I = 0; I < Current.Count && !EFI_ERROR (Status); I++) {
+    if (FixedOn && Current.Items[I].Last < MTRR_FIXED_RANGE_END) continue;
+    if (!MtrrMapAppend (Desired, MAX (Current.Items[I].First, FixedOn ? MTRR_FIXED_RANGE_END : 0),
+                        Current.Items[I].Last, Current.Items[I].Type)) {
+      Status = EFI_OUT_OF_RESOURCES;
+    }
+  }
+  MtrrMapFree (&Current);
+  if (EFI_ERROR (Status)) MtrrMapFree (Desired);
+  return Status;
+}
+
+//
+// Replaces [First, Last] in Map with Type.
+//
+STATIC EFI_STATUS MtrrMapOverride (IN OUT MTRR_MEMORY_MAP *Map, IN UINT64 First, IN UINT64 Last, IN UINT8 Type) {
+  MTRR_MEMORY_MAP New;
+  UINTN           I;
+  BOOLEAN         Ok = TRUE, Inserted = FALSE;
+  MTRR_MAP_ENTRY  *Item;
+
+  ZeroMem (&New, sizeof (New));
+  for (I = 0; I < Map->Count && Ok; I++) {
+    Item = &Map->Items[I];
+    if (Item->Last < First || Item->First > Last) {
+      if (Item->First > Last && !Inserted) { Ok = MtrrMapAppend (&New, First, Last, Type); Inserted = TRUE; }
+      if (Ok) Ok = MtrrMapAppend (&New, Item->First, Item->Last, Item->Type);
+      continue;
+    }
+    if (Item->First < First) Ok = MtrrMapAppend (&New, Item->First, First - 1, Item->Type);
+    if (Ok && !Inserted) { Ok = MtrrMapAppend (&New, First, Last, Type); Inserted = TRUE; }
+    if (Ok && Item->Last > Last) Ok = MtrrMapAppend (&New, Last + 1, Item->Last, Item->Type);
+  }
+  if (!Ok) {
+    MtrrMapFree (&New);
+    return EFI_OUT_OF_RESOURCES;
+  }
+  MtrrMapFree (Map);
+  *Map = New;
+  return EFI_SUCCESS;
+}
+
+//
+// Rebuilds the effective map from the proposed registers and compares it
+// with Desired ("don't care" ranges are skipped).
+//
+STATIC BOOLEAN MtrrSolutionVerify (IN CONST MTRR_SNAPSHOT *Snap, IN CONST MTRR_SOLUTION *Sol, IN CONST MTRR_MEMORY_MAP *Desired) {
+  MTRR_SNAPSHOT        Proposed;
+  MTRR_MEMORY_MAP      Result;
+  CONST MTRR_MAP_ENTRY *Entry;
+  UINTN                I, Pos;
+  BOOLEAN              Match = TRUE;
+
+  CopyMem (&Proposed, Snap, sizeof (Proposed));
+  Proposed.DefType       = (Snap->DefType & ~(UINT64)IA32_MTRR_DEF_TYPE_TYPE_MASK) | IA32_MTRR_DEF_TYPE_E_BIT | Sol->DefaultType;
+  Proposed.Variables     = Sol->Pairs;
+  Proposed.VariableCount = Sol->Count;
+  if (EFI_ERROR (MtrrMapBuild (&Proposed, &Result))) return FALSE;
+
+  for (I = 0; I < Desired->Count && Match; I++) {
+    if (Desired->Items[I].Type == MTRR_TYPE_DONT_CARE) continue;
+    Entry = MtrrMapLookup (&Result, Desired->Items[I].First);
+    for (Pos = (Entry == NULL) ? Result.Count : (UINTN)(Entry - Result.Items);
+         Pos < Result.Count && Result.Items[Pos].First <= Desired->Items[I].Last; Pos++) {
+      if (Result.Items[Pos].Type != Desired->Items[I].Type) { Match = FALSE; break; }
+    }
+  }
+  MtrrMapFree (&Result);
+  return Match;
+}
+
+//
+// Entry rendezvous, all or nothing: Arrived either reaches Expected and every
+// CPU goes ahead, or a CPU whose deadline passed swaps it to
+// MTRR_RENDEZVOUS_ABORT and every CPU (including late ones) backs out. Both
+// moves are compare-exchanges on the same word, so they cannot both win.
+//
+STATIC BOOLEAN MtrrApplyEnter (IN OUT MTRR_APPLY_JOB *Job) {
+  UINT64 Deadline = AsmReadTsc () + Job->TimeoutTicks;
+  UINT32 Seen;
+
+  do {
+    Seen = Job->Arrived;
+    if (Seen == MTRR_RENDEZVOUS_ABORT) return FALSE;
+  } while (InterlockedCompareExchange32 (&Job->Arrived, Seen, Seen + 1) != Seen);
+
+  while (TRUE) {
+    Seen = Job->Arrived;
+    if (Seen == Job->Expected) return TRUE;
+    if (Seen == MTRR_RENDEZVOUS_ABORT) return FALSE;
+    if (AsmReadTsc () >= Deadline &&
+        InterlockedCompareExchange32 (&Job->Arrived, Seen, MTRR_RENDEZVOUS_ABORT) == Seen) {
+      Job->Abort = TRUE;
+      return FALSE;
+    }
+    CpuPause ();
+  }
+}
+
+//
+// Exit rendezvous. Every CPU is known to be inside the sequence by now and the
+// MTRRs are already rewritten, so there is nothing left to abort; the deadline
+// only keeps a CPU stalled by an SMI from holding the others with interrupts off.
+//
+STATIC VOID MtrrApplyLeave (IN OUT MTRR_APPLY_JOB *Job) {
+  UINT64 Deadline = AsmReadTsc () + Job->TimeoutTicks;
+
+  InterlockedIncrement (&Job->Left);
+  while (Job->Left < Job->Expected && AsmReadTsc () < Deadline) CpuPause ();
+}
+
+//
+// Runs on every CPU at once and follows the SDM MTRR update sequence: all
+// CPUs meet with interrupts off, then caches off + WBINVD, CR4.PGE cleared
+// (CpuFlushTlb only reloads CR3, global entries would survive it), MTRRs
+// disabled while the pairs are rewritten, WBINVD + TLB flush again, MTRRs
+// enabled, caches on, CR4 restored, and a second meeting so no CPU resumes
+// normal work while another still runs with different MTRRs. Nothing is
+// written unless every CPU made it to the first meeting.
+//
+STATIC VOID EFIAPI MtrrApplyProc (IN OUT VOID *Buffer) {
+  MTRR_APPLY_JOB *Job = (MTRR_APPLY_JOB *)Buffer;
+  BOOLEAN        IntState;
+  UINTN          I, Cr4, Failed = 0;
+
+  IntState = SaveAndDisableInterrupts ();
+  if (!MtrrApplyEnter (Job)) {
+    SetInterruptState (IntState);
+    InterlockedIncrement (&Job->Finished);
+    return;
+  }
+  AsmDisableCache ();
+  Cr4 = AsmReadCr4 ();
+  if ((Cr4 & CR4_PGE_BIT) != 0) AsmWriteCr4 (Cr4 & ~(UINTN)CR4_PGE_BIT);
+  CpuFlushTlb ();
+  if (!SafeWriteMsr (MSR_IA32_MTRR_DEF_TYPE, Job->DefType & ~(UINT64)IA32_MTRR_DEF_TYPE_E_BIT)) Failed++;
+  for (I = 0; I < Job->VariableCount; I++) {
+    if (!SafeWriteMsr (MSR_IA32_MTRR_PHYSBASE0 + (UINT32)(I * 2), Job->Pairs[I].Base)) Failed++;
+    if (!SafeWriteMsr (MSR_IA32_MTRR_PHYSMASK0 + (UINT32)(I * 2), Job->Pairs[I].Mask)) Failed++;
+  }
+  AsmWbinvd ();
+  CpuFlushTlb ();
+  if (!SafeWriteMsr (MSR_IA32_MTRR_DEF_TYPE, Job->DefType)) Failed++;
+  AsmEnableCache ();
+  AsmWriteCr4 (Cr4);
+  MtrrApplyLeave (Job);
+  SetInterruptState (IntState);
+  if (Failed != 0) InterlockedIncrement (&Job->FailedCpus);
+  InterlockedIncrement (&Job->Finished);
+}
+
+//
+// Writes DEF_TYPE and all VariableCount pairs on every CPU. The APs are
+// started non-blocking so the BSP joins the same rendezvous instead of
+// reprogramming after them. Returns EFI_ABORTED, with every CPU's MTRRs
+// untouched, when not all CPUs reached the rendezvous in time. Also used to
+// put a snapshot back after a temporary change.
+//
+// The job (with its own copy of Pairs) is pool-allocated: if an AP never
+// reports back it may still read the job later, so it is leaked, like an
+// orphaned PERCPU_MSR_JOB, rather than freed under it.
+//
+STATIC EFI_STATUS MtrrVariablesApply (IN UINT64 DefType, IN CONST MTRR_VARIABLE_PAIR *Pairs, IN UINTN VariableCount, OUT UINT32 *FailedCpus) {
+  MTRR_APPLY_JOB *Job;
+  EFI_STATUS     Status = EFI_NOT_STARTED;
+  EFI_EVENT      Done   = NULL;
+  UINTN          NumCpus, NumEnabled;
+  UINT64         Deadline;
+  BOOLEAN        Aborted;
+
+  *FailedCpus = 0;
+  Job = AllocateZeroPool (sizeof (*Job) + VariableCount * sizeof (MTRR_VARIABLE_PAIR));
+  if (Job == NULL) return EFI_OUT_OF_RESOURCES;
+  CopyMem (Job + 1, Pairs, VariableCount * sizeof (MTRR_VARIABLE_PAIR));
+  Job->DefType       = DefType;
+  Job->Pairs         = (CONST MTRR_VARIABLE_PAIR *)(Job + 1);
+  Job->VariableCount = VariableCount;
+  Job->Expected      = 1;
+  Job->TimeoutTicks  = DivU64x32 (MultU64x32 (BenchTscHz (), MTRR_RENDEZVOUS_MS), 1000);
+
+  // All CPUs must end up with identical MTRRs
+  if (mMp != NULL && !EFI_ERROR (mMp->GetNumberOfProcessors (mMp, &NumCpus, &NumEnabled)) && NumEnabled > 1 &&
+      !EFI_ERROR (PerCpuCreateDoneEvent (&Done))) {
+    Job->Expected = (UINT32)NumEnabled;
+    Status = mMp->StartupAllAPs (mMp, MtrrApplyProc, FALSE, Done, 0, Job, NULL);
+    if (EFI_ERROR (Status)) Job->Expected = 1;
+  }
+  MtrrApplyProc (Job);
+
+  if (!EFI_ERROR (Status)) {
+    //
+    // The BSP is past both rendezvous, so every AP that runs at all finishes
+    // within one more rendezvous timeout.
+    //
+    Deadline = AsmReadTsc () + Job->TimeoutTicks;
+    while (Job->Finished < Job->Expected && AsmReadTsc () < Deadline) CpuPause ();
+    if (Job->Finished < Job->Expected) {
+      *FailedCpus = Job->Expected - Job->Finished;
+      return Job->Abort ? EFI_ABORTED : EFI_TIMEOUT;          // Job and Done leaked on purpose
+    }
+    Status = PerCpuWaitDone (Done);
+  } else if (Done != NULL) {
+    gBS->CloseEvent (Done);
+  }
+  *FailedCpus = Job->FailedCpus;
+  Aborted     = Job->Abort;
+  FreePool (Job);                                               // every CPU has finished with it
+  if (Aborted) return EFI_ABORTED;
+  return (Status == EFI_NOT_STARTED) ? EFI_SUCCESS : Status;
+}
+
+STATIC EFI_STATUS MtrrSolutionApply (IN CONST MTRR_SNAPSHOT *Snap, IN CONST MTRR_SOLUTION *Sol, OUT UINT32 *FailedCpus) {
+  MTRR_VARIABLE_PAIR *Pairs;
+  EFI_STATUS         Status;
+
+  Pairs = AllocateZeroPool (Snap->VariableCount * sizeof (MTRR_VARIABLE_PAIR));
+  if (Pairs == NULL) return EFI_OUT_OF_RESOURCES;
+  CopyMem (Pairs, Sol->Pairs, Sol->Count * sizeof (MTRR_VARIABLE_PAIR));
+
+  Status = MtrrVariablesApply ((Snap->DefType & ~(UINT64)IA32_MTRR_DEF_TYPE_TYPE_MASK) | IA32_MTRR_DEF_TYPE_E_BIT | Sol->DefaultType,
+                               Pairs, Snap->VariableCount, FailedCpus);
+  FreePool (Pairs);
+  return Status;
+}
+
+STATIC BOOLEAN MtrrParseTypeKey (IN CHAR16 Ch, OUT UINT8 *Type) {
+  switch (Ch) {
+    case L'0': *Type = MTRR_TYPE_UC; return TRUE;
+    case L'1': *Type = MTRR_TYPE_WC; return TRUE;
+    case L'4': *Type = MTRR_TYPE_WT; return TRUE;
+    case L'5': *Type = MTRR_TYPE_WP; return TRUE;
+    case L'6': *Type = MTRR_TYPE_WB; return TRUE;
+    default:   return FALSE;
+  }
+}
+
+STATIC VOID DoMtrrPlanner (VOID) {
+  MTRR_SNAPSHOT   Snap;
+  MTRR_MEMORY_MAP Desired;
+  MTRR_SOLUTION   Sol;
+  UINT64          Base, Size, AddrMask;
+  UINTN           I, LineCount = 0;
+  UINT32          FailedCpus;
+  UINT8           Type;
+  CHAR16          SizeStr[16];
+  EFI_INPUT_KEY   Key;
+  EFI_STATUS      Status;
+  BOOLEAN         Verified;
+  ShowHeaderAndMenu (MenuMtrrPlanner);
+
+  if (!CpuSupportsMsr () || !CpuSupportsMtrr ()) {
+    Print (L"[ERROR] CPU does not support MSR/MTRR.\n"); WaitAnyKey (); return;
+  }
+  if (EFI_ERROR (MtrrSnapshotRead (&Snap))) {
+    Print (L"[ERROR] Failed to read MTRR registers.\n"); WaitAnyKey (); return;
+  }
+  if (EFI_ERROR (MtrrDesiredFromSnapshot (&Snap, &Desired))) {
+    MtrrSnapshotFree (&Snap);
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); return;
+  }
+  AddrMask = MtrrPhysAddrMask (&Snap);
+
+  // What-if edits on top of the current effective map
+  Print (L"Current layout is the starting point. Add overrides (4KB aligned), empty Base to solve.\n");
+  Print (L"Types: 0=UC 1=WC 4=WT 5=WP 6=WB\n");
+  while (PromptHexUint64 (L"Override Base (Hex): ", &Base)) {
+    if (!PromptHexUint64 (L"Override Size (Hex): ", &Size) || Size == 0 || ((Base | Size) & 0xFFF) != 0 ||
+        Base > AddrMask || Size - 1 > AddrMask - Base) {
+      Print (L"  Invalid range.\n");
+      continue;
+    }
+    Print (L"Type key: ");
+    if (!ReadKeyBlocking (&Key)) continue;
+    Print (L"%c\n", (Key.UnicodeChar == 0) ? L'?' : Key.UnicodeChar);
+    if (!MtrrParseTypeKey (Key.UnicodeChar, &Type)) {
+      Print (L"  Invalid type.\n");
+      continue;
+    }
+    if (EFI_ERROR (MtrrMapOverride (&Desired, Base, Base + Size - 1, Type))) {
+      Print (L"  Out of resources.\n");
+      break;
+    }
+  }
+
+  ClearScreenAndResetAttr ();
+  Print (L"=== [ Desired Layout ] ===\n");
+  LineCount = 1;
+  if (PrintMtrrMap (&Desired, &LineCount)) goto Exit;
+
+  Status = MtrrSolve (&Desired, Snap.PhysAddrBits, &Sol);
+  if (Status == EFI_INVALID_PARAMETER) {
+    Print (L"\n[ERROR] Desired layout contains undefined overlaps; override them first.\n"); WaitAnyKey (); goto Exit;
+  }
+  if (EFI_ERROR (Status)) {
+    Print (L"\n[ERROR] Out of resources.\n"); WaitAnyKey (); goto Exit;
+  }
+  Verified = MtrrSolutionVerify (&Snap, &Sol, &Desired);
+
+  Print (L"\n=== [ Proposed Variable MTRRs ] ===  Default=%s  %d register(s), VCNT=%d  %s\n",
+         MtrrTypeToShortStr (Sol.DefaultType), (UINT32)Sol.Count, (UINT32)Snap.VariableCount,
+         Verified ? L"(verified)" : L"(VERIFY FAILED)");
+  if (PageLineAccountingEx (&LineCount, NULL, 0)) goto ExitSol;
+  if (PageLineAccountingEx (&LineCount, NULL, 0)) goto ExitSol;
+  for (I = 0; I < Sol.Count; I++) {
+    FormatByteSize ((~(Sol.Pairs[I].Mask & ~(UINT64)0xFFF) & AddrMask) + 1, SizeStr, ARRAY_SIZE (SizeStr));
+    Print (L"  [%02d] PHYSBASE %016lx  PHYSMASK %016lx  %s %s\n", (UINT32)I, Sol.Pairs[I].Base, Sol.Pairs[I].Mask,
+           MtrrTypeToShortStr ((UINT8)(Sol.Pairs[I].Base & 0xFF)), SizeStr);
+    if (PageLineAccountingEx (&LineCount, NULL, 0)) goto ExitSol;
+  }
+
+  if (Sol.Count > Snap.VariableCount) {
+    Print (L"\nDoes not fit: %d register(s) needed, %d available.\n", (UINT32)Sol.Count, (UINT32)Snap.VariableCount);
+    WaitAnyKey ();
+    goto ExitSol;
+  }
+  if (!Verified) {
+    WaitAnyKey ();
+    goto ExitSol;
+  }
+
+  Print (L"\nApply to all CPUs now? Firmware-owned settings are overwritten until reset. (Y/N): ");
+  if (!ReadKeyBlocking (&Key)) goto ExitSol;
+  Print (L"%c\n", (Key.UnicodeChar == 0) ? L'?' : Key.UnicodeChar);
+  if (Key.UnicodeChar != L'Y' && Key.UnicodeChar != L'y') {
+    Print (L"Canceled.\n"); WaitAnyKey (); goto ExitSol;
+  }
+  Status = MtrrSolutionApply (&Snap, &Sol, &FailedCpus);
+  if (Status == EFI_ABORTED) {
+    Print (L"[ERROR] Not every CPU reached the rendezvous in time; no MTRR was changed.\n");
+  } else if (EFI_ERROR (Status)) {
+    Print (L"[WARN] Applying returned %r, APs may not be updated.\n", Status);
+  } else if (FailedCpus != 0) {
+    Print (L"[ERROR] MSR write faulted on %d CPU(s).\n", FailedCpus);
+  } else {
+    Print (L"Applied.\n");
+  }
+  WaitAnyKey ();
+
+ExitSol:
+  MtrrSolutionFree (&Sol);
+Exit:
+  MtrrMapFree (&Desired);
+  MtrrSnapshotFree (&Snap);
+}
+
+//
+// =====================================================
+// PAT Decode / Effective Memory Type
+// =====================================================
+//
+STATIC CONST CHAR16 *PatTypeToStr (IN UINT8 Type) {
+  return (Type == PAT_TYPE_UC_MINUS) ? L"Uncached (UC-)" : MtrrTypeToStr (Type);
+}
+
+STATIC UINT64 PageWalkAddrMask (VOID) {
+  return (LShiftU64 (1, GetPhysicalAddressBits ()) - 1) & ~(UINT64)0xFFF;
+}
+
+#define PAGE_ENTRY_IS_LEAF(Entry, Level)  ((Level) == 1 || (((Level) == 2 || (Level) == 3) && ((Entry) & PTE_PS) != 0))
+
+STATIC UINT8 PageEntryPatIndex (IN UINT64 Entry, IN UINTN Level) {
+  return (UINT8)(((Entry & PTE_PWT) ? 1 : 0) | ((Entry & PTE_PCD) ? 2 : 0) |
+                 ((Entry & ((Level == 1) ? PTE_PAT_4K : PTE_PAT_LARGE)) ? 4 : 0));
+}
+
+//
+// Walks the active 4- or 5-level tables from CR3. Table entries are read
+// through ProbeMemRead64, relying on the UEFI identity map; a table outside
+// it sets Faulted instead of crashing.
+//
+STATIC BOOLEAN PageWalkTranslate (IN UINT64 Linear, OUT PAGE_WALK_RESULT *Result) {
+  UINT64 Cr3, Cr4, Table, Entry, AddrMask, PageMask;
+  UINTN  Level, Shift;
+
+  ZeroMem (Result, sizeof (*Result));
+  if (ProbeReadCr (3, &Cr3) != PROBE_OK || ProbeReadCr (4, &Cr4) != PROBE_OK) return FALSE;
+
+  AddrMask = PageWalkAddrMask ();
+  Table    = Cr3 & AddrMask;
+  for (Level = ((Cr4 & CR4_LA57_BIT) != 0) ? 5 : 4; Level >= 1; Level--) {
+    Shift = 12 + 9 * (Level - 1);
+    if (ProbeMemRead64 ((UINTN)(Table + (RShiftU64 (Linear, Shift) & 0x1FF) * sizeof (UINT64)), &Entry) != PROBE_OK) {
+      Result->Faulted = TRUE;
+      return FALSE;
+    }
+    if ((Entry & PTE_PRESENT) == 0) return FALSE;
+
+    if (PAGE_ENTRY_IS_LEAF (Entry, Level)) {
+      PageMask          = LShiftU64 (1, Shift) - 1;
+      Result->Present   = TRUE;
+      Result->Level     = (UINT8)Level;
+      Result->Entry     = Entry;
+      Result->PageSize  = PageMask + 1;
+      Result->Physical  = (Entry & AddrMask & ~PageMask) | (Linear & PageMask);
+      Result->PatIndex  = PageEntryPatIndex (Entry, Level);
+      return TRUE;
+    }
+    Table = Entry & AddrMask;
+  }
+  return FALSE;
+}
+
+//
+// SDM "Effective Page-Level Memory Types" (Table 11-7), indexed by the MTRR
+// type and PAT type encodings. Reserved encodings on either side resolve to
+// MTRR_TYPE_UNDEFINED.
+//
+STATIC CONST UINT8 mPatMtrrEffective[MTRR_TYPE_WB + 1][PAT_ENTRY_COUNT] = {
+  //  UC                   WC                   (2)                  (3)                  WT                   WP                   WB                   UC-
+  { MTRR_TYPE_UC,        MTRR_TYPE_WC,        MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UC,        MTRR_TYPE_UC,        MTRR_TYPE_UC,        MTRR_TYPE_UC },  // MTRR UC
+  { MTRR_TYPE_UC,        MTRR_TYPE_WC,        MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UC,        MTRR_TYPE_UC,        MTRR_TYPE_WC,        MTRR_TYPE_WC },  // MTRR WC
+  { MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED },  // MTRR 2 (reserved)
+  { MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED },  // MTRR 3 (reserved)
+  { MTRR_TYPE_UC,        MTRR_TYPE_WC,        MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_WT,        MTRR_TYPE_WP,        MTRR_TYPE_WT,        MTRR_TYPE_UC },  // MTRR WT
+  { MTRR_TYPE_UC,        MTRR_TYPE_WC,        MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_WP,        MTRR_TYPE_WP,        MTRR_TYPE_WP,        MTRR_TYPE_UC },  // MTRR WP
+  { MTRR_TYPE_UC,        MTRR_TYPE_WC,        MTRR_TYPE_UNDEFINED, MTRR_TYPE_UNDEFINED, MTRR_TYPE_WT,        MTRR_TYPE_WP,        MTRR_TYPE_WB,        MTRR_TYPE_UC }   // MTRR WB
+};
+
+STATIC UINT8 PatMtrrCombine (IN UINT8 MtrrType, IN UINT8 PatType) {
+  if (MtrrType > MTRR_TYPE_WB || PatType >= PAT_ENTRY_COUNT) return MTRR_TYPE_UNDEFINED;
+  return mPatMtrrEffective[MtrrType][PatType];
+}
+
+STATIC VOID PrintPatEntries (IN UINT64 Pat) {
+  UINTN I;
+  UINT8 Type;
+
+  Print (L"IA32_PAT (0x277)  : %016lx\n", Pat);
+  Print (L"Entry  PAT PCD PWT  Type\n");
+  Print (L"------------------------------------\n");
+  for (I = 0; I < PAT_ENTRY_COUNT; I++) {
+    Type = (UINT8)(RShiftU64 (Pat, I * 8) & 0x7);
+    Print (L"PA%d     %d   %d   %d   %s\n", (UINT32)I, (UINT32)((I >> 2) & 1), (UINT32)((I >> 1) & 1), (UINT32)(I & 1), PatTypeToStr (Type));
+  }
+}
+
+STATIC VOID DoPatResolve (VOID) {
+  MTRR_SNAPSHOT        Snap;
+  MTRR_MEMORY_MAP      Map;
+  CONST MTRR_MAP_ENTRY *MtrrEntry;
+  PAGE_WALK_RESULT     Walk;
+  UINT64               Pat, Cr0 = 0, Cr4 = 0, Linear;
+  UINT8                PatType, MtrrType, Effective;
+  CHAR16               SizeStr[16];
+  ShowHeaderAndMenu (MenuPatResolve);
+
+  if (!CpuSupportsMsr () || !CPU_HAS (CpuFeatPat)) {
+    Print (L"[ERROR] CPU does not support PAT.\n"); WaitAnyKey (); return;
+  }
+  if (!SafeReadMsr (MSR_IA32_PAT, &Pat)) {
+    Print (L"[ERROR] #GP reading IA32_PAT.\n"); WaitAnyKey (); return;
+  }
+  PrintPatEntries (Pat);
+
+  ProbeReadCr (0, &Cr0);
+  ProbeReadCr (4, &Cr4);
+  Print (L"\nCR0.CD=%d CR0.NW=%d  Paging levels=%d\n", (Cr0 & CR0_CD_BIT) ? 1 : 0, (Cr0 & CR0_NW_BIT) ? 1 : 0,
+         (Cr4 & CR4_LA57_BIT) ? 5 : 4);
+
+  ZeroMem (&Map, sizeof (Map));
+  if (!CpuSupportsMtrr () || EFI_ERROR (MtrrSnapshotRead (&Snap))) {
+    Print (L"[WARN] MTRRs unavailable, resolving against PAT only.\n");
+  } else {
+    if (EFI_ERROR (MtrrMapBuild (&Snap, &Map))) ZeroMem (&Map, sizeof (Map));
+    MtrrSnapshotFree (&Snap);
+  }
+
+  Print (L"\n");
+  while (PromptHexUint64 (L"Linear address (Hex, empty to exit): ", &Linear)) {
+    if (!PageWalkTranslate (Linear, &Walk)) {
+      Print (L"  %s\n", Walk.Faulted ? L"Page tables not readable (outside identity map)." : L"Not mapped.");
+      continue;
+    }
+    PatType   = (UINT8)(RShiftU64 (Pat, Walk.PatIndex * 8) & 0x7);
+    MtrrEntry = (Map.Count != 0) ? MtrrMapLookup (&Map, Walk.Physical) : NULL;
+    MtrrType  = (MtrrEntry != NULL) ? MtrrEntry->Type : MTRR_TYPE_WB;   // no MTRRs: PAT alone decides
+    Effective = ((Cr0 & CR0_CD_BIT) != 0) ? MTRR_TYPE_UC : PatMtrrCombine (MtrrType, PatType);
+
+    FormatByteSize (Walk.PageSize, SizeStr, ARRAY_SIZE (SizeStr));
+    Print (L"  Physical  : %016lx  (%s page, entry %016lx)\n", Walk.Physical, SizeStr, Walk.Entry);
+    Print (L"  PAT index : PA%d  -> %s\n", (UINT32)Walk.PatIndex, PatTypeToStr (PatType));
+    Print (L"  MTRR type : %s\n", (MtrrEntry != NULL) ? MtrrTypeToStr (MtrrType) : L"(n/a)");
+    SetAttrHighlight ();
+    Print (L"  Effective : %s%s\n", MtrrTypeToStr (Effective), ((Cr0 & CR0_CD_BIT) != 0) ? L"  (CR0.CD set)" : L"");
+    SetAttrNormal ();
+  }
+  MtrrMapFree (&Map);
+}
+
+//
+// =====================================================
+// Page Table Walk Statistics
+// =====================================================
+//
+STATIC VOID PageWalkContextFree (IN OUT PAGE_WALK_CONTEXT *Ctx) {
+  if (Ctx->Runs != NULL) FreePool (Ctx->Runs);
+  Ctx->Runs        = NULL;
+  Ctx->RunCount    = 0;
+  Ctx->RunCapacity = 0;
+}
+
+STATIC VOID PageWalkRecordLeaf (
+  IN OUT PAGE_WALK_CONTEXT *Ctx,
+  IN     UINT64            Linear,
+  IN     UINT64            Entry,
+  IN     UINTN             Level,
+  IN     BOOLEAN           Writable,
+  IN     BOOLEAN           NoExec,
+  IN     BOOLEAN           User
+  )
+{
+  CONST MTRR_MAP_ENTRY *MtrrEntry = NULL;
+  PAGE_RUN             *Run, *NewRuns;
+  UINT64               Size, Physical;
+  UINTN                NewCapacity;
+  UINT8                PatType, MtrrType = MTRR_TYPE_WB, EffType;
+
+  Size     = LShiftU64 (1, 12 + 9 * (Level - 1));
+  Physical = Entry & Ctx->AddrMask & ~(Size - 1);
+  PatType  = (UINT8)(RShiftU64 (Ctx->Pat, PageEntryPatIndex (Entry, Level) * 8) & 0x7);
+  if (Ctx->Mtrr->Count != 0) {
+    MtrrEntry = MtrrMapLookup (Ctx->Mtrr, Physical);
+    if (MtrrEntry != NULL) {
+      MtrrType = MtrrEntry->Type;
+      if (MtrrEntry->Last < Physical + Size - 1) Ctx->MtrrSplitPages++;
+    }
+  }
+  EffType = Ctx->CacheDisabled ? MTRR_TYPE_UC : PatMtrrCombine (MtrrType, PatType);
+
+  Ctx->PageCount[Level - 1]++;
+  Ctx->BytesByType[MtrrAuditSlot (EffType)] += Size;
+  if (Writable) Ctx->WritableBytes += Size;
+  if (NoExec)   Ctx->NoExecBytes   += Size;
+
+  if (Ctx->RunCount > 0) {
+    Run = &Ctx->Runs[Ctx->RunCount - 1];
+    if (Run->LastLinear + 1 == Linear && Run->PageSize == Size && Run->EffType == EffType &&
+        Run->Writable == Writable && Run->NoExec == NoExec && Run->User == User) {
+      Run->LastLinear = Linear + Size - 1;
+      return;
+    }
+  }
+  if (Ctx->RunsTruncated) return;
+  if (Ctx->RunCount == Ctx->RunCapacity) {
+    NewCapacity = MAX (256, Ctx->RunCapacity * 2);
+    NewRuns     = (NewCapacity > PAGE_WALK_MAX_RUNS) ? NULL :
+                  ReallocatePool (Ctx->RunCapacity * sizeof (PAGE_RUN), NewCapacity * sizeof (PAGE_RUN), Ctx->Runs);
+    if (NewRuns == NULL) {
+      Ctx->RunsTruncated = TRUE;
+      return;
+    }
+    Ctx->Runs        = NewRuns;
+    Ctx->RunCapacity = NewCapacity;
+  }
+  Run              = &Ctx->Runs[Ctx->RunCount++];
+  Run->FirstLinear = Linear;
+  Run->LastLinear  = Linear + Size - 1;
+  Run->PageSize    = Size;
+  Run->EffType     = EffType;
+  Run->Writable    = Writable;
+  Run->NoExec      = NoExec;
+  Run->User        = User;
+}
+
+//
+// Depth-first walk of one table. RW/US are effective only if set at every
+// level, NX if set at any level. Entries are read with ProbeMemRead64 so a
+// table outside the identity map is counted as faulted and skipped.
+//
+STATIC VOID PageWalkTable (
+  IN OUT PAGE_WALK_CONTEXT *Ctx,
+  IN     UINT64            Table,
+  IN     UINTN             Level,
+  IN     UINT64            LinearBase,
+  IN     BOOLEAN           Writable,
+  IN     BOOLEAN           NoExec,
+  IN     BOOLEAN           User
+  )
+{
+  UINT64  Entry, Linear;
+  UINTN   Index, Shift;
+  BOOLEAN W, X, U;
+
+  Ctx->Tables++;
+  Shift = 12 + 9 * (Level - 1);
+  for (Index = 0; Index < PAGE_TABLE_ENTRIES; Index++) {
+    if (ProbeMemRead64 ((UINTN)(Table + Index * sizeof (UINT64)), &Entry) != PROBE_OK) {
+      Ctx->FaultedTables++;
+      return;
+    }
+    if ((Entry & PTE_PRESENT) == 0) continue;
+
+    Linear = LinearBase + LShiftU64 (Index, Shift);
+    if (Level == Ctx->Levels && Index >= PAGE_TABLE_ENTRIES / 2) {
+      Linear |= ~(LShiftU64 (1, Shift + 9) - 1);   // canonical upper half
+    }
+    W = (BOOLEAN)(Writable && (Entry & PTE_RW) != 0);
+    X = (BOOLEAN)(NoExec || (Entry & PTE_NX) != 0);
+    U = (BOOLEAN)(User && (Entry & PTE_US) != 0);
+
+    if (PAGE_ENTRY_IS_LEAF (Entry, Level)) {
+      PageWalkRecordLeaf (Ctx, Linear, Entry, Level, W, X, U);
+    } else {
+      PageWalkTable (Ctx, Entry & Ctx->AddrMask, Level - 1, Linear, W, X, U);
+    }
+  }
+}
+
+STATIC VOID PrintPageRunHeader (VOID) {
+  Print (L"Linear First       Linear Last        Size        Page  Type  RW NX US\n");
+  Print (L"----------------------------------------------------------------------\n");
+}
+
+STATIC VOID DoPageWalk (VOID) {
+  PAGE_WALK_CONTEXT Ctx;
+  MTRR_SNAPSHOT     Snap;
+  MTRR_MEMORY_MAP   Map;
+  UINT64            Cr0 = 0, Cr3 = 0, Cr4 = 0;
+  UINTN             I, LineCount;
+  PAGE_RUN          *Run;
+  CHAR16            SizeStr[16];
+  STATIC CONST UINT8   SlotTypes[] = { MTRR_TYPE_WB, MTRR_TYPE_WT, MTRR_TYPE_WP, MTRR_TYPE_WC, MTRR_TYPE_UC, MTRR_TYPE_UNDEFINED };
+  STATIC CONST CHAR16 *PageSizeStr[] = { L"4K", L"2M", L"1G" };
+  ShowHeaderAndMenu (MenuPageWalk);
+
+  if (ProbeReadCr (0, &Cr0) != PROBE_OK || ProbeReadCr (3, &Cr3) != PROBE_OK || ProbeReadCr (4, &Cr4) != PROBE_OK) {
+    Print (L"[ERROR] Cannot read control registers.\n"); WaitAnyKey (); return;
+  }
+
+  ZeroMem (&Ctx, sizeof (Ctx));
+  ZeroMem (&Map, sizeof (Map));
+  if (CpuSupportsMsr () && CPU_HAS (CpuFeatPat)) SafeReadMsr (MSR_IA32_PAT, &Ctx.Pat);
+  else Ctx.Pat = 0x0007040600070406ull;                 // architectural reset value
+  if (CpuSupportsMsr () && CpuSupportsMtrr () && !EFI_ERROR (MtrrSnapshotRead (&Snap))) {
+    if (EFI_ERROR (MtrrMapBuild (&Snap, &Map))) ZeroMem (&Map, sizeof (Map));
+    MtrrSnapshotFree (&Snap);
+  }
+  Ctx.Mtrr          = &Map;
+  Ctx.CacheDisabled = (BOOLEAN)((Cr0 & CR0_CD_BIT) != 0);
+  Ctx.AddrMask      = PageWalkAddrMask ();
+  Ctx.Levels        = ((Cr4 & CR4_LA57_BIT) != 0) ? 5 : 4;
+
+  Print (L"Walking %d-level tables from CR3=%016lx ...\n", (UINT32)Ctx.Levels, Cr3);
+  PageWalkTable (&Ctx, Cr3 & Ctx.AddrMask, Ctx.Levels, 0, TRUE, FALSE, TRUE);
+
+  ClearScreenAndResetAttr ();
+  Print (L"=== [ Page Table Summary ] ===  %d-level, %d table(s), %d unreadable\n",
+         (UINT32)Ctx.Levels, (UINT32)Ctx.Tables, (UINT32)Ctx.FaultedTables);
+  for (I = 0; I < 3; I++) {
+    FormatByteSize (LShiftU64 (Ctx.PageCount[I], 12 + 9 * I), SizeStr, ARRAY_SIZE (SizeStr));
+    Print (L"%s pages : %-10ld (%s)\n", PageSizeStr[I], Ctx.PageCount[I], SizeStr);
+  }
+  if (Ctx.PageCount[0] > 0 && Ctx.PageCount[1] + Ctx.PageCount[2] == 0) {
+    SetAttrHighlight ();
+    Print (L"[WARN] Everything is mapped with 4K pages.\n");
+    SetAttrNormal ();
+  }
+  Print (L"Effective type :");
+  for (I = 0; I < ARRAY_SIZE (SlotTypes); I++) {
+    FormatByteSize (Ctx.BytesByType[MtrrAuditSlot (SlotTypes[I])], SizeStr, ARRAY_SIZE (SizeStr));
+    Print (L" %s=%s", (SlotTypes[I] == MTRR_TYPE_UNDEFINED) ? L"Other" : MtrrTypeToShortStr (SlotTypes[I]), SizeStr);
+  }
+  FormatByteSize (Ctx.WritableBytes, SizeStr, ARRAY_SIZE (SizeStr));
+  Print (L"\nWritable %s, ", SizeStr);
+  FormatByteSize (Ctx.NoExecBytes, SizeStr, ARRAY_SIZE (SizeStr));
+  Print (L"NX %s, large pages split by MTRRs: %d\n", SizeStr, (UINT32)Ctx.MtrrSplitPages);
+  Print (L"Runs : %d%s\n\n", (UINT32)Ctx.RunCount, Ctx.RunsTruncated ? L" (list truncated)" : L"");
+  LineCount = 10;
+
+  PrintPageRunHeader ();
+  LineCount += 2;
+  for (I = 0; I < Ctx.RunCount; I++) {
+    Run = &Ctx.Runs[I];
+    FormatByteSize (Run->LastLinear - Run->FirstLinear + 1, SizeStr, ARRAY_SIZE (SizeStr));
+    Print (L"%016lx  %016lx  %-10s  %s    %-4s  %c  %c  %c\n", Run->FirstLinear, Run->LastLinear, SizeStr,
+           PageSizeStr[(Run->PageSize == SIZE_4KB) ? 0 : (Run->PageSize == SIZE_2MB) ? 1 : 2],
+           MtrrTypeToShortStr (Run->EffType), Run->Writable ? L'W' : L'-', Run->NoExec ? L'X' : L'-', Run->User ? L'U' : L'-');
+    if (PageLineAccountingEx (&LineCount, PrintPageRunHeader, 2)) break;
+  }
+  if (I == Ctx.RunCount) WaitAnyKey ();
+
+  PageWalkContextFree (&Ctx);
+  MtrrMapFree (&Map);
+}
+
+//
+// =====================================================
+// Memory Throughput Benchmark
+// =====================================================
+//
+// One buffer is retyped in turn to each of mMemBenchTypes: the planner's
+// solver lays out "current map + buffer override" in the variable MTRRs,
+// the layout goes to every CPU, and the firmware registers are put back at
+// the end. Caches are written back before each pass.
+//
+STATIC CONST UINT8 mMemBenchTypes[MEM_BENCH_TYPE_COUNT] = { MTRR_TYPE_WB, MTRR_TYPE_WT, MTRR_TYPE_WC, MTRR_TYPE_UC };
+
+//
+// Links Lines blocks of Stride bytes into one random cycle and returns its
+// head. Order is Lines UINT32 of scratch.
+//
+STATIC VOID *MemBenchBuildChain (IN UINT8 *Buffer, IN UINTN Lines, IN UINTN Stride, IN OUT UINT32 *Order) {
+  UINT64 Seed = AsmReadTsc () | 1;
+  UINTN  I, J;
+  UINT32 Temp;
+
+  for (I = 0; I < Lines; I++) Order[I] = (UINT32)I;
+  for (I = Lines - 1; I > 0; I--) {
+    Seed ^= Seed << 13;                          // xorshift64
+    Seed ^= Seed >> 7;
+    Seed ^= Seed << 17;
+    J        = (UINTN)ModU64x32 (Seed, (UINT32)(I + 1));
+    Temp     = Order[I];
+    Order[I] = Order[J];
+    Order[J] = Temp;
+  }
+  for (I = 0; I < Lines; I++) {
+    *(VOID **)(Buffer + Order[I] * Stride) = Buffer + Order[(I + 1) % Lines] * Stride;
+  }
+  return Buffer + Order[0] * Stride;
+}
+
+STATIC UINT64 MemBenchMBs (IN UINT64 Bytes, IN UINT64 Ticks, IN UINT64 TscHz) {
+  if (Ticks == 0) return 0;
+  return RShiftU64 (DivU64x64Remainder (MultU64x64 (Bytes, TscHz), Ticks, NULL), 20);
+}
+
+//
+// Latency first (it needs the chain intact), then read, write and a
+// non-temporal copy of the lower half onto the upper half.
+//
+STATIC VOID MemBenchMeasure (IN UINT8 *Buffer, IN UINTN Size, IN OUT UINT32 *Order, IN UINT64 TscHz, IN OUT MEM_BENCH_ROW *Row) {
+  UINTN   Lines = Size / MEM_BENCH_LINE;
+  UINT64  T0, Ticks;
+  VOID    *Head;
+  BOOLEAN IntState;
+
+  Head     = MemBenchBuildChain (Buffer, Lines, MEM_BENCH_LINE, Order);
+  IntState = SaveAndDisableInterrupts ();
+
+  AsmWbinvd ();
+  AsmLfence ();
+  T0 = AsmReadTsc ();
+  MemBenchChase (Head, Lines);
+  AsmLfence ();
+  Ticks          = AsmReadTsc () - T0;
+  Row->LatencyPs = DivU64x64Remainder (MultU64x32 (DivU64x64Remainder (MultU64x32 (Ticks, 1000), Lines, NULL), 1000000000),
+                                       TscHz, NULL);
+
+  AsmWbinvd ();
+  AsmLfence ();
+  T0 = AsmReadTsc ();
+  MemBenchRead (Buffer, Size);
+  AsmLfence ();
+  Row->ReadMBs = MemBenchMBs (Size, AsmReadTsc () - T0, TscHz);
+
+  AsmWbinvd ();
+  AsmLfence ();
+  T0 = AsmReadTsc ();
+  MemBenchWrite (Buffer, Size, T0);
+  AsmLfence ();
+  Row->WriteMBs = MemBenchMBs (Size, AsmReadTsc () - T0, TscHz);
+
+  AsmWbinvd ();
+  AsmLfence ();
+  T0 = AsmReadTsc ();
+  MemBenchCopyNt (Buffer + Size / 2, Buffer, Size / 2);
+  AsmLfence ();
+  Row->CopyMBs = MemBenchMBs (Size / 2, AsmReadTsc () - T0, TscHz);
+
+  SetInterruptState (IntState);
+}
+
+STATIC VOID DoMemBench (VOID) {
+  MTRR_SNAPSHOT    Snap;
+  MTRR_MEMORY_MAP  Desired;
+  MTRR_SOLUTION    Sol;
+  PAGE_WALK_RESULT Walk;
+  MEM_BENCH_ROW    *Row;
+  UINT64           Size, Base, Pat;
+  UINT32           *Order, FailedCpus;
+  UINT8            *Buffer, PatType = MTRR_TYPE_WB;
+  UINTN            I;
+  CHAR16           SizeStr[16];
+  EFI_STATUS       Status;
+  BOOLEAN          Applied = FALSE, WriteFailed = FALSE;
+  ShowHeaderAndMenu (MenuMemBench);
+
+  if (!CpuSupportsMsr () || !CpuSupportsMtrr ()) {
+    Print (L"[ERROR] CPU does not support MSR/MTRR.\n"); WaitAnyKey (); return;
+  }
+  if (EFI_ERROR (MtrrSnapshotRead (&Snap))) {
+    Print (L"[ERROR] Failed to read MTRR registers.\n"); WaitAnyKey (); return;
+  }
+  if ((Snap.DefType & IA32_MTRR_DEF_TYPE_E_BIT) == 0 || Snap.VariableCount == 0) {
+    MtrrSnapshotFree (&Snap);
+    Print (L"[ERROR] Variable MTRRs are disabled or not implemented.\n"); WaitAnyKey (); return;
+  }
+
+  if (!PromptHexUint64 (L"Buffer size (Hex, power of two, Enter = 0x1000000): ", &Size)) Size = MEM_BENCH_DEFAULT_SIZE;
+  if (Size < MEM_BENCH_MIN_SIZE || Size > MEM_BENCH_MAX_SIZE || (Size & (Size - 1)) != 0) {
+    MtrrSnapshotFree (&Snap);
+    Print (L"Invalid size.\n"); WaitAnyKey (); return;
+  }
+
+  // Naturally aligned so one MTRR can cover it; alignment >= 1MB keeps it
+  // clear of the fixed ranges.
+  Buffer = AllocateAlignedPages (EFI_SIZE_TO_PAGES ((UINTN)Size), (UINTN)Size);
+  Order  = AllocatePool ((UINTN)(Size / MEM_BENCH_LINE) * sizeof (UINT32));
+  if (Buffer == NULL || Order == NULL) {
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); goto Exit;
+  }
+  Base = (UINTN)Buffer;                          // identity mapped
+  if (CPU_HAS (CpuFeatPat) && SafeReadMsr (MSR_IA32_PAT, &Pat) && PageWalkTranslate (Base, &Walk)) {
+    PatType = (UINT8)(RShiftU64 (Pat, Walk.PatIndex * 8) & 0x7);
+  }
+
+  ZeroMem (&mMemBenchReport, sizeof (mMemBenchReport));
+  mMemBenchReport.Base  = Base;
+  mMemBenchReport.Size  = Size;
+  mMemBenchReport.TscHz = BenchTscHz ();
+
+  FormatByteSize (Size, SizeStr, ARRAY_SIZE (SizeStr));
+  Print (L"Buffer %016lx (%s), PAT %s. Each type is programmed on all CPUs;\n", Base, SizeStr, PatTypeToStr (PatType));
+  Print (L"the firmware MTRRs are restored afterwards.\n\n");
+  for (I = 0; I < MEM_BENCH_TYPE_COUNT; I++) {
+    Row            = &mMemBenchReport.Rows[I];
+    Row->Type      = mMemBenchTypes[I];
+    Row->Effective = PatMtrrCombine (Row->Type, PatType);
+    Print (L"  %s ...\n", MtrrTypeToStr (Row->Type));
+
+    if (EFI_ERROR (MtrrDesiredFromSnapshot (&Snap, &Desired))) {
+      Row->Failure = L"out of resources";
+      continue;
+    }
+    Status = MtrrMapOverride (&Desired, Base, Base + Size - 1, Row->Type);
+    if (!EFI_ERROR (Status)) Status = MtrrSolve (&Desired, Snap.PhysAddrBits, &Sol);
+    if (EFI_ERROR (Status)) {
+      Row->Failure = L"no valid layout";
+    } else {
+      if (Sol.Count > Snap.VariableCount || !MtrrSolutionVerify (&Snap, &Sol, &Desired)) {
+        Row->Failure = L"not enough variable MTRRs";
+      } else {
+        Applied = TRUE;
+        Status  = MtrrSolutionApply (&Snap, &Sol, &FailedCpus);
+        if (EFI_ERROR (Status) || FailedCpus != 0) {
+          Row->Failure = L"MTRR write failed";
+          WriteFailed  = TRUE;
+        } else {
+          MemBenchMeasure (Buffer, (UINTN)Size, Order, mMemBenchReport.TscHz, Row);
+        }
+      }
+      MtrrSolutionFree (&Sol);
+    }
+    MtrrMapFree (&Desired);
+    // CPUs may now disagree on their MTRRs: no further layout goes on top of
+    // a partial one, the snapshot is put back right away.
+    if (WriteFailed) break;
+  }
+  for (I++; I < MEM_BENCH_TYPE_COUNT; I++) {
+    Row            = &mMemBenchReport.Rows[I];
+    Row->Type      = mMemBenchTypes[I];
+    Row->Effective = PatMtrrCombine (Row->Type, PatType);
+    Row->Failure   = L"skipped";
+  }
+
+  if (Applied) {
+    Status = MtrrVariablesApply (Snap.DefType, Snap.Variables, Snap.VariableCount, &FailedCpus);
+    if (EFI_ERROR (Status) || FailedCpus != 0) {
+      Print (L"[WARN] Restoring firmware MTRRs failed (%r, %d CPU(s) faulted).\n", Status, FailedCpus);
+    }
+  }
+  mMemBenchReport.Valid = TRUE;
+  PrintMemBenchReport ();
+  Print (L"\nThe table is also shown at the end of Dump MTRR.\n");
+  WaitAnyKey ();
+
+Exit:
+  if (Order != NULL) FreePool (Order);
+  if (Buffer != NULL) FreeAlignedPages (Buffer, EFI_SIZE_TO_PAGES ((UINTN)Size));
+  MtrrSnapshotFree (&Snap);
+}
+
+//
+// =====================================================
+// Cache Hierarchy Probe
+// =====================================================
+//
+// Random pointer chase over working sets from 4KB to 4x the LLC, in
+// 2^n and 1.5 * 2^n steps. A plateau is a run of sizes whose latency stays
+// within CACHE_PROBE_PLATEAU_PCT of the run's first point; single-point
+// runs are the ramps between levels and are dropped. Each data/unified
+// cache from CpuidCacheLeaf is then paired with the plateau whose edge is
+// nearest its size; plateaus no cache claimed are listed on their own.
+//
+STATIC UINT64 CacheProbeMeasure (IN UINT8 *Buffer, IN UINTN Size, IN OUT UINT32 *Order) {
+  UINTN   Lines = Size / MEM_BENCH_LINE, Steps = MAX (Lines, CACHE_PROBE_MIN_STEPS);
+  UINT64  T0, Ticks;
+  VOID    *Head;
+  BOOLEAN IntState;
+
+  Head     = MemBenchBuildChain (Buffer, Lines, MEM_BENCH_LINE, Order);
+  IntState = SaveAndDisableInterrupts ();
+  Head     = MemBenchChase (Head, Lines);        // warm the working set
+  AsmLfence ();
+  T0 = AsmReadTsc ();
+  MemBenchChase (Head, Steps);
+  AsmLfence ();
+  Ticks = AsmReadTsc () - T0;
+  SetInterruptState (IntState);
+  return DivU64x64Remainder (MultU64x32 (Ticks, 100), Steps, NULL);
+}
+
+STATIC UINTN CacheProbeFindPlateaus (IN CONST CACHE_PROBE_POINT *Points, IN UINTN PointCount, OUT CACHE_PLATEAU *Plateaus) {
+  UINTN I, J, Count = 0;
+
+  for (I = 0; I < PointCount; I = J) {
+    for (J = I + 1; J < PointCount && Points[J].CyclesX100 * 100 <= Points[I].CyclesX100 * CACHE_PROBE_PLATEAU_PCT; J++);
+    if (J - I < 2 && J < PointCount) continue;   // ramp; the last point may stand alone as memory
+    Plateaus[Count].FirstSize  = Points[I].Size;
+    Plateaus[Count].LastSize   = Points[J - 1].Size;
+    Plateaus[Count].CyclesX100 = Points[I].CyclesX100;
+    Count++;
+  }
+  return Count;
+}
+
+STATIC UINTN CacheProbeNearestPlateau (IN CONST CACHE_PLATEAU *Plateaus, IN UINTN PlateauCount, IN UINT64 CacheSize) {
+  UINTN  I, Best = 0;
+  UINT64 Distance, BestDistance = MAX_UINT64;
+
+  for (I = 0; I < PlateauCount; I++) {
+    Distance = (Plateaus[I].LastSize > CacheSize) ? Plateaus[I].LastSize - CacheSize : CacheSize - Plateaus[I].LastSize;
+    if (Distance < BestDistance) {
+      BestDistance = Distance;
+      Best         = I;
+    }
+  }
+  return Best;
+}
+
+STATIC VOID PrintCacheLatency (IN UINT64 CyclesX100, IN UINT64 TscHz) {
+  UINT64 NsX100 = DivU64x64Remainder (MultU64x32 (CyclesX100, 1000000000), TscHz, NULL);
+  Print (L"%4ld.%02d cyc %4ld.%d ns", DivU64x32 (CyclesX100, 100), ModU64x32 (CyclesX100, 100),
+         DivU64x32 (NsX100, 100), ModU64x32 (DivU64x32 (NsX100, 10), 10));
+}
+
+STATIC VOID PrintCacheSweepHeader (VOID) {
+  Print (L"Working set   Latency\n");
+  Print (L"---------------------------------------\n");
+}
+
+STATIC VOID PrintCacheCompareHeader (VOID) {
+  Print (L"Level            CPUID      Measured   Latency                 Status\n");
+  Print (L"------------------------------------------------------------------------------\n");
+}
+
+STATIC VOID DoCacheProbe (VOID) {
+  CONST CPUID_DB_ENTRY *Leaf;
+  CPU_CACHE_INFO       Caches[CPU_CACHE_MAX];
+  CACHE_PROBE_POINT    Points[CACHE_PROBE_MAX_POINTS];
+  CACHE_PLATEAU        Plateaus[CACHE_PROBE_MAX_POINTS];
+  BOOLEAN              Matched[CACHE_PROBE_MAX_POINTS];
+  UINTN                Count, CacheCount = 0, PointCount = 0, PlateauCount, I, J, LineCount;
+  UINT64               Llc = 0, MaxSet, Size, TscHz;
+  UINT8                *Buffer;
+  UINT32               *Order;
+  CHAR16               SizeStr[16];
+  CONST CHAR16         *Status;
+  ShowHeaderAndMenu (MenuCacheProbe);
+
+  Leaf = CpuidCacheLeaf (&Count);
+  for (I = 0; I < Count && CacheCount < CPU_CACHE_MAX; I++) {
+    CpuidCacheDecode (&Leaf[I], &Caches[CacheCount]);
+    if (Caches[CacheCount].Type == 2) continue;  // instruction caches are not on the data path
+    Llc = MAX (Llc, Caches[CacheCount].Size);
+    CacheCount++;
+  }
+  if (Llc == 0) {
+    Print (L"[WARN] No deterministic cache parameters (CPUID 4 / 0x8000001D), assuming an 8MB LLC.\n");
+    Llc = CACHE_PROBE_DEFAULT_LLC;
+  }
+  MaxSet = MIN (MultU64x32 (Llc, 4), MEM_BENCH_MAX_SIZE);
+
+  Buffer = AllocatePages (EFI_SIZE_TO_PAGES ((UINTN)MaxSet));
+  Order  = AllocatePool ((UINTN)(MaxSet / MEM_BENCH_LINE) * sizeof (UINT32));
+  if (Buffer == NULL || Order == NULL) {
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); goto Exit;
+  }
+
+  TscHz = BenchTscHz ();
+  FormatByteSize (MaxSet, SizeStr, ARRAY_SIZE (SizeStr));
+  Print (L"Sweeping 4KB .. %s on this CPU, interrupts disabled per point ...\n", SizeStr);
+  for (Size = CACHE_PROBE_MIN_SET; Size <= MaxSet && PointCount < CACHE_PROBE_MAX_POINTS; ) {
+    Points[PointCount].Size       = Size;
+    Points[PointCount].CyclesX100 = CacheProbeMeasure (Buffer, (UINTN)Size, Order);
+    PointCount++;
+    Size = ((Size & (Size - 1)) == 0) ? Size + Size / 2 : (Size / 3) * 4;   // 4K, 6K, 8K, 12K ...
+  }
+  PlateauCount = CacheProbeFindPlateaus (Points, PointCount, Plateaus);
+
+  ClearScreenAndResetAttr ();
+  PrintCacheSweepHeader ();
+  LineCount = 2;
+  for (I = 0; I < PointCount; I++) {
+    FormatByteSize (Points[I].Size, SizeStr, ARRAY_SIZE (SizeStr));
+    Print (L"%-12s  ", SizeStr);
+    PrintCacheLatency (Points[I].CyclesX100, TscHz);
+    Print (L"\n");
+    if (PageLineAccountingEx (&LineCount, PrintCacheSweepHeader, 2)) goto Exit;
+  }
+
+  Print (L"\n");
+  PrintCacheCompareHeader ();
+  LineCount += 3;
+  ZeroMem (Matched, sizeof (Matched));
+  for (I = 0; I < CacheCount; I++) {
+    FormatByteSize (Caches[I].Size, SizeStr, ARRAY_SIZE (SizeStr));
+    Print (L"L%d %-13s %-10s ", Caches[I].Level, CpuidCacheTypeStr (Caches[I].Type), SizeStr);
+    if (PlateauCount == 0) {
+      SetAttrHighlight ();
+      Print (L"%-10s %-23s NOT RESOLVED\n", L"-", L"-");
+      SetAttrNormal ();
+    } else {
+      J          = CacheProbeNearestPlateau (Plateaus, PlateauCount, Caches[I].Size);
+      Matched[J] = TRUE;
+      FormatByteSize (Plateaus[J].LastSize, SizeStr, ARRAY_SIZE (SizeStr));
+      Print (L"%-10s ", SizeStr);
+      PrintCacheLatency (Plateaus[J].CyclesX100, TscHz);
+      if (Plateaus[J].LastSize * 2 < Caches[I].Size) {
+        Status = L"SMALLER (disabled / partitioned?)";
+      } else if (Plateaus[J].LastSize > Caches[I].Size * 2) {
+        Status = L"LARGER";
+      } else {
+        Status = L"OK";
+      }
+      if (Status[0] != L'O') SetAttrHighlight ();
+      Print (L"  %s\n", Status);
+      SetAttrNormal ();
+    }
+    if (PageLineAccountingEx (&LineCount, PrintCacheCompareHeader, 2)) goto Exit;
+  }
+  // Plateaus no cache level claimed (memory, or a level CPUID does not report).
+  for (J = 0; J < PlateauCount; J++) {
+    if (Matched[J]) continue;
+    FormatByteSize (Plateaus[J].LastSize, SizeStr, ARRAY_SIZE (SizeStr));
+    Print (L"%-16s %-10s %-10s ", L"Unmatched", L"-", SizeStr);
+    PrintCacheLatency (Plateaus[J].CyclesX100, TscHz);
+    Print (L"\n");
+    if (PageLineAccountingEx (&LineCount, PrintCacheCompareHeader, 2)) goto Exit;
+  }
+  Print (L"\nMeasured = largest working set at the plateau latency (TLB misses included).\n");
+  WaitAnyKey ();
+
+Exit:
+  if (Order != NULL) FreePool (Order);
+  if (Buffer != NULL) FreePages (Buffer, EFI_SIZE_TO_PAGES ((UINTN)MaxSet));
+}
+
+//
+// =====================================================
+// PMU Session (Architectural Performance Monitoring)
+// =====================================================
+//
+// Counters are programmed with IA32_PERF_GLOBAL_CTRL cleared, enabled
+// around one built-in kernel with interrupts off, then read and the
+// previous control registers put back. Needs CPUID 0xA version 2 or later
+// (global control and fixed counters).
+//
+typedef struct {
+  UINT8  Version;
+  UINT8  GpCount;
+  UINT8  GpWidth;
+  UINT8  FixedCount;
+  UINT8  FixedWidth;
+  UINT8  ArchEvents;       // valid bits in Unavailable
+  UINT32 Unavailable;      // CPUID.0AH:EBX, set = architectural event missing
+} PMU_INFO;
+
+typedef struct {
+  CONST CHAR16 *Name;
+  UINT8        Event;
+  UINT8        UMask;
+  UINT8        ArchBit;      // CPUID.0AH:EBX bit
+  UINT8        Fixed;        // fixed counter that counts the same thing, or PMU_NONE
+} PMU_EVENT_DESC;
+
+typedef struct {
+  UINTN   Event;             // index into mPmuEvents
+  BOOLEAN IsFixed;
+  UINT8   Counter;
+  UINT64  Count;
+  BOOLEAN Overflowed;
+} PMU_SLOT;
+
+typedef struct {
+  PMU_SLOT Slots[PMU_MAX_GP + PMU_MAX_FIXED];
+  UINTN    SlotCount;
+  UINT64   Enable;             // IA32_PERF_GLOBAL_CTRL value for the run
+  UINT64   SavedGlobalCtrl;
+  UINT64   SavedFixedCtrl;
+  UINT64   SavedEvtSel[PMU_MAX_GP];
+  UINT64   SavedPmc[PMU_MAX_GP];
+  UINT64   SavedFixedCtr[PMU_MAX_FIXED];
+  UINT64   SavedOverflow;      // IA32_PERF_GLOBAL_STATUS counter overflow bits
+  BOOLEAN  FullWidthPmc;       // SavedPmc can be written back without truncation
+} PMU_SESSION;
+
+typedef struct {
+  UINT8  *Buffer;
+  UINTN  Size;
+  UINT32 *Order;
+  VOID   *Head;
+} PMU_KERNEL_CONTEXT;
+
+typedef struct {
+  CONST CHAR16 *Name;
+  VOID         (*Prepare)(IN OUT PMU_KERNEL_CONTEXT *Ctx);   // runs before counting, may be NULL
+  VOID         (*Run)(IN OUT PMU_KERNEL_CONTEXT *Ctx);
+} PMU_KERNEL;
+
+typedef enum {
+  PmuEvtCycles = 0,
+  PmuEvtInstructions,
+  PmuEvtRefCycles,
+  PmuEvtLlcRefs,
+  PmuEvtLlcMisses,
+  PmuEvtBranches,
+  PmuEvtBranchMisses,
+  PmuEvtTopdownSlots,
+  PmuEvtMax
+} PMU_EVENT;
+
+STATIC CONST PMU_EVENT_DESC mPmuEvents[PmuEvtMax] = {
+  { L"Core cycles",           0x3C, 0x00, 0, 1        },
+  { L"Instructions retired",  0xC0, 0x00, 1, 0        },
+  { L"Reference cycles",      0x3C, 0x01, 2, 2        },
+  { L"LLC references",        0x2E, 0x4F, 3, PMU_NONE },
+  { L"LLC misses",            0x2E, 0x41, 4, PMU_NONE },
+  { L"Branches retired",      0xC4, 0x00, 5, PMU_NONE },
+  { L"Branch misses retired", 0xC5, 0x00, 6, PMU_NONE },
+  { L"Topdown slots",         0xA4, 0x01, 7, 3        }
+};
+
+STATIC VOID PmuKernelCopy (IN OUT PMU_KERNEL_CONTEXT *Ctx) {
+  CopyMem (Ctx->Buffer + Ctx->Size / 2, Ctx->Buffer, Ctx->Size / 2);
+}
+
+STATIC VOID PmuKernelZero (IN OUT PMU_KERNEL_CONTEXT *Ctx) {
+  ZeroMem (Ctx->Buffer, Ctx->Size);
+}
+
+STATIC VOID PmuKernelRead (IN OUT PMU_KERNEL_CONTEXT *Ctx) {
+  MemBenchRead (Ctx->Buffer, Ctx->Size);
+}
+
+STATIC VOID PmuKernelChasePrepare (IN OUT PMU_KERNEL_CONTEXT *Ctx) {
+  Ctx->Head = MemBenchBuildChain (Ctx->Buffer, Ctx->Size / MEM_BENCH_LINE, MEM_BENCH_LINE, Ctx->Order);
+}
+
+STATIC VOID PmuKernelChase (IN OUT PMU_KERNEL_CONTEXT *Ctx) {
+  MemBenchChase (Ctx->Head, Ctx->Size / MEM_BENCH_LINE);
+}
+
+STATIC VOID PmuKernelSortPrepare (IN OUT PMU_KERNEL_CONTEXT *Ctx) {
+  UINT64 *Values = (UINT64 *)Ctx->Buffer;
+  UINT64 Seed    = AsmReadTsc () | 1;
+  UINTN  I;
+
+  for (I = 0; I < PMU_SORT_VALUES; I++) {
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 7;
+    Seed ^= Seed << 17;
+    Values[I] = Seed;
+  }
+}
+
+STATIC VOID PmuKernelSort (IN OUT PMU_KERNEL_CONTEXT *Ctx) {
+  SortUint64 ((UINT64 *)Ctx->Buffer, PMU_SORT_VALUES);
+}
+
+STATIC VOID PmuKernelCpuid (IN OUT PMU_KERNEL_CONTEXT *Ctx) {
+  UINT32 Eax;
+  UINTN  I;
+  for (I = 0; I < 1000; I++) AsmCpuid (0, &Eax, NULL, NULL, NULL);
+}
+
+STATIC CONST PMU_KERNEL mPmuKernels[] = {
+  { L"CopyMem 8MB -> 8MB",         NULL,                  PmuKernelCopy  },
+  { L"ZeroMem 16MB",               NULL,                  PmuKernelZero  },
+  { L"Sequential read 16MB",       NULL,                  PmuKernelRead  },
+  { L"Random pointer chase 16MB",  PmuKernelChasePrepare, PmuKernelChase },
+  { L"SortUint64 64K values",      PmuKernelSortPrepare,  PmuKernelSort  },
+  { L"CPUID leaf 0 x 1000",        NULL,                  PmuKernelCpuid }
+};
+
+STATIC BOOLEAN PmuQuery (OUT PMU_INFO *Pmu) {
+  UINT32 Eax = 0, Ebx = 0, Edx = 0;
+
+  ZeroMem (Pmu, sizeof (*Pmu));
+  if (!mCpuidDb.IsIntel || !CpuidDbGet (0xA, 0, &Eax, &Ebx, NULL, &Edx)) return FALSE;
+  Pmu->Version     = (UINT8)Eax;
+  Pmu->GpCount     = (UINT8)MIN ((Eax >> 8) & 0xFF, PMU_MAX_GP);
+  Pmu->GpWidth     = (UINT8)(Eax >> 16);
+  Pmu->ArchEvents  = (UINT8)(Eax >> 24);
+  Pmu->Unavailable = Ebx;
+  if (Pmu->Version >= 2) {
+    Pmu->FixedCount = (UINT8)MIN (Edx & 0x1F, PMU_MAX_FIXED);
+    Pmu->FixedWidth = (UINT8)(Edx >> 5);
+  }
+  return (BOOLEAN)(Pmu->Version != 0);
+}
+
+STATIC BOOLEAN PmuEventAvailable (IN CONST PMU_INFO *Pmu, IN UINTN Event) {
+  return (BOOLEAN)(mPmuEvents[Event].ArchBit < Pmu->ArchEvents && (Pmu->Unavailable & (1u << mPmuEvents[Event].ArchBit)) == 0);
+}
+
+//
+// Fixed counter when one counts the event, otherwise the next free GP
+// counter. FALSE when none is left.
+//
+STATIC BOOLEAN PmuSessionAdd (IN CONST PMU_INFO *Pmu, IN OUT PMU_SESSION *Session, IN UINTN Event) {
+  PMU_SLOT *Slot = &Session->Slots[Session->SlotCount];
+  UINTN    I, GpUsed = 0;
+
+  for (I = 0; I < Session->SlotCount; I++) {
+    if (Session->Slots[I].Event == Event) return TRUE;
+    if (!Session->Slots[I].IsFixed) GpUsed++;
+  }
+  ZeroMem (Slot, sizeof (*Slot));
+  Slot->Event = Event;
+  if (mPmuEvents[Event].Fixed < Pmu->FixedCount) {
+    Slot->IsFixed = TRUE;
+    Slot->Counter = mPmuEvents[Event].Fixed;
+  } else if (GpUsed < Pmu->GpCount) {
+    Slot->Counter = (UINT8)GpUsed;
+  } else {
+    return FALSE;
+  }
+  Session->SlotCount++;
+  return TRUE;
+}
+
+//
+// Overflow bits PmuProgram clears: every GP and fixed counter plus the two
+// buffer/uncore bits at 62..63.
+//
+STATIC UINT64 PmuOverflowMask (IN CONST PMU_INFO *Pmu) {
+  return (LShiftU64 (1, Pmu->GpCount) - 1) | LShiftU64 (LShiftU64 (1, Pmu->FixedCount) - 1, 32) | LShiftU64 (0x3, 62);
+}
+
+//
+// Saves everything PmuProgram touches: controls, counter values and the
+// overflow status.
+//
+STATIC BOOLEAN PmuSave (IN CONST PMU_INFO *Pmu, OUT PMU_SESSION *Session) {
+  UINT64  Status = 0, Caps = 0;
+  BOOLEAN Ok;
+  UINTN   I;
+
+  Ok = SafeReadMsr (MSR_IA32_PERF_GLOBAL_CTRL, &Session->SavedGlobalCtrl);
+  Ok = (BOOLEAN)(Ok && SafeReadMsr (MSR_IA32_PERF_GLOBAL_STATUS, &Status));
+  if (Pmu->FixedCount != 0) Ok = (BOOLEAN)(Ok && SafeReadMsr (MSR_IA32_FIXED_CTR_CTRL, &Session->SavedFixedCtrl));
+  for (I = 0; I < Pmu->GpCount; I++) {
+    Ok = (BOOLEAN)(Ok && SafeReadMsr (MSR_IA32_PERFEVTSEL0 + (UINT32)I, &Session->SavedEvtSel[I]));
+    Ok = (BOOLEAN)(Ok && SafeReadMsr (MSR_IA32_PMC0 + (UINT32)I, &Session->SavedPmc[I]));
+  }
+  for (I = 0; I < Pmu->FixedCount; I++) {
+    Ok = (BOOLEAN)(Ok && SafeReadMsr (MSR_IA32_FIXED_CTR0 + (UINT32)I, &Session->SavedFixedCtr[I]));
+  }
+  Session->SavedOverflow = Status & PmuOverflowMask (Pmu);
+  Session->FullWidthPmc  = (BOOLEAN)(SafeReadMsr (MSR_IA32_PERF_CAPABILITIES, &Caps) && (Caps & PERF_CAP_FW_WRITE) != 0);
+  return Ok;
+}
+
+//
+// Counters first, then controls, then GLOBAL_CTRL last so nothing counts
+// half-restored state. Without full-width writes IA32_PMCx only take the
+// low 32 bits (sign-extended), and overflow bits can only be set again on
+// version 4+ (GLOBAL_STATUS_SET); returns FALSE when either was lost.
+//
+STATIC BOOLEAN PmuRestore (IN CONST PMU_INFO *Pmu, IN CONST PMU_SESSION *Session) {
+  UINT64  GpMask = LShiftU64 (1, Pmu->GpWidth) - 1;
+  BOOLEAN Exact  = TRUE;
+  UINTN   I;
+
+  SafeWriteMsr (MSR_IA32_PERF_GLOBAL_CTRL, 0);
+  for (I = 0; I < Pmu->GpCount; I++) {
+    if (Session->FullWidthPmc) {
+      SafeWriteMsr (MSR_IA32_A_PMC0 + (UINT32)I, Session->SavedPmc[I]);
+    } else {
+      SafeWriteMsr (MSR_IA32_PMC0 + (UINT32)I, Session->SavedPmc[I]);
+      if ((Session->SavedPmc[I] & GpMask) != ((UINT64)(INT64)(INT32)(UINT32)Session->SavedPmc[I] & GpMask)) Exact = FALSE;
+    }
+    SafeWriteMsr (MSR_IA32_PERFEVTSEL0 + (UINT32)I, Session->SavedEvtSel[I]);
+  }
+  for (I = 0; I < Pmu->FixedCount; I++) SafeWriteMsr (MSR_IA32_FIXED_CTR0 + (UINT32)I, Session->SavedFixedCtr[I]);
+  if (Pmu->FixedCount != 0) SafeWriteMsr (MSR_IA32_FIXED_CTR_CTRL, Session->SavedFixedCtrl);
+
+  SafeWriteMsr (MSR_IA32_PERF_GLOBAL_OVF_CTRL, PmuOverflowMask (Pmu));   // drop what the kernel raised
+  if (Session->SavedOverflow != 0) {
+    if (Pmu->Version < 4 || !SafeWriteMsr (MSR_IA32_PERF_GLOBAL_STATUS_SET, Session->SavedOverflow)) Exact = FALSE;
+  }
+  SafeWriteMsr (MSR_IA32_PERF_GLOBAL_CTRL, Session->SavedGlobalCtrl);
+  return Exact;
+}
+
+//
+// Counters another agent left running: enabled EVTSELs and fixed counters
+// with a non-zero ring-level field. GLOBAL_CTRL alone says nothing, its
+// reset value already has every enable bit set.
+//
+STATIC UINTN PmuCountersInUse (IN CONST PMU_INFO *Pmu, IN CONST PMU_SESSION *Session) {
+  UINTN I, InUse = 0;
+
+  for (I = 0; I < Pmu->GpCount; I++) {
+    if ((Session->SavedEvtSel[I] & PERFEVTSEL_EN) != 0) InUse++;
+  }
+  for (I = 0; I < Pmu->FixedCount; I++) {
+    if ((RShiftU64 (Session->SavedFixedCtrl, I * 4) & 0x3) != 0) InUse++;
+  }
+  return InUse;
+}
+
+//
+// Leaves everything stopped (GLOBAL_CTRL = 0) with zeroed counters and
+// overflow bits; Session->Enable receives the mask that starts them.
+//
+STATIC BOOLEAN PmuProgram (IN CONST PMU_INFO *Pmu, IN OUT PMU_SESSION *Session) {
+  CONST PMU_EVENT_DESC *Desc;
+  UINT64               FixedCtrl = Session->SavedFixedCtrl;
+  BOOLEAN              Ok;
+  UINTN                I;
+
+  Ok = SafeWriteMsr (MSR_IA32_PERF_GLOBAL_CTRL, 0);
+  Ok = (BOOLEAN)(Ok && SafeWriteMsr (MSR_IA32_PERF_GLOBAL_OVF_CTRL, PmuOverflowMask (Pmu)));
+  Session->Enable = 0;
+  for (I = 0; I < Session->SlotCount && Ok; I++) {
+    Desc = &mPmuEvents[Session->Slots[I].Event];
+    if (Session->Slots[I].IsFixed) {
+      FixedCtrl &= ~LShiftU64 (0xF, Session->Slots[I].Counter * 4);
+      FixedCtrl |= LShiftU64 (0x3, Session->Slots[I].Counter * 4);            // OS + USR
+      Ok = SafeWriteMsr (MSR_IA32_FIXED_CTR0 + Session->Slots[I].Counter, 0);
+      Session->Enable |= LShiftU64 (1, 32 + Session->Slots[I].Counter);
+    } else {
+      Ok = SafeWriteMsr (MSR_IA32_PERFEVTSEL0 + Session->Slots[I].Counter,
+                         Desc->Event | ((UINT64)Desc->UMask << 8) | PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN);
+      Ok = (BOOLEAN)(Ok && SafeWriteMsr (MSR_IA32_PMC0 + Session->Slots[I].Counter, 0));
+      Session->Enable |= LShiftU64 (1, Session->Slots[I].Counter);
+    }
+  }
+  if (Ok && Pmu->FixedCount != 0) Ok = SafeWriteMsr (MSR_IA32_FIXED_CTR_CTRL, FixedCtrl);
+  return Ok;
+}
+
+STATIC VOID PmuCollect (IN CONST PMU_INFO *Pmu, IN OUT PMU_SESSION *Session) {
+  PMU_SLOT *Slot;
+  UINT64   Status = 0;
+  UINTN    I;
+
+  SafeReadMsr (MSR_IA32_PERF_GLOBAL_STATUS, &Status);
+  for (I = 0; I < Session->SlotCount; I++) {
+    Slot = &Session->Slots[I];
+    if (Slot->IsFixed) {
+      SafeReadMsr (MSR_IA32_FIXED_CTR0 + Slot->Counter, &Slot->Count);
+      Slot->Count     &= LShiftU64 (1, Pmu->FixedWidth) - 1;
+      Slot->Overflowed = (BOOLEAN)((RShiftU64 (Status, 32 + Slot->Counter) & 1) != 0);
+    } else {
+      SafeReadMsr (MSR_IA32_PMC0 + Slot->Counter, &Slot->Count);
+      Slot->Count     &= LShiftU64 (1, Pmu->GpWidth) - 1;
+      Slot->Overflowed = (BOOLEAN)((RShiftU64 (Status, Slot->Counter) & 1) != 0);
+    }
+  }
+}
+
+STATIC BOOLEAN PmuSessionCount (IN CONST PMU_SESSION *Session, IN UINTN Event, OUT UINT64 *Count) {
+  UINTN I;
+  for (I = 0; I < Session->SlotCount; I++) {
+    if (Session->Slots[I].Event == Event) {
+      *Count = Session->Slots[I].Count;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+//
+// Prints Label and Num * Scale / Den with two decimals, if both events ran.
+//
+STATIC VOID PmuPrintRatio (IN CONST PMU_SESSION *Session, IN CONST CHAR16 *Label, IN UINTN NumEvent, IN UINTN DenEvent, IN UINT32 Scale) {
+  UINT64 Num, Den, X100;
+
+  if (!PmuSessionCount (Session, NumEvent, &Num) || !PmuSessionCount (Session, DenEvent, &Den) || Den == 0) return;
+  X100 = DivU64x64Remainder (MultU64x32 (Num, Scale * 100), Den, NULL);
+  Print (L"  %-18s: %ld.%02d\n", Label, DivU64x32 (X100, 100), ModU64x32 (X100, 100));
+}
+
+STATIC VOID DoPmuSession (VOID) {
+  PMU_INFO           Pmu;
+  PMU_SESSION        Session;
+  PMU_KERNEL_CONTEXT Ctx;
+  CONST PMU_KERNEL   *Kernel;
+  UINT32             List[PmuEvtMax];
+  UINTN              Count, I;
+  UINT64             T0, Ticks = 0;
+  CHAR16             Input[MSR_LIST_INPUT_LEN];
+  EFI_INPUT_KEY      Key;
+  BOOLEAN            IntState, Ok, Exact;
+  ShowHeaderAndMenu (MenuPmuSession);
+
+  if (!CpuSupportsMsr () || !PmuQuery (&Pmu)) {
+    Print (L"[ERROR] No architectural performance monitoring (CPUID 0xA, Intel only).\n"); WaitAnyKey (); return;
+  }
+  Print (L"Arch PerfMon v%d: %d GP counter(s) x %d bit, %d fixed x %d bit\n", Pmu.Version, Pmu.GpCount, Pmu.GpWidth,
+         Pmu.FixedCount, Pmu.FixedWidth);
+  if (Pmu.Version < 2) {
+    Print (L"[ERROR] Version 2 or later (IA32_PERF_GLOBAL_CTRL) is required.\n"); WaitAnyKey (); return;
+  }
+
+  Print (L"\n");
+  for (I = 0; I < PmuEvtMax; I++) {
+    Print (L"  [%d] %-22s %02x/%02x  %s", (UINT32)I, mPmuEvents[I].Name, mPmuEvents[I].Event, mPmuEvents[I].UMask,
+           PmuEventAvailable (&Pmu, I) ? L"" : L"(not available)");
+    if (mPmuEvents[I].Fixed < Pmu.FixedCount) Print (L"  fixed %d", mPmuEvents[I].Fixed);
+    Print (L"\n");
+  }
+  Print (L"Events (e.g. 0 1 4 6, Enter = all available): ");
+  if (!ReadLine (Input, MSR_LIST_INPUT_LEN)) return;
+  Count = (Input[0] == L'\0') ? 0 : ParseHexList32 (Input, List, PmuEvtMax);
+  if (Input[0] != L'\0' && Count == 0) {
+    Print (L"Invalid event list.\n"); WaitAnyKey (); return;
+  }
+  if (Count == 0) {
+    for (I = 0; I < PmuEvtMax; I++) {
+      if (PmuEventAvailable (&Pmu, I)) List[Count++] = (UINT32)I;
+    }
+  }
+
+  ZeroMem (&Session, sizeof (Session));
+  for (I = 0; I < Count; I++) {
+    if (List[I] >= PmuEvtMax || !PmuEventAvailable (&Pmu, List[I])) {
+      Print (L"  [WARN] Event %d not available, skipped.\n", List[I]);
+    } else if (!PmuSessionAdd (&Pmu, &Session, List[I])) {
+      Print (L"  [WARN] No counter left for %s, skipped.\n", mPmuEvents[List[I]].Name);
+    }
+  }
+  if (Session.SlotCount == 0) {
+    Print (L"Nothing to count.\n"); WaitAnyKey (); return;
+  }
+
+  Print (L"\n");
+  for (I = 0; I < ARRAY_SIZE (mPmuKernels); I++) Print (L"  [%d] %s\n", (UINT32)I, mPmuKernels[I].Name);
+  Print (L"Kernel: ");
+  if (!ReadKeyBlocking (&Key)) return;
+  Print (L"%c\n", (Key.UnicodeChar == 0) ? L'?' : Key.UnicodeChar);
+  if (Key.UnicodeChar < L'0' || Key.UnicodeChar >= L'0' + ARRAY_SIZE (mPmuKernels)) {
+    Print (L"Invalid kernel.\n"); WaitAnyKey (); return;
+  }
+  Kernel = &mPmuKernels[Key.UnicodeChar - L'0'];
+
+  Ctx.Size   = MEM_BENCH_DEFAULT_SIZE;
+  Ctx.Head   = NULL;
+  Ctx.Buffer = AllocatePages (EFI_SIZE_TO_PAGES (Ctx.Size));
+  Ctx.Order  = AllocatePool ((Ctx.Size / MEM_BENCH_LINE) * sizeof (UINT32));
+  if (Ctx.Buffer == NULL || Ctx.Order == NULL) {
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); goto Exit;
+  }
+  SetMem (Ctx.Buffer, Ctx.Size, 0x5A);           // fault the pages in before counting
+  if (Kernel->Prepare != NULL) Kernel->Prepare (&Ctx);
+
+  if (!PmuSave (&Pmu, &Session)) {
+    Print (L"[ERROR] #GP reading PMU control MSRs.\n"); WaitAnyKey (); goto Exit;
+  }
+  Count = PmuCountersInUse (&Pmu, &Session);
+  if (Count != 0) {
+    Print (L"[WARN] %d counter(s) already enabled; controls and values are restored afterwards.\n", (UINT32)Count);
+  }
+
+  IntState = SaveAndDisableInterrupts ();
+  Ok       = PmuProgram (&Pmu, &Session);
+  if (Ok) {
+    T0 = AsmReadTsc ();
+    SafeWriteMsr (MSR_IA32_PERF_GLOBAL_CTRL, Session.Enable);
+    Kernel->Run (&Ctx);
+    SafeWriteMsr (MSR_IA32_PERF_GLOBAL_CTRL, 0);
+    Ticks = AsmReadTsc () - T0;
+    PmuCollect (&Pmu, &Session);
+  }
+  Exact = PmuRestore (&Pmu, &Session);
+  SetInterruptState (IntState);
+  if (!Exact) {
+    Print (L"[WARN] Previous counter values / overflow bits could not be restored exactly.\n");
+  }
+  if (!Ok) {
+    Print (L"[ERROR] #GP programming the counters (PMU virtualised or locked?).\n"); WaitAnyKey (); goto Exit;
+  }
+
+  Print (L"\n=== [ %s ] ===  %ld TSC ticks\n", Kernel->Name, Ticks);
+  Print (L"  Event                   Counter   Count\n");
+  for (I = 0; I < Session.SlotCount; I++) {
+    Print (L"  %-22s  %s%d  %-20ld%s\n", mPmuEvents[Session.Slots[I].Event].Name,
+           Session.Slots[I].IsFixed ? L"FIXED" : L"PMC  ", Session.Slots[I].Counter, Session.Slots[I].Count,
+           Session.Slots[I].Overflowed ? L" (overflowed)" : L"");
+  }
+  Print (L"\n");
+  PmuPrintRatio (&Session, L"IPC",              PmuEvtInstructions, PmuEvtCycles,       1);
+  PmuPrintRatio (&Session, L"LLC MPKI",         PmuEvtLlcMisses,    PmuEvtInstructions, 1000);
+  PmuPrintRatio (&Session, L"Branch MPKI",      PmuEvtBranchMisses, PmuEvtInstructions, 1000);
+  PmuPrintRatio (&Session, L"LLC miss %",       PmuEvtLlcMisses,    PmuEvtLlcRefs,      100);
+  PmuPrintRatio (&Session, L"Branch miss %",    PmuEvtBranchMisses, PmuEvtBranches,     100);
+  WaitAnyKey ();
+
+Exit:
+  if (Ctx.Order != NULL) FreePool (Ctx.Order);
+  if (Ctx.Buffer != NULL) FreePages (Ctx.Buffer, EFI_SIZE_TO_PAGES (Ctx.Size));
+}
+
+//
+// =====================================================
+// Effective Frequency (APERF / MPERF)
+// =====================================================
+//
+// Every enabled CPU samples TSC / MPERF / APERF around the chosen load in
+// its own PERCPU_MSR_SLOT. Loaded runs start together behind a barrier so
+// turbo sees the real active-core count; the idle run samples twice with
+// the APs left parked by the firmware in between.
+//
+typedef enum {
+  FreqLoadIdle = 0,
+  FreqLoadSpin,
+  FreqLoadInteger,
+  FreqLoadMemory,
+  FreqLoadMax
+} FREQ_LOAD;
+
+#define FREQ_PHASE_START             BIT0
+#define FREQ_PHASE_END               BIT1
+
+//
+// Slot->Values layout.
+//
+#define FREQ_VAL_TSC                 0
+#define FREQ_VAL_MPERF               1
+#define FREQ_VAL_APERF               2
+#define FREQ_VAL_END                 3           // end sample = start index + FREQ_VAL_END
+#define FREQ_VAL_PERF_CTL            6
+
+typedef struct {
+  PERCPU_MSR_JOB  Cpus;
+  FREQ_LOAD       Load;
+  UINT8           Phases;
+  UINT64          IntervalTicks;
+  UINT8           *Buffer;        // FreqLoadMemory
+  UINTN           BufferSize;
+  volatile UINT32 Arrived;
+  UINT32          Expected;
+  volatile UINT64 Sink;           // keeps the integer load from being optimised away
+  volatile BOOLEAN Abort;         // ends the load early
+} FREQ_JOB;
+
+STATIC CONST CHAR16 *mFreqLoadNames[FreqLoadMax] = {
+  L"Idle (APs parked by firmware)",
+  L"Spin (PAUSE loop)",
+  L"Integer (xorshift)",
+  L"Memory (16MB sequential read)"
+};
+
+STATIC VOID FreqReadCounters (IN OUT PERCPU_MSR_SLOT *Slot, IN UINTN Base) {
+  Slot->Values[Base + FREQ_VAL_TSC] = AsmReadTsc ();
+  if (ProbeReadMsr (MSR_IA32_MPERF, &Slot->Values[Base + FREQ_VAL_MPERF]) != PROBE_OK) Slot->FaultMask |= BIT0;
+  if (ProbeReadMsr (MSR_IA32_APERF, &Slot->Values[Base + FREQ_VAL_APERF]) != PROBE_OK) Slot->FaultMask |= BIT1;
+}
+
+STATIC VOID FreqRunLoad (IN OUT FREQ_JOB *Job, IN UINT64 Start) {
+  UINT64 Seed = Start | 1;
+  UINTN  I;
+
+  while (AsmReadTsc () - Start < Job->IntervalTicks && !Job->Abort) {
+    switch (Job->Load) {
+      case FreqLoadSpin:
+        CpuPause ();
+        break;
+      case FreqLoadInteger:
+        for (I = 0; I < 1000; I++) {
+          Seed ^= Seed << 13;
+          Seed ^= Seed >> 7;
+          Seed ^= Seed << 17;
+        }
+        break;
+      case FreqLoadMemory:
+        Seed += MemBenchRead (Job->Buffer, Job->BufferSize);
+        break;
+      default:
+        return;
+    }
+  }
+  Job->Sink = Seed;
+}
+
+//
+// Runs on every CPU at once; same rules as PerCpuMsrCollectProc.
+//
+STATIC VOID EFIAPI FreqSampleProc (IN OUT VOID *Buffer) {
+  FREQ_JOB        *Job = (FREQ_JOB *)Buffer;
+  PERCPU_MSR_SLOT *Slot;
+  UINT64          Deadline;
+
+  Slot = PerCpuFindSlot (&Job->Cpus, GetCurrentApicId (Job->Cpus.MaxBasicLeaf));
+  if (Slot == NULL) return;
+
+  if ((Job->Phases & FREQ_PHASE_START) != 0) {
+    if (Job->Load != FreqLoadIdle) {
+      InterlockedIncrement (&Job->Arrived);
+      Deadline = AsmReadTsc () + Job->IntervalTicks;          // never wait longer than one interval
+      while (Job->Arrived < Job->Expected && AsmReadTsc () < Deadline) CpuPause ();
+    }
+    FreqReadCounters (Slot, 0);
+    FreqRunLoad (Job, Slot->Values[FREQ_VAL_TSC]);
+  }
+  if ((Job->Phases & FREQ_PHASE_END) != 0) {
+    FreqReadCounters (Slot, FREQ_VAL_END);
+    if (ProbeReadMsr (MSR_IA32_PERF_CTL, &Slot->Values[FREQ_VAL_PERF_CTL]) != PROBE_OK) Slot->Values[FREQ_VAL_PERF_CTL] = 0;
+  }
+  Slot->Done = 1;
+}
+
+//
+// Starts FreqSampleProc on the APs, non-blocking with a completion event,
+// so the BSP can run its own share (WithBsp) or do something else.
+//
+STATIC EFI_STATUS FreqJobStartAps (IN OUT FREQ_JOB *Job, IN UINT8 Phases, IN BOOLEAN WithBsp, OUT EFI_EVENT *Done) {
+  EFI_STATUS Status = EFI_NOT_STARTED;
+  UINTN      I;
+
+  *Done         = NULL;
+  Job->Phases   = Phases;
+  Job->Arrived  = 0;
+  Job->Abort    = FALSE;
+  Job->Expected = WithBsp ? 0 : (UINT32)-1;
+  for (I = 0; I < Job->Cpus.SlotCount; I++) {
+    if (PERCPU_SLOT (&Job->Cpus, I)->Enabled) Job->Expected++;
+  }
+  if (mMp != NULL && Job->Cpus.SlotCount > 1 && !EFI_ERROR (PerCpuCreateDoneEvent (Done))) {
+    Status = mMp->StartupAllAPs (mMp, FreqSampleProc, FALSE, *Done, 0, Job, NULL);
+  }
+  if (EFI_ERROR (Status)) Job->Expected = WithBsp ? 1 : 0;
+  return Status;
+}
+
+//
+// Waits for the APs of FreqJobStartAps. If that fails Job->Cpus is left
+// Orphaned and neither the slots nor Job->Buffer may be freed.
+//
+STATIC EFI_STATUS FreqJobWait (IN OUT FREQ_JOB *Job, IN EFI_STATUS Status, IN EFI_EVENT Done) {
+  if (!EFI_ERROR (Status)) return PerCpuWaitAps (&Job->Cpus, Done);
+  if (Done != NULL) gBS->CloseEvent (Done);
+  return (Status == EFI_NOT_STARTED) ? EFI_SUCCESS : Status;
+}
+
+STATIC VOID FreqJobFree (IN OUT FREQ_JOB *Job) {
+  if (Job->Cpus.Orphaned) return;                     // APs may still be loading the buffer
+  if (Job->Buffer != NULL) FreePages (Job->Buffer, EFI_SIZE_TO_PAGES (Job->BufferSize));
+  Job->Buffer = NULL;
+  PerCpuJobFree (&Job->Cpus);
+}
+
+STATIC EFI_STATUS FreqJobRun (IN OUT FREQ_JOB *Job, IN UINT8 Phases) {
+  EFI_STATUS Status;
+  EFI_EVENT  Done;
+
+  Status = FreqJobStartAps (Job, Phases, TRUE, &Done);
+  FreqSampleProc (Job);
+  return FreqJobWait (Job, Status, Done);
+}
+
+//
+// Family 6 models where 0x1AD holds per-group ratios and 0x1AE the active-core
+// count of each group (MSR_TURBO_GROUP_CORECNT): Skylake-SP and later Xeons and
+// the Goldmont / Tremont Atoms. Elsewhere 0x1AE is absent or is
+// MSR_TURBO_RATIO_LIMIT1 (more ratios, Ivy Bridge-EP / Haswell-E), so being
+// readable says nothing about its layout.
+//
+STATIC CONST UINT8 mTurboGroupModels[] = {
+  0x55, 0x6A, 0x6C, 0x8F, 0xCF, 0xAD, 0xAE, 0xAF,     // Xeon SP
+  0x5C, 0x5F, 0x7A, 0x86, 0x96, 0x9C                  // Atom
+};
+
+STATIC BOOLEAN FreqHasTurboGroups (VOID) {
+  UINTN I;
+
+  if (!mCpuidDb.IsIntel || mCpuidDb.Family != 6) return FALSE;
+  for (I = 0; I < ARRAY_SIZE (mTurboGroupModels); I++) {
+    if (mTurboGroupModels[I] == mCpuidDb.Model) return TRUE;
+  }
+  return FALSE;
+}
+
+//
+// MSR_PLATFORM_INFO / turbo ratio limits (Intel). Returns the base
+// (max non-turbo) frequency in MHz, 0 when not decodable.
+//
+STATIC UINT32 PrintPlatformFrequencyInfo (IN UINT32 BusMhz) {
+  UINT64 PlatformInfo, Turbo, Groups = 0, Misc;
+  UINT32 Base, Ratio;
+  UINTN  I;
+
+  if (SafeReadMsr (MSR_IA32_MISC_ENABLE, &Misc)) {
+    Print (L"IA32_MISC_ENABLE      : EIST %s, Turbo %s\n", (Misc & MISC_ENABLE_EIST_BIT) ? L"enabled" : L"DISABLED",
+           (Misc & MISC_ENABLE_TURBO_DISABLE) ? L"DISABLED" : L"enabled");
+  }
+  if (!mCpuidDb.IsIntel || !SafeReadMsr (MSR_PLATFORM_INFO, &PlatformInfo)) {
+    Print (L"MSR_PLATFORM_INFO     : not available\n");
+    return 0;
+  }
+  Base = (UINT32)RShiftU64 (PlatformInfo, 8) & 0xFF;
+  Print (L"MSR_PLATFORM_INFO     : %016lx  (bus %d MHz)\n", PlatformInfo, BusMhz);
+  Print (L"  Base (max non-turbo): %3d x  = %5d MHz\n", Base, Base * BusMhz);
+  Ratio = (UINT32)RShiftU64 (PlatformInfo, 40) & 0xFF;
+  Print (L"  Max efficiency      : %3d x  = %5d MHz\n", Ratio, Ratio * BusMhz);
+  Ratio = (UINT32)RShiftU64 (PlatformInfo, 48) & 0xFF;
+  if (Ratio != 0) Print (L"  Min operating       : %3d x  = %5d MHz\n", Ratio, Ratio * BusMhz);
+  Print (L"  Programmable        : turbo ratio %d, TDP limit %d, TjOffset %d\n",
+         (PlatformInfo & BIT28) ? 1 : 0, (PlatformInfo & BIT29) ? 1 : 0, (PlatformInfo & BIT30) ? 1 : 0);
+
+  if (SafeReadMsr (MSR_TURBO_RATIO_LIMIT, &Turbo) && Turbo != 0) {
+    if (!FreqHasTurboGroups () || !SafeReadMsr (MSR_TURBO_RATIO_LIMIT_CORES, &Groups)) Groups = 0;
+    Print (L"MSR_TURBO_RATIO_LIMIT : %016lx\n", Turbo);
+    for (I = 0; I < 8; I++) {
+      Ratio = (UINT32)RShiftU64 (Turbo, I * 8) & 0xFF;
+      if (Ratio == 0) continue;
+      Print (L"  %3d active core(s)  : %3d x  = %5d MHz\n",
+             (Groups != 0) ? (UINT32)RShiftU64 (Groups, I * 8) & 0xFF : (UINT32)(I + 1), Ratio, Ratio * BusMhz);
+    }
+  }
+  return Base * BusMhz;
+}
+
+STATIC VOID PrintFreqHeader (VOID) {
+  Print (L"CPU  APIC ID   Eff MHz  Busy%%  APERF/MPERF  PERF_CTL ratio\n");
+  Print (L"-------------------------------------------------------------\n");
+}
+
+STATIC VOID DoFreqSampler (VOID) {
+  FREQ_JOB        Job;
+  PERCPU_MSR_SLOT *Slot;
+  UINT32          BusMhz = FREQ_DEFAULT_BUS_MHZ, RefMhz, BaseMhz, Ecx = 0, IntervalMs, Low = 0;
+  UINT64          DTsc, DMperf, DAperf, EffMhz, MinMhz = MAX_UINT64, MaxMhz = 0, SumMhz = 0;
+  UINTN           I, Sampled = 0, LineCount;
+  EFI_INPUT_KEY   Key;
+  EFI_STATUS      Status;
+  ShowHeaderAndMenu (MenuFreqSampler);
+
+  if (!CpuSupportsMsr () || !CPU_HAS (CpuFeatAperfMperf)) {
+    Print (L"[ERROR] APERF/MPERF not supported (CPUID.06H:ECX[0]).\n"); WaitAnyKey (); return;
+  }
+  if (CpuidDbGet (0x16, 0, NULL, NULL, &Ecx, NULL) && (Ecx & 0xFFFF) != 0) BusMhz = Ecx & 0xFFFF;
+  BaseMhz = PrintPlatformFrequencyInfo (BusMhz);
+  // MPERF counts at the base (TSC) rate
+  RefMhz  = (BaseMhz != 0) ? BaseMhz : (UINT32)DivU64x32 (BenchTscHz (), 1000000);
+
+  Print (L"\n");
+  for (I = 0; I < FreqLoadMax; I++) Print (L"  [%d] %s\n", (UINT32)I, mFreqLoadNames[I]);
+  Print (L"Load: ");
+  if (!ReadKeyBlocking (&Key)) return;
+  Print (L"%c\n", (Key.UnicodeChar == 0) ? L'?' : Key.UnicodeChar);
+  if (Key.UnicodeChar < L'0' || Key.UnicodeChar >= L'0' + FreqLoadMax) {
+    Print (L"Invalid load.\n"); WaitAnyKey (); return;
+  }
+  if (!PromptHexUint32 (L"Interval ms (Hex, Enter = 0x3E8): ", &IntervalMs) || IntervalMs == 0) {
+    IntervalMs = FREQ_DEFAULT_INTERVAL_MS;
+  }
+
+  ZeroMem (&Job, sizeof (Job));
+  Job.Load          = (FREQ_LOAD)(Key.UnicodeChar - L'0');
+  Job.IntervalTicks = DivU64x32 (MultU64x32 (BenchTscHz (), IntervalMs), 1000);
+  if (EFI_ERROR (PerCpuJobInit (&Job.Cpus, NULL, 0))) {
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); return;
+  }
+  if (Job.Load == FreqLoadMemory) {
+    Job.BufferSize = MEM_BENCH_DEFAULT_SIZE;
+    Job.Buffer     = AllocatePages (EFI_SIZE_TO_PAGES (Job.BufferSize));
+    if (Job.Buffer == NULL) {
+      Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); goto Exit;
+    }
+    SetMem (Job.Buffer, Job.BufferSize, 0x5A);
+  }
+
+  Print (L"Sampling %d CPU(s) for %d ms ...\n", (UINT32)Job.Cpus.SlotCount, IntervalMs);
+  if (Job.Load == FreqLoadIdle) {
+    Status = FreqJobRun (&Job, FREQ_PHASE_START);
+    EventLoopSleep (IntervalMs);                                // BSP halts too, like the idle APs
+    if (!EFI_ERROR (Status)) Status = FreqJobRun (&Job, FREQ_PHASE_END);
+  } else {
+    Status = FreqJobRun (&Job, FREQ_PHASE_START | FREQ_PHASE_END);
+  }
+  if (Job.Cpus.Orphaned) {
+    Print (L"[ERROR] Could not wait for the APs (%r); results dropped.\n", Status); WaitAnyKey (); return;
+  }
+  if (EFI_ERROR (Status)) {
+    Print (L"[WARN] StartupAllAPs returned %r, showing partial results.\n", Status);
+  }
+
+  Print (L"\n");
+  PrintFreqHeader ();
+  LineCount = 0;
+  for (I = 0; I < Job.Cpus.SlotCount; I++) {
+    Slot = PERCPU_SLOT (&Job.Cpus, I);
+    if (!Slot->Enabled) continue;
+    Print (L"%3d  %08x  ", (UINT32)I, Slot->ApicId);
+    DTsc   = Slot->Values[FREQ_VAL_END + FREQ_VAL_TSC]   - Slot->Values[FREQ_VAL_TSC];
+    DMperf = Slot->Values[FREQ_VAL_END + FREQ_VAL_MPERF] - Slot->Values[FREQ_VAL_MPERF];
+    DAperf = Slot->Values[FREQ_VAL_END + FREQ_VAL_APERF] - Slot->Values[FREQ_VAL_APERF];
+    if (!Slot->Done || Slot->FaultMask != 0 || DTsc == 0) {
+      Print (L"%s\n", Slot->Done ? L"(read faulted)" : L"(did not run)");
+    } else if (DMperf == 0) {
+      Print (L"%-8s 0\n", L"-");                 // never left a C-state
+    } else {
+      EffMhz = DivU64x64Remainder (MultU64x32 (DAperf, RefMhz), DMperf, NULL);
+      if (Job.Load != FreqLoadIdle && EffMhz * 100 < (UINT64)RefMhz * FREQ_LOW_PCT) {
+        SetAttrHighlight ();
+        Low++;
+      }
+      Print (L"%-8ld %3ld    %4ld.%02ld      %d\n", EffMhz, DivU64x64Remainder (MultU64x32 (MIN (DMperf, DTsc), 100), DTsc, NULL),
+             DivU64x64Remainder (DAperf, DMperf, NULL), DivU64x64Remainder (MultU64x32 (DAperf, 100), DMperf, NULL) % 100,
+             (UINT32)RShiftU64 (Slot->Values[FREQ_VAL_PERF_CTL], 8) & 0xFF);
+      SetAttrNormal ();
+      MinMhz  = MIN (MinMhz, EffMhz);
+      MaxMhz  = MAX (MaxMhz, EffMhz);
+      SumMhz += EffMhz;
+      Sampled++;
+    }
+    if (PageLineAccountingEx (&LineCount, PrintFreqHeader, 2)) goto Exit;
+  }
+
+  Print (L"\nReference %d MHz (%s)", RefMhz, (BaseMhz != 0) ? L"base ratio x bus" : L"TSC");
+  if (Sampled != 0) {
+    Print (L"  min %ld / avg %ld / max %ld MHz", MinMhz, DivU64x32 (SumMhz, (UINT32)Sampled), MaxMhz);
+  }
+  Print (L"\n");
+  if (Low != 0) {
+    SetAttrHighlight ();
+    Print (L"%d loaded CPU(s) below %d%% of base: check P-state / EIST / power limit setup.\n", Low, FREQ_LOW_PCT);
+    SetAttrNormal ();
+  }
+  WaitAnyKey ();
+
+Exit:
+  FreqJobFree (&Job);
+}
+
+//
+// =====================================================
+// RAPL / C-State Residency Telemetry
+// =====================================================
+//
+// A periodic timer event at TPL_NOTIFY samples the counters on the BSP and
+// stores the per-interval deltas in a preallocated ring; it never prints
+// or allocates. The display loop drains the ring between key checks. Core
+// C-state and PP0 counters therefore describe the BSP's core only.
+//
+typedef struct {
+  CONST CHAR16 *Name;
+  UINT32       IntelMsr;
+  UINT32       AmdMsr;       // 0 = no AMD equivalent
+  BOOLEAN      IsEnergy;     // 32-bit energy status, else TSC-rate residency
+} TELEMETRY_COUNTER_DESC;
+
+STATIC CONST TELEMETRY_COUNTER_DESC mTelemetryCounters[] = {
+  { L"Pkg W",  MSR_PKG_ENERGY_STATUS,  AMD_MSR_PKG_ENERGY_STATUS,  TRUE  },
+  { L"PP0 W",  MSR_PP0_ENERGY_STATUS,  AMD_MSR_CORE_ENERGY_STATUS, TRUE  },
+  { L"DRAM W", MSR_DRAM_ENERGY_STATUS, 0,                          TRUE  },   // server DRAM units may differ
+  { L"PC2%",   MSR_PKG_C2_RESIDENCY,   0,                          FALSE },
+  { L"PC3%",   MSR_PKG_C3_RESIDENCY,   0,                          FALSE },
+  { L"PC6%",   MSR_PKG_C6_RESIDENCY,   0,                          FALSE },
+  { L"PC7%",   MSR_PKG_C7_RESIDENCY,   0,                          FALSE },
+  { L"CC3%",   MSR_CORE_C3_RESIDENCY,  0,                          FALSE },
+  { L"CC6%",   MSR_CORE_C6_RESIDENCY,  0,                          FALSE },
+  { L"CC7%",   MSR_CORE_C7_RESIDENCY,  0,                          FALSE }
+};
+
+#define TELEMETRY_COUNTERS           ARRAY_SIZE (mTelemetryCounters)
+
+typedef struct {
+  UINT64 TscDelta;
+  UINT64 Delta[TELEMETRY_COUNTERS];
+} TELEMETRY_SAMPLE;
+
+//
+// Head is only written by the timer callback, Tail only by the display
+// loop; both are free-running and taken modulo TELEMETRY_RING_SIZE.
+//
+typedef struct {
+  UINT32           Msr[TELEMETRY_COUNTERS];     // 0 = not readable on this CPU
+  UINT64           Prev[TELEMETRY_COUNTERS];
+  UINT64           PrevTsc;
+  TELEMETRY_SAMPLE Ring[TELEMETRY_RING_SIZE];
+  volatile UINT32  Head;
+  volatile UINT32  Tail;
+  volatile UINT32  Dropped;                     // intervals lost to a full ring
+  TELEMETRY_SAMPLE Total;                       // display side from here on
+  UINT64           Elapsed;
+  UINT64           TscHz;
+  UINTN            EnergyShift;
+} TELEMETRY_CONTEXT;
+
+STATIC VOID EFIAPI TelemetryTimerNotify (IN EFI_EVENT Event, IN VOID *Context) {
+  TELEMETRY_CONTEXT *Ctx = (TELEMETRY_CONTEXT *)Context;
+  TELEMETRY_SAMPLE  *Sample = NULL;
+  UINT64            Tsc, Now;
+  UINTN             I;
+
+  Tsc = AsmReadTsc ();
+  if (Ctx->Head - Ctx->Tail < TELEMETRY_RING_SIZE) {
+    Sample = &Ctx->Ring[Ctx->Head % TELEMETRY_RING_SIZE];
+  } else {
+    Ctx->Dropped++;                              // keep Prev current so the next delta is one interval
+  }
+  for (I = 0; I < TELEMETRY_COUNTERS; I++) {
+    if (Ctx->Msr[I] == 0 || ProbeReadMsr (Ctx->Msr[I], &Now) != PROBE_OK) continue;
+    if (Sample != NULL) {
+      // Unsigned subtraction handles wraparound; energy status is 32 bits wide
+      Sample->Delta[I] = mTelemetryCounters[I].IsEnergy ? ((Now - Ctx->Prev[I]) & MAX_UINT32) : Now - Ctx->Prev[I];
+    }
+    Ctx->Prev[I] = Now;
+  }
+  if (Sample != NULL) {
+    Sample->TscDelta = Tsc - Ctx->PrevTsc;
+    MemoryFence ();
+    Ctx->Head++;
+  }
+  Ctx->PrevTsc = Tsc;
+}
+
+STATIC VOID PrintTelemetryHeader (IN CONST TELEMETRY_CONTEXT *Ctx) {
+  UINTN I;
+  Print (L"  Time s ");
+  for (I = 0; I < TELEMETRY_COUNTERS; I++) {
+    if (Ctx->Msr[I] != 0) Print (L" %7s", mTelemetryCounters[I].Name);
+  }
+  Print (L"\n");
+}
+
+//
+// One row: watts from energy deltas (EnergyShift = RAPL energy status
+// unit), residency as a share of the interval's TSC ticks.
+//
+STATIC VOID PrintTelemetryRow (IN CONST TELEMETRY_CONTEXT *Ctx, IN CONST TELEMETRY_SAMPLE *Sample, IN UINT64 ElapsedTicks,
+                               IN UINT64 TscHz, IN UINTN EnergyShift) {
+  UINT64 Milli, Tenths, Micros;
+  UINTN  I;
+
+  Micros = DivU64x64Remainder (Sample->TscDelta, MAX (DivU64x32 (TscHz, 1000000), 1), NULL);
+  Tenths = DivU64x64Remainder (MultU64x32 (ElapsedTicks, 10), TscHz, NULL);
+  Print (L"%6ld.%d ", DivU64x32 (Tenths, 10), ModU64x32 (Tenths, 10));
+  for (I = 0; I < TELEMETRY_COUNTERS; I++) {
+    if (Ctx->Msr[I] == 0) continue;
+    if (Sample->TscDelta == 0 || Micros == 0) {
+      Print (L" %7s", L"-");
+    } else if (mTelemetryCounters[I].IsEnergy) {
+      Milli = DivU64x64Remainder (MultU64x32 (RShiftU64 (MultU64x32 (Sample->Delta[I], 1000), EnergyShift), 1000000),
+                                  Micros, NULL);                                         // mJ / s = mW
+      Print (L" %4ld.%02d", DivU64x32 (Milli, 1000), ModU64x32 (Milli, 1000) / 10);
+    } else {
+      Tenths = DivU64x64Remainder (MultU64x32 (MIN (Sample->Delta[I], Sample->TscDelta), 1000), Sample->TscDelta, NULL);
+      Print (L" %5ld.%d", DivU64x32 (Tenths, 10), ModU64x32 (Tenths, 10));
+    }
+  }
+  Print (L"\n");
+}
+
+//
+// Display side of the ring: drains what the sampling callback queued since the last tick.
+//
+STATIC BOOLEAN TelemetryOnDisplay (IN VOID *Context) {
+  TELEMETRY_CONTEXT      *Ctx = (TELEMETRY_CONTEXT *)Context;
+  CONST TELEMETRY_SAMPLE *Sample;
+  UINTN                  I;
+
+  while (Ctx->Tail != Ctx->Head) {
+    Sample               = &Ctx->Ring[Ctx->Tail % TELEMETRY_RING_SIZE];
+    Ctx->Elapsed        += Sample->TscDelta;
+    Ctx->Total.TscDelta += Sample->TscDelta;
+    for (I = 0; I < TELEMETRY_COUNTERS; I++) Ctx->Total.Delta[I] += Sample->Delta[I];
+    PrintTelemetryRow (Ctx, Sample, Ctx->Elapsed, Ctx->TscHz, Ctx->EnergyShift);
+    Ctx->Tail++;
+  }
   return FALSE;
 }
 
-STATIC VOID PrintBrandStringIfSupported (IN UINT32 MaxExtLeaf) {
-  if (MaxExtLeaf >= 0x80000004) {
-    CHAR8  Brand[49];
-    UINT32 *Ptr32;
-    SetMem (Brand, sizeof (Brand), 0);
-    Ptr32 = (UINT32 *)Brand;
-    AsmCpuid (0x80000002, &Ptr32[0],  &Ptr32[1],  &Ptr32[2],  &Ptr32[3]);
-    AsmCpuid (0x80000003, &Ptr32[4],  &Ptr32[5],  &Ptr32[6],  &Ptr32[7]);
-    AsmCpuid (0x80000004, &Ptr32[8],  &Ptr32[9],  &Ptr32[10], &Ptr32[11]);
-    Print (L"\nBrand String : %a\n", Brand);
+STATIC VOID DoTelemetry (VOID) {
+  TELEMETRY_CONTEXT      *Ctx;
+  FREQ_JOB               Load;
+  EFI_EVENT              Display = NULL, Timer = NULL, LoadDone = NULL;
+  EVENT_LOOP             Loop;
+  EFI_STATUS             LoadStatus = EFI_NOT_STARTED;
+  EFI_INPUT_KEY          Key;
+  UINT64                 Units = 0;
+  UINT32                 PeriodMs;
+  UINTN                  I, Present = 0;
+  BOOLEAN                IsAmd = CpuIsAmd ();
+  ShowHeaderAndMenu (MenuTelemetry);
+
+  if (!CpuSupportsMsr ()) {
+    Print (L"[ERROR] CPU does not support MSR.\n"); WaitAnyKey (); return;
+  }
+  Ctx = AllocateZeroPool (sizeof (*Ctx));
+  if (Ctx == NULL) {
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); return;
+  }
+  ZeroMem (&Load, sizeof (Load));
+
+  if (SafeReadMsr (IsAmd ? AMD_MSR_RAPL_POWER_UNIT : MSR_RAPL_POWER_UNIT, &Units)) {
+    Ctx->EnergyShift = (UINTN)RShiftU64 (Units, 8) & 0x1F;
+    Print (L"RAPL unit %016lx: energy 1/2^%d J\n", Units, (UINT32)Ctx->EnergyShift);
+  }
+  for (I = 0; I < TELEMETRY_COUNTERS; I++) {
+    Ctx->Msr[I] = IsAmd ? mTelemetryCounters[I].AmdMsr : mTelemetryCounters[I].IntelMsr;
+    if (mTelemetryCounters[I].IsEnergy && Units == 0) Ctx->Msr[I] = 0;
+    if (Ctx->Msr[I] != 0 && !SafeReadMsr (Ctx->Msr[I], &Ctx->Prev[I])) Ctx->Msr[I] = 0;
+    if (Ctx->Msr[I] != 0) Present++;
+  }
+  if (Present == 0) {
+    Print (L"[ERROR] No RAPL energy or C-state residency MSRs are readable.\n"); WaitAnyKey (); goto Exit;
+  }
+
+  if (!PromptHexUint32 (L"Sample period ms (Hex, Enter = 0x3E8): ", &PeriodMs) || PeriodMs < TELEMETRY_MIN_PERIOD_MS) {
+    PeriodMs = TELEMETRY_DEFAULT_PERIOD_MS;
+  }
+  if (mMp != NULL && !EFI_ERROR (PerCpuJobInit (&Load.Cpus, NULL, 0)) && Load.Cpus.SlotCount > 1) {
+    for (I = 0; I < FreqLoadMax; I++) Print (L"  [%d] %s\n", (UINT32)I, mFreqLoadNames[I]);
+    Print (L"Load on the APs while sampling: ");
+    if (ReadKeyBlocking (&Key) && Key.UnicodeChar > L'0' && Key.UnicodeChar < L'0' + FreqLoadMax) {
+      Load.Load = (FREQ_LOAD)(Key.UnicodeChar - L'0');
+    }
+    Print (L"%s\n", mFreqLoadNames[Load.Load]);
+  }
+
+  Ctx->TscHz = BenchTscHz ();
+  if (Load.Load == FreqLoadMemory) {
+    Load.BufferSize = MEM_BENCH_DEFAULT_SIZE;
+    Load.Buffer     = AllocatePages (EFI_SIZE_TO_PAGES (Load.BufferSize));
+    if (Load.Buffer == NULL) Load.Load = FreqLoadIdle;
+  }
+  if (Load.Load != FreqLoadIdle) {
+    Load.IntervalTicks = MultU64x32 (Ctx->TscHz, 24 * 3600);     // runs until Abort
+    LoadStatus         = FreqJobStartAps (&Load, FREQ_PHASE_START, FALSE, &LoadDone);
+  }
+
+  if (EFI_ERROR (gBS->CreateEvent (EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_NOTIFY, TelemetryTimerNotify, Ctx, &Timer)) ||
+      EFI_ERROR (gBS->CreateEvent (EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Display))) {
+    Print (L"[ERROR] Failed to create timer events.\n"); WaitAnyKey (); goto Exit;
+  }
+
+  ClearScreenAndResetAttr ();
+  Print (L"Sampling every %d ms on the BSP, any key to stop. PP0 / CCx = BSP core only.\n\n", PeriodMs);
+  PrintTelemetryHeader (Ctx);
+  DrainKeyBuffer ();
+
+  for (I = 0; I < TELEMETRY_COUNTERS; I++) {
+    if (Ctx->Msr[I] != 0) SafeReadMsr (Ctx->Msr[I], &Ctx->Prev[I]);
+  }
+  Ctx->PrevTsc = AsmReadTsc ();
+  gBS->SetTimer (Timer, TimerPeriodic, EFI_TIMER_PERIOD_MILLISECONDS (PeriodMs));
+  gBS->SetTimer (Display, TimerPeriodic, EFI_TIMER_PERIOD_MILLISECONDS (TELEMETRY_DISPLAY_MS));
+
+  EventLoopInit (&Loop);
+  EventLoopAdd (&Loop, gST->ConIn->WaitForKey, EventLoopReadKey, &Key);
+  EventLoopAdd (&Loop, Display, TelemetryOnDisplay, Ctx);
+  EventLoopRun (&Loop);
+  gBS->SetTimer (Timer, TimerCancel, 0);
+  gBS->SetTimer (Display, TimerCancel, 0);
+  DrainKeyBuffer ();
+
+  SetAttrHighlight ();
+  Print (L"\nAverage ");
+  SetAttrNormal ();
+  PrintTelemetryRow (Ctx, &Ctx->Total, Ctx->Elapsed, Ctx->TscHz, Ctx->EnergyShift);
+  if (Ctx->Dropped != 0) Print (L"[WARN] %d interval(s) dropped (ring full).\n", Ctx->Dropped);
+  WaitAnyKey ();
+
+Exit:
+  if (Timer != NULL) gBS->CloseEvent (Timer);
+  if (Display != NULL) gBS->CloseEvent (Display);
+  if (Load.Load != FreqLoadIdle) {
+    Load.Abort = TRUE;                                          // the APs see it within one load iteration
+    LoadStatus = FreqJobWait (&Load, LoadStatus, LoadDone);
+    if (Load.Cpus.Orphaned) Print (L"[WARN] Could not confirm the load APs stopped (%r).\n", LoadStatus);
+  }
+  FreqJobFree (&Load);                                          // no-op while the APs may still run
+  FreePool (Ctx);
+}
+
+//
+// =====================================================
+// MSR Watch
+// =====================================================
+//
+// Layout is drawn once; each tick only repositions the cursor over cells whose text
+// (or highlight) changed, so a 10-20 Hz refresh stays cheap on a serial console.
+//
+typedef struct {
+  UINT32  Index;
+  BOOLEAN Valid;                       // last read succeeded
+  BOOLEAN Drawn;                       // value cell painted at least once
+  UINT16  HighMask;                    // hex digits currently painted highlighted, bit 0 = leftmost
+  UINT64  Value;
+  CHAR16  Delta[MSR_WATCH_CELL_CHARS];
+  CHAR16  Rate[MSR_WATCH_CELL_CHARS];
+} MSR_WATCH_ROW;
+
+STATIC CONST UINT32 mMsrWatchDefaultMsrs[] = {
+  MSR_IA32_TIME_STAMP_COUNTER, MSR_IA32_MPERF, MSR_IA32_APERF,
+  MSR_IA32_FIXED_CTR0, MSR_IA32_FIXED_CTR0 + 1, MSR_IA32_FIXED_CTR0 + 2,
+  MSR_IA32_PERF_STATUS, MSR_IA32_THERM_STATUS, MSR_IA32_PACKAGE_THERM_STATUS
+};
+
+STATIC VOID MsrWatchDrawCell (IN UINTN Col, IN UINTN Line, IN CONST CHAR16 *Text, IN OUT CHAR16 *Shown) {
+  if (StrCmp (Text, Shown) == 0) return;
+  gST->ConOut->SetCursorPosition (gST->ConOut, Col, Line);
+  Print (L"%-20s", Text);
+  StrCpyS (Shown, MSR_WATCH_CELL_CHARS, Text);
+}
+
+//
+// Repaints only the hex digits that changed since the last tick, plus the ones that
+// were highlighted last tick and now need to drop back to normal.
+//
+STATIC VOID MsrWatchDrawValue (IN OUT MSR_WATCH_ROW *Row, IN UINTN Line, IN BOOLEAN Valid, IN UINT64 Value) {
+  CHAR16  Run[17];
+  UINTN   I, RunLen = 0;
+  UINT16  Changed = 0, Redraw;
+  BOOLEAN RunHigh = FALSE;
+
+  if (!Valid) {
+    if (Row->Valid || !Row->Drawn) {
+      gST->ConOut->SetCursorPosition (gST->ConOut, MSR_WATCH_VALUE_COL, Line);
+      Print (L"%-16s", L"#GP");
+    }
+    Row->Drawn    = TRUE;
+    Row->HighMask = 0;
+    return;
+  }
+
+  if (Row->Drawn && Row->Valid) {
+    for (I = 0; I < 16; I++) {
+      if ((RShiftU64 (Value ^ Row->Value, 60 - 4 * I) & 0xF) != 0) Changed |= (UINT16)(1 << I);
+    }
+    Redraw = Changed | Row->HighMask;
+  } else {
+    Redraw = 0xFFFF;
+  }
+
+  for (I = 0; I <= 16; I++) {
+    if (RunLen != 0 && (I == 16 || (Redraw & (1 << I)) == 0 || (((Changed >> I) & 1) != 0) != RunHigh)) {
+      Run[RunLen] = L'\0';
+      if (RunHigh) SetAttrHighlight ();
+      gST->ConOut->OutputString (gST->ConOut, Run);
+      if (RunHigh) SetAttrNormal ();
+      RunLen = 0;
+    }
+    if (I == 16 || (Redraw & (1 << I)) == 0) continue;
+    if (RunLen == 0) {
+      gST->ConOut->SetCursorPosition (gST->ConOut, MSR_WATCH_VALUE_COL + I, Line);
+      RunHigh = (BOOLEAN)(((Changed >> I) & 1) != 0);
+    }
+    Run[RunLen++] = L"0123456789abcdef"[RShiftU64 (Value, 60 - 4 * I) & 0xF];
   }
+  Row->Drawn    = TRUE;
+  Row->HighMask = Changed;
 }
 
-STATIC VOID PrintFixedMtrrDecoded8Types (IN UINT64 Val) {
-  UINTN B;
-  for (B = 0; B < 8; B++) {
-    UINT8 Type = (UINT8)((Val >> (B * 8)) & 0xFF);
-    Print (L"%s%s", MtrrTypeToShortStr (Type), (B == 7) ? L"" : L" ");
+typedef struct {
+  MSR_WATCH_ROW *Rows;
+  UINTN         Count;
+  UINTN         Ticks;
+  UINT64        TscHz;
+  UINT64        PrevTsc;
+  CHAR16        Status[MSR_WATCH_CELL_CHARS];
+} MSR_WATCH_VIEW;
+
+STATIC BOOLEAN MsrWatchOnTick (IN VOID *Context) {
+  MSR_WATCH_VIEW *View = (MSR_WATCH_VIEW *)Context;
+  MSR_WATCH_ROW  *Row;
+  UINT64         Value, Delta, Rate, Tsc, Micros;
+  UINTN          I;
+  CHAR16         Text[MSR_WATCH_CELL_CHARS];
+  BOOLEAN        Valid;
+
+  Tsc           = AsmReadTsc ();
+  Micros        = DivU64x64Remainder (Tsc - View->PrevTsc, MAX (DivU64x32 (View->TscHz, 1000000), 1), NULL);
+  View->PrevTsc = Tsc;
+  for (I = 0; I < View->Count; I++) {
+    Row   = &View->Rows[I];
+    Valid = SafeReadMsr (Row->Index, &Value);
+    MsrWatchDrawValue (Row, MSR_WATCH_FIRST_ROW + I, Valid, Value);
+    if (Valid && Row->Valid) {
+      Delta = Value - Row->Value;
+      UnicodeSPrint (Text, sizeof (Text), L"%ld", (INT64)Delta);
+      MsrWatchDrawCell (MSR_WATCH_DELTA_COL, MSR_WATCH_FIRST_ROW + I, Text, Row->Delta);
+      if ((INT64)Delta < 0 || Micros == 0) {
+        StrCpyS (Text, MSR_WATCH_CELL_CHARS, L"-");
+      } else {
+        Rate = (Delta <= DivU64x32 (MAX_UINT64, 1000000)) ?
+               DivU64x64Remainder (MultU64x32 (Delta, 1000000), Micros, NULL) :
+               MultU64x32 (DivU64x64Remainder (Delta, Micros, NULL), 1000000);
+        UnicodeSPrint (Text, sizeof (Text), L"%ld", Rate);
+      }
+    } else {
+      StrCpyS (Text, MSR_WATCH_CELL_CHARS, L"-");
+      MsrWatchDrawCell (MSR_WATCH_DELTA_COL, MSR_WATCH_FIRST_ROW + I, Text, Row->Delta);
+    }
+    MsrWatchDrawCell (MSR_WATCH_RATE_COL, MSR_WATCH_FIRST_ROW + I, Text, Row->Rate);
+    Row->Valid = Valid;
+    if (Valid) Row->Value = Value;
+  }
+  View->Ticks++;
+  UnicodeSPrint (Text, sizeof (Text), L"tick %d, %ld us", (UINT32)View->Ticks, Micros);
+  MsrWatchDrawCell (0, MSR_WATCH_FIRST_ROW - 2, Text, View->Status);
+  return FALSE;
+}
+
+STATIC VOID DoMsrWatch (VOID) {
+  MSR_WATCH_VIEW View;
+  EVENT_LOOP     Loop;
+  EFI_EVENT      Timer;
+  EFI_INPUT_KEY  Key;
+  UINT32         MsrList[PERCPU_MSR_MAX], Hz;
+  UINT64         Value;
+  UINTN          MsrCount, I;
+  CHAR16         Input[MSR_LIST_INPUT_LEN];
+  BOOLEAN        Valid;
+  ShowHeaderAndMenu (MenuMsrWatch);
+
+  if (!CpuSupportsMsr ()) {
+    Print (L"[ERROR] CPU does not support MSR.\n"); WaitAnyKey (); return;
+  }
+  Print (L"Enter MSR list (Hex, max %d, Enter = TSC/MPERF/APERF/FIXED/THERM): ", PERCPU_MSR_MAX);
+  if (!ReadLine (Input, MSR_LIST_INPUT_LEN)) return;
+  if (Input[0] == L'\0') {
+    MsrCount = sizeof (mMsrWatchDefaultMsrs) / sizeof (mMsrWatchDefaultMsrs[0]);
+    CopyMem (MsrList, mMsrWatchDefaultMsrs, sizeof (mMsrWatchDefaultMsrs));
+  } else {
+    MsrCount = ParseHexList32 (Input, MsrList, PERCPU_MSR_MAX);
+    if (MsrCount == 0) {
+      Print (L"Invalid MSR list.\n"); WaitAnyKey (); return;
+    }
+  }
+  if (!PromptHexUint32 (L"Refresh rate Hz (Hex, Enter = 0xA): ", &Hz) || Hz == 0) {
+    Hz = MSR_WATCH_DEFAULT_HZ;
+  }
+  Hz = MIN (Hz, MSR_WATCH_MAX_HZ);
+  if (MsrCount > mScreen.Rows - MSR_WATCH_FIRST_ROW - 1) {
+    MsrCount = mScreen.Rows - MSR_WATCH_FIRST_ROW - 1;
+  }
+
+  ZeroMem (&View, sizeof (View));
+  View.Count = MsrCount;
+  View.Rows  = AllocateZeroPool (MsrCount * sizeof (MSR_WATCH_ROW));
+  if (View.Rows == NULL) {
+    Print (L"[ERROR] Out of resources.\n"); WaitAnyKey (); return;
+  }
+  if (EFI_ERROR (gBS->CreateEvent (EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Timer))) {
+    Print (L"[ERROR] Failed to create timer event.\n"); WaitAnyKey (); FreePool (View.Rows); return;
+  }
+  View.TscHz = BenchTscHz ();
+
+  ClearScreenAndResetAttr ();
+  gST->ConOut->EnableCursor (gST->ConOut, FALSE);
+  Print (L"MSR Watch on the BSP, %d Hz, any key to stop. Changed digits are highlighted.\n\n", Hz);
+  Print (L"MSR       Value             Delta/interval       Rate/s\n");
+  for (I = 0; I < MsrCount; I++) {
+    View.Rows[I].Index = MsrList[I];
+    gST->ConOut->SetCursorPosition (gST->ConOut, 0, MSR_WATCH_FIRST_ROW + I);
+    Print (L"%08x", MsrList[I]);
+    Valid = SafeReadMsr (MsrList[I], &Value);
+    MsrWatchDrawValue (&View.Rows[I], MSR_WATCH_FIRST_ROW + I, Valid, Value);
+    View.Rows[I].Valid = Valid;
+    View.Rows[I].Value = Value;
   }
+  DrainKeyBuffer ();
+  View.PrevTsc = AsmReadTsc ();
+  gBS->SetTimer (Timer, TimerPeriodic, EFI_TIMER_PERIOD_MILLISECONDS (1000 / Hz));
+
+  EventLoopInit (&Loop);
+  EventLoopAdd (&Loop, gST->ConIn->WaitForKey, EventLoopReadKey, &Key);
+  EventLoopAdd (&Loop, Timer, MsrWatchOnTick, &View);
+  EventLoopRun (&Loop);
+
+  gBS->SetTimer (Timer, TimerCancel, 0);
+  gBS->CloseEvent (Timer);
+  DrainKeyBuffer ();
+  FreePool (View.Rows);
+
+  gST->ConOut->SetCursorPosition (gST->ConOut, 0, MSR_WATCH_FIRST_ROW + MsrCount);
+  gST->ConOut->EnableCursor (gST->ConOut, TRUE);
+  WaitAnyKey ();
 }
 
 //
 // =====================================================
-// Feature Implementation 
+// Capture Export (CSV / JSON on the ESP)
 // =====================================================
 //
-STATIC VOID DumpMtrrUiLikePhoto_VariableRanges (VOID) {
-  UINT64 MtrrCap;
-  UINT8  VariableCount;
-  UINTN  I;
-  
-  if (!SafeReadMsr (MSR_IA32_MTRRCAP, &MtrrCap)) return;
-  
-  VariableCount = (UINT8)(MtrrCap & IA32_MTRRCAP_VCNT_MASK);
-  if (VariableCount > 10) VariableCount = 10;
+// Records are formatted as ASCII into one large buffer and written to the boot volume
+// a few MB at a time, so a full capture costs a handful of File->Write calls instead
+// of one console round trip per line. The first write error is sticky and reported
+// by ExportClose.
+//
+STATIC CONST CHAR16 *mExportExtensions[ExportFormatMax] = { L"csv", L"json" };
 
-  Print (L"=== [ Variable Range MTRRs ] ===\n");
-  Print (L"MTRR | Idx  | PHYSBASE (Type)                  | PHYSMASK (Valid)               | Status\n");
-  Print (L"-----+------+--------------------------------+--------------------------------+----------------\n");
+STATIC EFI_STATUS ExportOpen (OUT EXPORT_SINK *Sink, IN EXPORT_FORMAT Format, OUT CHAR16 *Path, IN UINTN PathChars) {
+  EFI_STATUS        Status;
+  EFI_FILE_PROTOCOL *Root, *Dir, *File;
 
-  for (I = 0; I < 10; I++) {
-    UINT64  BaseVal = 0, MaskVal = 0;
-    UINT8   Type = 0;
-    BOOLEAN Valid = FALSE;
-    UINT32  BaseMsr, MaskMsr;
+  ZeroMem (Sink, sizeof (*Sink));
+  Sink->Format = Format;
+  Sink->Size   = EXPORT_BUFFER_SIZE;
+  Sink->Buffer = AllocatePool (Sink->Size);
+  if (Sink->Buffer == NULL) return EFI_OUT_OF_RESOURCES;
+
+  UnicodeSPrint (Path, PathChars * sizeof (CHAR16), L"%s\\Capture-%08X-%08X.%s",
+                 MSR_CACHE_DIR, mCpuidDb.Signature, GetMicrocodeRevision (), mExportExtensions[Format]);
+
+  Status = OpenBootVolumeRoot (&Root);
+  if (EFI_ERROR (Status)) { FreePool (Sink->Buffer); return Status; }
+  Status = Root->Open (Root, &Dir, MSR_CACHE_DIR, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, EFI_FILE_DIRECTORY);
+  if (!EFI_ERROR (Status)) Dir->Close (Dir);
+
+  // Replace any earlier capture outright rather than overwrite its head
+  Status = Root->Open (Root, &File, Path, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+  if (!EFI_ERROR (Status)) File->Delete (File);
+  Status = Root->Open (Root, &Sink->File, Path, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+  Root->Close (Root);
+  if (EFI_ERROR (Status)) FreePool (Sink->Buffer);
+  return Status;
+}
 
-    if (I < VariableCount) {
-      BaseMsr = MSR_IA32_MTRR_PHYSBASE0 + (UINT32)(I * 2);
-      MaskMsr = MSR_IA32_MTRR_PHYSMASK0 + (UINT32)(I * 2);
-      SafeReadMsr(BaseMsr, &BaseVal);
-      SafeReadMsr(MaskMsr, &MaskVal);
-      Type  = (UINT8)(BaseVal & 0xFF);
-      Valid = (BOOLEAN)((MaskVal & BIT11) != 0);
-    } 
+STATIC VOID ExportFlush (IN OUT EXPORT_SINK *Sink) {
+  UINTN Size = Sink->Used;
 
-    Print (L"MTRR | 0x%02x | %016lx (%-24s) | %016lx (Valid:%d) | %s\n",
-           (UINT32)I, BaseVal, MtrrTypeToStr (Type), MaskVal, Valid ? 1 : 0, Valid ? L"ENABLED" : L"DISABLED");
+  if (Size != 0 && !EFI_ERROR (Sink->Status)) {
+    Sink->Status = Sink->File->Write (Sink->File, &Size, Sink->Buffer);
+    if (!EFI_ERROR (Sink->Status) && Size != Sink->Used) Sink->Status = EFI_VOLUME_FULL;
+    Sink->Written += Size;
+    Sink->Writes++;
   }
-  Print (L"\n");
+  Sink->Used = 0;
 }
 
-STATIC VOID DumpMtrrUiLikePhoto_FixedRanges (VOID) {
-  UINT64  MtrrCap, MtrrDef;
-  BOOLEAN FixSupported, MtrrEnabled, FixEnabled;
-  CONST UINT32 FixedMsrList[] = {
-    MSR_IA32_MTRR_FIX64K_00000, MSR_IA32_MTRR_FIX16K_80000, MSR_IA32_MTRR_FIX16K_A0000,
-    MSR_IA32_MTRR_FIX4K_C0000,  MSR_IA32_MTRR_FIX4K_C8000,  MSR_IA32_MTRR_FIX4K_D0000,
-    MSR_IA32_MTRR_FIX4K_D8000,  MSR_IA32_MTRR_FIX4K_E0000,  MSR_IA32_MTRR_FIX4K_E8000,
-    MSR_IA32_MTRR_FIX4K_F0000,  MSR_IA32_MTRR_FIX4K_F8000
-  };
-  UINTN I;
+STATIC VOID ExportPrint (IN OUT EXPORT_SINK *Sink, IN CONST CHAR8 *Format, ...) {
+  VA_LIST Marker;
 
-  if (!SafeReadMsr(MSR_IA32_MTRRCAP, &MtrrCap)) return;
-  if (!SafeReadMsr(MSR_IA32_MTRR_DEF_TYPE, &MtrrDef)) return;
+  if (Sink->Size - Sink->Used < EXPORT_LINE_MAX) ExportFlush (Sink);
+  VA_START (Marker, Format);
+  Sink->Used += AsciiVSPrint (Sink->Buffer + Sink->Used, Sink->Size - Sink->Used, Format, Marker);
+  VA_END (Marker);
+}
 
-  FixSupported = (BOOLEAN)((MtrrCap & IA32_MTRRCAP_FIX_BIT) != 0);
-  MtrrEnabled  = (BOOLEAN)((MtrrDef & IA32_MTRR_DEF_TYPE_E_BIT) != 0);
-  FixEnabled   = (BOOLEAN)((MtrrDef & IA32_MTRR_DEF_TYPE_FE_BIT) != 0);
+STATIC EFI_STATUS ExportClose (IN OUT EXPORT_SINK *Sink) {
+  EFI_STATUS Status;
 
-  Print (L"=== [ Fixed Range MTRRs ] ===\n");
+  ExportFlush (Sink);
+  Status = Sink->File->Close (Sink->File);
+  FreePool (Sink->Buffer);
+  return EFI_ERROR (Sink->Status) ? Sink->Status : Status;
+}
 
-  if (!FixSupported) {
-    Print (L"Fixed MTRR not supported.\n\n");
-    return;
+//
+// CSV is one flat table (the kind column says which fields apply); JSON gets one
+// array per section under a single top-level object.
+//
+STATIC VOID ExportBeginSection (IN OUT EXPORT_SINK *Sink, IN CONST CHAR8 *Name) {
+  Sink->Records = 0;
+  if (Sink->Format == ExportJson) ExportPrint (Sink, ",\n  \"%a\": [", Name);
+}
+
+STATIC VOID ExportEndSection (IN OUT EXPORT_SINK *Sink) {
+  if (Sink->Format == ExportJson) ExportPrint (Sink, "\n  ]");
+}
+
+STATIC VOID ExportCpuidEntry (IN OUT EXPORT_SINK *Sink, IN CONST CPUID_DB_ENTRY *Entry) {
+  if (Sink->Format == ExportCsv) {
+    ExportPrint (Sink, "cpuid,0x%08x,0x%08x,0x%08x,0x%08x,0x%08x,0x%08x,\n",
+                 Entry->Leaf, Entry->SubLeaf, Entry->Eax, Entry->Ebx, Entry->Ecx, Entry->Edx);
+  } else {
+    ExportPrint (Sink, "%a\n    {\"leaf\": \"0x%08x\", \"subleaf\": \"0x%08x\", \"eax\": \"0x%08x\", "
+                 "\"ebx\": \"0x%08x\", \"ecx\": \"0x%08x\", \"edx\": \"0x%08x\"}", (Sink->Records == 0) ? "" : ",",
+                 Entry->Leaf, Entry->SubLeaf, Entry->Eax, Entry->Ebx, Entry->Ecx, Entry->Edx);
   }
+  Sink->Records++;
+}
 
-  if (!MtrrEnabled || !FixEnabled) {
-    Print (L"Fixed MTRR supported but disabled (E=%d, FE=%d).\n\n", MtrrEnabled ? 1 : 0, FixEnabled ? 1 : 0);
-    return;
+STATIC VOID ExportMsrValue (IN OUT EXPORT_SINK *Sink, IN CONST CHAR8 *Kind, IN UINT32 Index, IN UINT64 Value) {
+  if (Sink->Format == ExportCsv) {
+    ExportPrint (Sink, "%a,0x%08x,,,,,,0x%016lx\n", Kind, Index, Value);
+  } else {
+    ExportPrint (Sink, "%a\n    {\"index\": \"0x%08x\", \"value\": \"0x%016lx\"}", (Sink->Records == 0) ? "" : ",",
+                 Index, Value);
   }
+  Sink->Records++;
+}
 
-  Print (L"MSR | MSR Addr | Value (64-bit Hex)   | Decoded Memory Types (8 Bytes)\n");
-  Print (L"----+----------+----------------------+----------------------------------------\n");
+//
+// Same cache-assisted walk as DumpMsrRange; only MSRs that read back are exported.
+//
+STATIC UINTN ExportMsrRange (IN OUT EXPORT_SINK *Sink, IN UINT32 StartMsr, IN UINT32 EndMsr) {
+  UINT32 Msr = StartMsr;
+  UINT64 Remaining = (UINT64)EndMsr - StartMsr + 1;
+  UINTN  Chunk, I, J, ListCount, Valid = 0;
 
-  for (I = 0; I < sizeof (FixedMsrList) / sizeof (FixedMsrList[0]); I++) {
-    UINT64 Val = 0;
-    SafeReadMsr(FixedMsrList[I], &Val);
-    Print (L"MSR | 0x%03x    | %016lx | ", FixedMsrList[I], Val);
-    PrintFixedMtrrDecoded8Types (Val);
-    Print (L"\n");
+  MsrCacheLoad ();
+  ExportBeginSection (Sink, "msr");
+  while (Remaining > 0) {
+    Chunk     = (Remaining > MSR_BATCH_CHUNK) ? MSR_BATCH_CHUNK : (UINTN)Remaining;
+    ListCount = 0;
+    for (I = 0; I < Chunk; I++) {
+      if (MsrCacheLookup (Msr + (UINT32)I) != MsrCacheInvalid) mMsrBatchIndices[ListCount++] = Msr + (UINT32)I;
+    }
+    SafeReadMsrList (mMsrBatchIndices, ListCount, mMsrBatchValues, mMsrBatchFaults);
+    MsrCacheRecordBatch (Msr, Chunk, mMsrBatchIndices, ListCount, mMsrBatchFaults);
+    for (J = 0; J < ListCount; J++) {
+      if (MSR_BITMAP_TEST (mMsrBatchFaults, J)) continue;
+      ExportMsrValue (Sink, "msr", mMsrBatchIndices[J], mMsrBatchValues[J]);
+      Valid++;
+    }
+    Msr       += (UINT32)Chunk;
+    Remaining -= Chunk;
   }
-  Print (L"\n");
+  ExportEndSection (Sink);
+  MsrCacheSave ();
+  return Valid;
 }
 
-STATIC VOID DoCpuId (VOID) {
-  UINT32 Leaf, Eax, Ebx, Ecx, Edx;
-  ShowHeaderAndMenu (MenuCpuId);
+STATIC VOID ExportMtrr (IN OUT EXPORT_SINK *Sink) {
+  MTRR_SNAPSHOT Snap;
+  UINTN         I;
 
-  if (!PromptHexUint32 (L"Enter Function Number (Hex): ", &Leaf)) {
-    Print (L"Invalid input.\n"); WaitAnyKey (); return;
+  if (!CpuSupportsMtrr () || EFI_ERROR (MtrrSnapshotRead (&Snap))) return;
+  ExportBeginSection (Sink, "mtrr");
+  ExportMsrValue (Sink, "mtrr", MSR_IA32_MTRRCAP, Snap.Cap);
+  ExportMsrValue (Sink, "mtrr", MSR_IA32_MTRR_DEF_TYPE, Snap.DefType);
+  if (Snap.FixedValid) {
+    for (I = 0; I < MTRR_FIXED_MSR_COUNT; I++) ExportMsrValue (Sink, "mtrr", mMtrrFixedMsrs[I], Snap.Fixed[I]);
   }
-  AsmCpuid (Leaf, &Eax, &Ebx, &Ecx, &Edx);
-  Print (L"RegisterEax : %08x\nRegisterEbx : %08x\nRegisterEcx : %08x\nRegisterEdx : %08x\n", Eax, Ebx, Ecx, Edx);
+  for (I = 0; I < Snap.VariableCount; I++) {
+    ExportMsrValue (Sink, "mtrr", MSR_IA32_MTRR_PHYSBASE0 + (UINT32)(I * 2), Snap.Variables[I].Base);
+    ExportMsrValue (Sink, "mtrr", MSR_IA32_MTRR_PHYSMASK0 + (UINT32)(I * 2), Snap.Variables[I].Mask);
+  }
+  ExportEndSection (Sink);
+  MtrrSnapshotFree (&Snap);
+}
 
-  if (Leaf == 0) {
-    CHAR8 Vendor[13];
-    *(UINT32 *)&Vendor[0] = Ebx; *(UINT32 *)&Vendor[4] = Edx; *(UINT32 *)&Vendor[8] = Ecx; Vendor[12] = '\0';
-    Print (L"Vendor      : %a\n", Vendor);
+//
+// CPUID database, the valid MSRs in [StartMsr, EndMsr] and the MTRRs in one file.
+//
+STATIC EFI_STATUS ExportCapture (IN EXPORT_FORMAT Format, IN UINT32 StartMsr, IN UINT32 EndMsr) {
+  EXPORT_SINK Sink;
+  EFI_STATUS  Status;
+  CHAR16      Path[EXPORT_PATH_LEN];
+  UINT64      Start, TscHz;
+  UINTN       I, MsrCount = 0;
+
+  TscHz = BenchTscHz ();
+  Start = AsmReadTsc ();
+  Status = ExportOpen (&Sink, Format, Path, EXPORT_PATH_LEN);
+  if (EFI_ERROR (Status)) {
+    Print (L"[ERROR] Cannot create capture file on the boot volume (%r).\n", Status);
+    return Status;
   }
 
-  if (Leaf == 1) {
-    Print (L"Feature(MSR)  EDX.BIT5  : %d\n", ((Edx & CPUID_FEAT_EDX_MSR)  != 0) ? 1 : 0);
-    Print (L"Feature(MTRR) EDX.BIT12 : %d\n", ((Edx & CPUID_FEAT_EDX_MTRR) != 0) ? 1 : 0);
-    Print (L"Feature(TSC)  EDX.BIT4  : %d\n", ((Edx & CPUID_FEAT_EDX_TSC)  != 0) ? 1 : 0);
+  if (Format == ExportCsv) {
+    ExportPrint (&Sink, "kind,index,subleaf,eax,ebx,ecx,edx,value\n");
+  } else {
+    ExportPrint (&Sink, "{\n  \"vendor\": \"%a\",\n  \"signature\": \"0x%08x\",\n  \"microcode\": \"0x%08x\"",
+                 mCpuidDb.Vendor, mCpuidDb.Signature, GetMicrocodeRevision ());
+  }
+  ExportBeginSection (&Sink, "cpuid");
+  for (I = 0; I < mCpuidDb.Count; I++) ExportCpuidEntry (&Sink, &mCpuidDb.Entries[I]);
+  ExportEndSection (&Sink);
+  if (CpuSupportsMsr ()) {
+    MsrCount = ExportMsrRange (&Sink, StartMsr, EndMsr);
+    ExportMtrr (&Sink);
+  }
+  if (Format == ExportJson) ExportPrint (&Sink, "\n}\n");
+
+  Status = ExportClose (&Sink);
+  if (EFI_ERROR (Status)) {
+    Print (L"[ERROR] Writing %s failed (%r).\n", Path, Status);
+    return Status;
+  }
+  Print (L"%s: %d CPUID entries, %d MSRs, %ld bytes in %d write(s), %ld ms\n", Path, (UINT32)mCpuidDb.Count,
+         (UINT32)MsrCount, Sink.Written, (UINT32)Sink.Writes, DivU64x64Remainder (MultU64x32 (AsmReadTsc () - Start, 1000), TscHz, NULL));
+  return EFI_SUCCESS;
+}
+
+STATIC VOID DoExportCapture (VOID) {
+  EFI_INPUT_KEY Key;
+  EXPORT_FORMAT Format;
+  UINT32        StartMsr, EndMsr;
+  ShowHeaderAndMenu (MenuExportCapture);
+
+  Print (L"Format [C]SV or [J]SON: ");
+  if (!ReadKeyBlocking (&Key)) return;
+  Format = (Key.UnicodeChar == L'j' || Key.UnicodeChar == L'J') ? ExportJson : ExportCsv;
+  Print (L"%s\n", (Format == ExportJson) ? L"JSON" : L"CSV");
+  if (!PromptHexUint32 (L"Start MSR Index (Hex, Enter = 0x0): ", &StartMsr)) StartMsr = 0;
+  if (!PromptHexUint32 (L"End   MSR Index (Hex, Enter = 0x1FFF): ", &EndMsr)) EndMsr = EXPORT_DEFAULT_MSR_END;
+  if (EndMsr < StartMsr) {
+    Print (L"[ERROR] End MSR must be >= Start MSR.\n"); WaitAnyKey (); return;
   }
+  ExportCapture (Format, StartMsr, EndMsr);
   WaitAnyKey ();
 }
 
-STATIC VOID DoDumpCpuId (VOID) {
-  UINT32 MaxBasic, MaxExt, Eax, Ebx, Ecx, Edx, Leaf;
-  UINTN  LineCount;
-  CHAR8  Vendor[13];
-  ShowHeaderAndMenu (MenuDumpCpuId);
+//
+// =====================================================
+// Command Line / Script Mode
+// =====================================================
+//
+// "CpuId.efi <command> [args]" runs one command and exits with its status instead of
+// entering the menu, so startup.nsh can collect data unattended. "script <file>" runs
+// one command per line ('#' starts a comment). Paging and key waits are off throughout.
+//
+typedef EFI_STATUS (*CLI_HANDLER)(IN UINTN Argc, IN CHAR16 **Argv);
 
-  AsmCpuid (0, &Eax, &Ebx, &Ecx, &Edx);
-  MaxBasic = Eax;
-  *(UINT32 *)&Vendor[0] = Ebx; *(UINT32 *)&Vendor[4] = Edx; *(UINT32 *)&Vendor[8] = Ecx; Vendor[12] = '\0';
+typedef struct {
+  CONST CHAR16 *Name;
+  UINTN        MinArgs;                // not counting the command name
+  UINTN        MaxArgs;
+  CLI_HANDLER  Handler;
+  CONST CHAR16 *Usage;
+} CLI_COMMAND;
 
-  Print (L"[CPUID Basic]\nMax Basic Leaf : 0x%08x\nVendor         : %a\n\n", MaxBasic, Vendor);
-  PrintCpuidTableHeader ();
-  LineCount = 2;
+STATIC EFI_SHELL_PROTOCOL *mShell      = NULL;
+STATIC UINTN              mScriptDepth = 0;
+
+STATIC EFI_STATUS CliRunLine (IN CHAR16 *Line);
 
-  for (Leaf = 0; Leaf <= MaxBasic; Leaf++) {
-    if (PrintOneCpuidLeafLine (Leaf, 0, &LineCount)) return;
-    if (Leaf == 0xFFFFFFFFu) break;
+STATIC BOOLEAN CliParseHex (IN CONST CHAR16 *Arg, IN UINT64 Max, OUT UINT64 *Value) {
+  if (!ParseHex16ToUint64 (Arg, Value) || *Value > Max) {
+    Print (L"[ERROR] Invalid hex value '%s'.\n", Arg);
+    return FALSE;
   }
+  return TRUE;
+}
 
-  AsmCpuid (0x80000000, &Eax, &Ebx, &Ecx, &Edx);
-  MaxExt = Eax;
+STATIC EFI_STATUS CliCpuid (IN UINTN Argc, IN CHAR16 **Argv) {
+  UINT64 Leaf, SubLeaf = 0;
 
-  Print (L"\n[CPUID Extended]\n");
-  if (PageLineAccountingEx (&LineCount, PrintCpuidTableHeader, 2)) return;
-  Print (L"Max Ext Leaf   : 0x%08x\n", MaxExt);
-  if (PageLineAccountingEx (&LineCount, PrintCpuidTableHeader, 2)) return;
-  PrintCpuidTableHeader ();
-  LineCount = 2;
+  if (Argc == 1) {
+    DumpCpuidDb ();
+    return EFI_SUCCESS;
+  }
+  if (!CliParseHex (Argv[1], MAX_UINT32, &Leaf)) return EFI_INVALID_PARAMETER;
+  if (Argc > 2 && !CliParseHex (Argv[2], MAX_UINT32, &SubLeaf)) return EFI_INVALID_PARAMETER;
+  PrintCpuidQuery ((UINT32)Leaf, (UINT32)SubLeaf);
+  return EFI_SUCCESS;
+}
 
-  if (MaxExt >= 0x80000000) {
-    for (Leaf = 0x80000000; Leaf <= MaxExt; Leaf++) {
-      if (PrintOneCpuidLeafLine (Leaf, 0, &LineCount)) return;
-      if (Leaf == 0xFFFFFFFFu) break;
+STATIC EFI_STATUS CliRdmsr (IN UINTN Argc, IN CHAR16 **Argv) {
+  UINT64     Index, Value;
+  UINTN      I;
+  EFI_STATUS Status = EFI_SUCCESS;
+
+  if (!CpuSupportsMsr ()) return EFI_UNSUPPORTED;
+  for (I = 1; I < Argc; I++) {
+    if (!CliParseHex (Argv[I], MAX_UINT32, &Index)) return EFI_INVALID_PARAMETER;
+    if (SafeReadMsr ((UINT32)Index, &Value)) {
+      Print (L"%08x   %016lx\n", (UINT32)Index, Value);
+    } else {
+      Print (L"%08x   [Invalid / #GP]\n", (UINT32)Index);
+      Status = EFI_DEVICE_ERROR;
     }
   }
-  PrintBrandStringIfSupported (MaxExt);
-  WaitAnyKey ();
+  return Status;
 }
 
-STATIC VOID DoReadMsr (VOID) {
-  UINT32 MsrIndex;
-  UINT64 MsrData;
-  ShowHeaderAndMenu (MenuReadMsr);
+STATIC EFI_STATUS CliDumpMsr (IN UINTN Argc, IN CHAR16 **Argv) {
+  UINT64 Start, End;
 
-  if (!CpuSupportsMsr ()) {
-    Print (L"[ERROR] CPU does not support MSR.\n"); WaitAnyKey (); return;
+  if (!CpuSupportsMsr ()) return EFI_UNSUPPORTED;
+  if (!CliParseHex (Argv[1], MAX_UINT32, &Start) || !CliParseHex (Argv[2], MAX_UINT32, &End)) {
+    return EFI_INVALID_PARAMETER;
   }
-  if (!PromptHexUint32 (L"Enter MSR Index (Hex): ", &MsrIndex)) {
-    Print (L"Invalid input.\n"); WaitAnyKey (); return;
+  if (End < Start) {
+    Print (L"[ERROR] End MSR must be >= Start MSR.\n");
+    return EFI_INVALID_PARAMETER;
   }
-  
-  if (SafeReadMsr (MsrIndex, &MsrData)) {
-    Print (L"MSR_Data : %016lx\n", MsrData);
-  } else {
-    Print (L"[ERROR] #GP Fault! MSR 0x%08x is invalid or reserved.\n", MsrIndex);
+  DumpMsrRange ((UINT32)Start, (UINT32)End);
+  return EFI_SUCCESS;
+}
+
+//
+// No Y/N confirmation here: the command line (or script) is the confirmation.
+//
+STATIC EFI_STATUS CliWrmsr (IN UINTN Argc, IN CHAR16 **Argv) {
+  UINT64 Index, Value;
+
+  if (!CpuSupportsMsr ()) return EFI_UNSUPPORTED;
+  if (!CliParseHex (Argv[1], MAX_UINT32, &Index) || !CliParseHex (Argv[2], MAX_UINT64, &Value)) {
+    return EFI_INVALID_PARAMETER;
   }
-  WaitAnyKey ();
+  return WriteMsrReadBack ((UINT32)Index, Value);
 }
 
-STATIC VOID DoDumpMsr (VOID) {
-  UINT32 StartMsr, EndMsr, Msr;
-  UINT64 Value;
-  UINTN  LineCount;
-  ShowHeaderAndMenu (MenuDumpMsr);
+STATIC EFI_STATUS CliMtrr (IN UINTN Argc, IN CHAR16 **Argv) {
+  return DumpMtrr ();
+}
 
-  if (!CpuSupportsMsr ()) {
-    Print (L"[ERROR] CPU does not support MSR.\n"); WaitAnyKey (); return;
+STATIC EFI_STATUS CliScript (IN UINTN Argc, IN CHAR16 **Argv) {
+  SHELL_FILE_HANDLE File;
+  UINT64            FileSize;
+  UINTN             Size, I, LineNo = 0;
+  UINT8             *Raw;
+  CHAR16            *Text, *Line, *Next;
+  EFI_STATUS        Status, First = EFI_SUCCESS;
+
+  if (mShell == NULL) {
+    Print (L"[ERROR] UEFI Shell protocol not available.\n");
+    return EFI_UNSUPPORTED;
   }
-  if (!PromptHexUint32 (L"Enter Start MSR Index (Hex): ", &StartMsr)) {
-    Print (L"Invalid start MSR index.\n"); WaitAnyKey (); return;
+  if (mScriptDepth >= CLI_MAX_SCRIPT_DEPTH) {
+    Print (L"[ERROR] Scripts nested too deeply.\n");
+    return EFI_ABORTED;
   }
-  if (!PromptHexUint32 (L"Enter End   MSR Index (Hex): ", &EndMsr)) {
-    Print (L"Invalid end MSR index.\n"); WaitAnyKey (); return;
+  Status = mShell->OpenFileByName (Argv[1], &File, EFI_FILE_MODE_READ);
+  if (EFI_ERROR (Status)) {
+    Print (L"[ERROR] Cannot open %s (%r).\n", Argv[1], Status);
+    return Status;
   }
-  if (EndMsr < StartMsr) {
-    Print (L"[ERROR] End MSR must be >= Start MSR.\n"); WaitAnyKey (); return;
+  Status = mShell->GetFileSize (File, &FileSize);
+  if (!EFI_ERROR (Status) && FileSize > CLI_MAX_SCRIPT_SIZE) Status = EFI_BAD_BUFFER_SIZE;
+  Raw = NULL;
+  if (!EFI_ERROR (Status)) {
+    Size = (UINTN)FileSize;
+    Raw  = AllocateZeroPool (Size + sizeof (CHAR16));
+    Status = (Raw == NULL) ? EFI_OUT_OF_RESOURCES : mShell->ReadFile (File, &Size, Raw);
+  }
+  mShell->CloseFile (File);
+  if (EFI_ERROR (Status)) {
+    Print (L"[ERROR] Cannot read %s (%r).\n", Argv[1], Status);
+    if (Raw != NULL) FreePool (Raw);
+    return Status;
   }
 
-  PrintMsrTableHeader ();
-  LineCount = 2;
+  //
+  // UCS-2 with a BOM (what the shell's edit writes) or plain ASCII.
+  //
+  if (Size >= 2 && Raw[0] == 0xFF && Raw[1] == 0xFE) {
+    Text = (CHAR16 *)(Raw + 2);
+  } else {
+    Text = AllocatePool ((Size + 1) * sizeof (CHAR16));
+    if (Text == NULL) {
+      FreePool (Raw);
+      return EFI_OUT_OF_RESOURCES;
+    }
+    for (I = 0; I < Size; I++) Text[I] = (CHAR16)Raw[I];
+    Text[Size] = L'\0';
+  }
 
-  for (Msr = StartMsr; Msr <= EndMsr; Msr++) {
-    if (SafeReadMsr (Msr, &Value)) {
-      Print (L"%08x   %016lx\n", Msr, Value);
-    } else {
-      SetAttrHighlight();
-      Print (L"%08x   [Invalid / #GP]\n", Msr);
-      SetAttrNormal();
+  mScriptDepth++;
+  for (Line = Text; *Line != L'\0'; Line = Next) {
+    for (Next = Line; *Next != L'\0' && *Next != L'\n'; Next++);
+    if (*Next == L'\n') *Next++ = L'\0';
+    LineNo++;
+    Status = CliRunLine (Line);
+    if (EFI_ERROR (Status)) {
+      Print (L"[ERROR] %s line %d: %r\n", Argv[1], (UINT32)LineNo, Status);
+      if (!EFI_ERROR (First)) First = Status;             // keep going, report the first failure
     }
-    
-    if (PageLineAccountingEx (&LineCount, PrintMsrTableHeader, 2)) return;
-    if (Msr == 0xFFFFFFFFu) break;
   }
-  WaitAnyKey ();
+  mScriptDepth--;
+
+  if ((UINT8 *)Text != Raw + 2) FreePool (Text);
+  FreePool (Raw);
+  return First;
 }
 
-STATIC VOID DoWriteMsr (VOID) {
-  UINT32        MsrIndex;
-  UINT64        MsrData;
-  EFI_INPUT_KEY Key;
-  ShowHeaderAndMenu (MenuWriteMsr);
+STATIC EFI_STATUS CliExport (IN UINTN Argc, IN CHAR16 **Argv) {
+  EXPORT_FORMAT Format;
+  UINT64        Start = 0, End = EXPORT_DEFAULT_MSR_END;
 
-  if (!CpuSupportsMsr ()) {
-    Print (L"[ERROR] CPU does not support MSR.\n"); WaitAnyKey (); return;
+  if (StrCmp (Argv[1], L"csv") == 0) {
+    Format = ExportCsv;
+  } else if (StrCmp (Argv[1], L"json") == 0) {
+    Format = ExportJson;
+  } else {
+    Print (L"[ERROR] Unknown format '%s' (csv or json).\n", Argv[1]);
+    return EFI_INVALID_PARAMETER;
   }
-
-  if (!PromptHexUint32 (L"Enter MSR Index (Hex): ", &MsrIndex)) {
-    Print (L"Invalid MSR index.\n"); WaitAnyKey (); return;
+  if (Argc == 3) {
+    Print (L"[ERROR] Give both start and end MSR.\n");
+    return EFI_INVALID_PARAMETER;
   }
-  if (!PromptHexUint64 (L"Enter MSR Data  (Hex): ", &MsrData)) {
-    Print (L"Invalid MSR data.\n"); WaitAnyKey (); return;
+  if (Argc == 4 && (!CliParseHex (Argv[2], MAX_UINT32, &Start) || !CliParseHex (Argv[3], MAX_UINT32, &End) || End < Start)) {
+    return EFI_INVALID_PARAMETER;
   }
+  return ExportCapture (Format, (UINT32)Start, (UINT32)End);
+}
 
-  Print (L"Confirm write MSR[0x%X] = 0x%016lx ? (Y/N): ", MsrIndex, MsrData);
-  if (!ReadKeyBlocking (&Key)) return;
-  Print (L"%c\n", (Key.UnicodeChar == 0) ? L'?' : Key.UnicodeChar);
-  if (Key.UnicodeChar != L'Y' && Key.UnicodeChar != L'y') {
-    Print (L"Canceled.\n"); WaitAnyKey (); return;
-  }
+STATIC EFI_STATUS CliHelp (IN UINTN Argc, IN CHAR16 **Argv);
 
-  if (SafeWriteMsr (MsrIndex, MsrData)) {
-    Print (L"Write executed successfully.\n");
-    if (SafeReadMsr(MsrIndex, &MsrData)) {
-      Print (L"ReadBack  : %016lx\n", MsrData);
-    }
-  } else {
-    Print (L"[ERROR] #GP Fault! Cannot write to MSR 0x%08x (Reserved or Read-Only).\n", MsrIndex);
-  }
-  WaitAnyKey ();
+STATIC CONST CLI_COMMAND mCliCommands[] = {
+  { L"cpuid",   0, 2, CliCpuid,   L"cpuid [leaf [subleaf]]    live CPUID query, or dump all leaves" },
+  { L"rdmsr",   1, CLI_MAX_ARGS - 1, CliRdmsr, L"rdmsr <index> [index ...]" },
+  { L"dumpmsr", 2, 2, CliDumpMsr, L"dumpmsr <start> <end>" },
+  { L"wrmsr",   2, 2, CliWrmsr,   L"wrmsr <index> <value>     writes without confirmation" },
+  { L"mtrr",    0, 0, CliMtrr,    L"mtrr" },
+  { L"export",  1, 3, CliExport,  L"export <csv|json> [start end]  CPUID/MSR/MTRR capture to the ESP" },
+  { L"script",  1, 1, CliScript,  L"script <file>             one command per line, '#' comments" },
+  { L"help",    0, 0, CliHelp,    L"help" }
+};
+
+STATIC EFI_STATUS CliHelp (IN UINTN Argc, IN CHAR16 **Argv) {
+  UINTN I;
+  Print (L"Usage: CpuId.efi [command [args]]   (no command = interactive menu)\n");
+  Print (L"Values are hex, 0x prefix optional.\n");
+  for (I = 0; I < ARRAY_SIZE (mCliCommands); I++) Print (L"  %s\n", mCliCommands[I].Usage);
+  return EFI_SUCCESS;
 }
 
-STATIC VOID DoDumpMtrr (VOID) {
-  UINT64 MtrrDefType, MtrrCap;
-  UINT8  DefaultType, Vcnt, PhysAddrBits;
-  ShowHeaderAndMenu (MenuDumpMtrr);
+STATIC EFI_STATUS CliDispatch (IN UINTN Argc, IN CHAR16 **Argv) {
+  UINTN I;
 
-  if (!CpuSupportsMsr () || !CpuSupportsMtrr ()) {
-    Print (L"[ERROR] CPU does not support MSR/MTRR.\n"); WaitAnyKey (); return;
+  for (I = 0; I < ARRAY_SIZE (mCliCommands); I++) {
+    if (StrCmp (Argv[0], mCliCommands[I].Name) != 0) continue;
+    if (Argc - 1 < mCliCommands[I].MinArgs || Argc - 1 > mCliCommands[I].MaxArgs) {
+      Print (L"Usage: %s\n", mCliCommands[I].Usage);
+      return EFI_INVALID_PARAMETER;
+    }
+    return mCliCommands[I].Handler (Argc, Argv);
   }
+  Print (L"[ERROR] Unknown command '%s'.\n", Argv[0]);
+  CliHelp (0, NULL);
+  return EFI_INVALID_PARAMETER;
+}
 
-  if (!SafeReadMsr (MSR_IA32_MTRR_DEF_TYPE, &MtrrDefType) || !SafeReadMsr (MSR_IA32_MTRRCAP, &MtrrCap)) {
-    Print (L"[ERROR] Failed to read base MTRR registers.\n"); WaitAnyKey (); return;
-  }
+//
+// Splits Line in place on blanks; CR and anything after '#' are ignored.
+//
+STATIC EFI_STATUS CliRunLine (IN CHAR16 *Line) {
+  CHAR16 *Argv[CLI_MAX_ARGS];
+  UINTN  Argc = 0;
 
-  DefaultType  = (UINT8)(MtrrDefType & IA32_MTRR_DEF_TYPE_TYPE_MASK);
-  Vcnt         = (UINT8)(MtrrCap & IA32_MTRRCAP_VCNT_MASK);
-  PhysAddrBits = GetPhysicalAddressBits ();
+  while (*Line != L'\0' && *Line != L'#') {
+    if (*Line == L' ' || *Line == L'\t' || *Line == L'\r') {
+      *Line++ = L'\0';
+      continue;
+    }
+    if (Argc == CLI_MAX_ARGS) {
+      Print (L"[ERROR] More than %d arguments.\n", CLI_MAX_ARGS - 1);
+      return EFI_INVALID_PARAMETER;
+    }
+    Argv[Argc++] = Line;
+    while (*Line != L'\0' && *Line != L'#' && *Line != L' ' && *Line != L'\t' && *Line != L'\r') Line++;
+  }
+  *Line = L'\0';
+  if (Argc == 0) return EFI_SUCCESS;
+  return CliDispatch (Argc, Argv);
+}
 
-  Print (L"\n=== [ MTRR Summary ] ===\n");
-  Print (L"MTRRCAP   (0xFE)  : %016lx   VCNT=%d  FIX=%d\n", MtrrCap, (UINT32)Vcnt, (MtrrCap & IA32_MTRRCAP_FIX_BIT) ? 1 : 0);
-  Print (L"DEF_TYPE  (0x2FF) : %016lx   E=%d  FE=%d  Default=%s\n", MtrrDefType, 
-         (MtrrDefType & IA32_MTRR_DEF_TYPE_E_BIT)  ? 1 : 0, 
-         (MtrrDefType & IA32_MTRR_DEF_TYPE_FE_BIT) ? 1 : 0, 
-         MtrrTypeToStr (DefaultType));
-  Print (L"PhysAddrBits      : %d\n\n", (UINT32)PhysAddrBits);
+//
+// TRUE when started from the shell with arguments; the command's status becomes
+// the image exit status (%lasterror% in the shell).
+//
+STATIC BOOLEAN CliRun (IN EFI_HANDLE ImageHandle, OUT EFI_STATUS *Status) {
+  EFI_SHELL_PARAMETERS_PROTOCOL *Params;
 
-  DumpMtrrUiLikePhoto_VariableRanges ();
-  DumpMtrrUiLikePhoto_FixedRanges ();
-  WaitAnyKey ();
+  if (EFI_ERROR (gBS->HandleProtocol (ImageHandle, &gEfiShellParametersProtocolGuid, (VOID **)&Params)) ||
+      Params->Argc < 2) {
+    return FALSE;
+  }
+  gBS->LocateProtocol (&gEfiShellProtocolGuid, NULL, (VOID **)&mShell);
+  mBatchMode = TRUE;
+  *Status    = CliDispatch (Params->Argc - 1, Params->Argv + 1);
+  return TRUE;
 }
 
 //
@@ -692,8 +6844,25 @@ STATIC VOID RunMainMenu (VOID) {
         case MenuDumpMsr:    DoDumpMsr (); break;
         case MenuWriteMsr:   DoWriteMsr (); break;
         case MenuDumpMtrr:   DoDumpMtrr (); break;
+        case MenuPerCoreMsr: DoPerCoreMsr (); break;
+        case MenuParallelMsrScan: DoParallelMsrScan (); break;
+        case MenuVmExitBench: DoVmExitBench (); break;
+        case MenuMtrrMap:    DoMtrrMemoryMap (); break;
+        case MenuMtrrAudit:  DoMtrrAudit (); break;
+        case MenuMtrrPlanner: DoMtrrPlanner (); break;
+        case MenuPatResolve: DoPatResolve (); break;
+        case MenuPageWalk:   DoPageWalk (); break;
+        case MenuCpuidMsrBench: DoCpuidMsrBench (); break;
+        case MenuMemBench:   DoMemBench (); break;
+        case MenuCacheProbe: DoCacheProbe (); break;
+        case MenuPmuSession: DoPmuSession (); break;
+        case MenuFreqSampler: DoFreqSampler (); break;
+        case MenuTelemetry:  DoTelemetry (); break;
+        case MenuMsrWatch:   DoMsrWatch (); break;
+        case MenuExportCapture: DoExportCapture (); break;
         default:             break;
       }
+      ScreenInvalidate ();
       continue;
     }
 
@@ -713,13 +6882,35 @@ UefiMain (
   IN EFI_SYSTEM_TABLE  *SystemTable
   )
 {
+  EFI_STATUS Status;
+
   gST->ConIn->Reset (gST->ConIn, FALSE);
   
-  // Locate CPU Protocol for Exception Handling
+  // Locate CPU Protocol and install the probe fixup handler once for the whole run
   gBS->LocateProtocol (&gEfiCpuArchProtocolGuid, NULL, (VOID **)&mCpu);
+  ProbeFaultHandlerInstall ();
+
+  // Execute CPUID once up front; feature checks and dumps read the database
+  CpuidDbBuild ();
+
+  // MP Services is optional: without it per-core features run on the BSP only
+  gBS->LocateProtocol (&gEfiMpServiceProtocolGuid, NULL, (VOID **)&mMp);
+
+  // Shell arguments run one command (or a script) and exit without the menu
+  if (CliRun (ImageHandle, &Status)) {
+    ProbeFaultHandlerUninstall ();
+    return Status;
+  }
+
+  // Size the off-screen renderer and page height from the active text mode
+  ScreenInit ();
 
   RunMainMenu ();
 
+  ScreenFree ();
+
+  ProbeFaultHandlerUninstall ();
+
   ClearScreenAndResetAttr ();
   Print (L"CpuMsrMtrrApp exit.\n");
   return EFI_SUCCESS;
@@ -0,0 +1,19 @@
+/** @file MemBench.h
+  Memory access kernels for the throughput / latency benchmarks.
+
+  The loops live in MemBench.nasm so that exactly the intended loads and
+  stores are timed; the compiler can neither vectorise nor drop them.
+  Buffers must be 64-byte aligned and Bytes a multiple of 64.
+**/
+
+#ifndef MEM_BENCH_H_
+#define MEM_BENCH_H_
+
+#define MEM_BENCH_LINE               64
+
+UINT64 EFIAPI MemBenchRead    (IN CONST VOID *Buffer, IN UINTN Bytes);
+VOID   EFIAPI MemBenchWrite   (OUT VOID *Buffer, IN UINTN Bytes, IN UINT64 Value);
+VOID   EFIAPI MemBenchCopyNt  (OUT VOID *Destination, IN CONST VOID *Source, IN UINTN Bytes);
+VOID * EFIAPI MemBenchChase   (IN VOID *Start, IN UINTN Steps);
+
+#endif
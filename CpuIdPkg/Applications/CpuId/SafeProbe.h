@@ -0,0 +1,47 @@
+/** @file SafeProbe.h
+  Fault-tolerant probes for privileged instructions and memory reads.
+
+  Every probe is a tiny assembly routine whose faulting instruction is
+  listed in mProbeFixupTable together with a recovery address. One
+  exception handler (ProbeFaultHandler in CpuId.c) is registered for
+  #UD/#GP/#PF at startup; when the faulting RIP is in the table it resumes
+  at the recovery address with a PROBE_FAULT status in RAX, so a faulting
+  probe simply returns an error instead of hanging the machine. A fault
+  outside the table is a real crash: the handler prints the register dump
+  (DumpCpuContext) and halts.
+**/
+
+#ifndef SAFE_PROBE_H_
+#define SAFE_PROBE_H_
+
+#define PROBE_OK                     0x000
+#define PROBE_NO_DATA                0x001     // e.g. rdrand returned CF=0
+#define PROBE_BAD_INDEX              0x002     // unsupported CR/DR number
+#define PROBE_FAULT_FLAG             0x100     // low byte = exception vector
+
+#define PROBE_IS_FAULT(Status)       (((Status) & PROBE_FAULT_FLAG) != 0)
+#define PROBE_FAULT_VECTOR(Status)   ((UINT8)(Status))
+
+typedef struct {
+  UINTN FaultIp;
+  UINTN FixupIp;
+} PROBE_FIXUP_ENTRY;
+
+//
+// Bounds of the fixup table emitted by SafeProbe.nasm (in address order).
+//
+extern PROBE_FIXUP_ENTRY  mProbeFixupTable[];
+extern PROBE_FIXUP_ENTRY  mProbeFixupTableEnd[];
+
+UINTN EFIAPI ProbeReadMsr    (IN UINT32 Index, OUT UINT64 *Value);
+UINTN EFIAPI ProbeWriteMsr   (IN UINT32 Index, IN UINT64 Value);
+UINTN EFIAPI ProbeReadPmc    (IN UINT32 Counter, OUT UINT64 *Value);
+UINTN EFIAPI ProbeXGetBv     (IN UINT32 Index, OUT UINT64 *Value);
+UINTN EFIAPI ProbeRdtscp     (OUT UINT64 *Tsc, OUT UINT32 *Aux);
+UINTN EFIAPI ProbeRdRand64   (OUT UINT64 *Value);
+UINTN EFIAPI ProbeReadCr     (IN UINT32 Index, OUT UINT64 *Value);
+UINTN EFIAPI ProbeReadDr     (IN UINT32 Index, OUT UINT64 *Value);
+UINTN EFIAPI ProbeMemRead32  (IN UINTN Address, OUT UINT32 *Value);
+UINTN EFIAPI ProbeMemRead64  (IN UINTN Address, OUT UINT64 *Value);
+
+#endif